@@ -0,0 +1,627 @@
+#include "bcache.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BCACHE_SHARDS (64)
+#define FRAME_NONE (SIZE_MAX)
+#define PREFETCH_QUEUE (256)
+#define PREFETCH_CHUNK (1 << 20)
+
+/*
+ * A cached block
+ * f_next : next frame in the same hash chain
+ * f_referenced : used since the CLOCK hand last passed
+ */
+typedef struct {
+    uint64_t f_block;
+    size_t f_next;
+    bool f_valid;
+    bool f_dirty;
+    bool f_referenced;
+} frame_t;
+
+/*
+ * A shard: the frames of the blocks hashing to it, their contents and the
+ * hash chains over them, all under s_mutex
+ * s_written : bumped whenever a block goes back to the device or is freed,
+ *             so a prefetch that read the device before that can tell its
+ *             copy may be stale
+ */
+typedef struct {
+    pthread_mutex_t s_mutex;
+    frame_t *s_frames;
+    char *s_data;
+    size_t *s_buckets;
+    size_t s_frame_count;
+    size_t s_bucket_mask;
+    size_t s_hand;
+    size_t s_dirty;
+    uint64_t s_written;
+} shard_t;
+
+/* A run of blocks to read ahead */
+typedef struct {
+    uint64_t p_block;
+    size_t p_count;
+} prefetch_t;
+
+/*
+ * Buffer cache
+ * queue : runs waiting for the prefetch thread (a ring, requests that do
+ *         not fit are dropped), under queue_mutex
+ */
+typedef struct {
+    block_device_t *device;
+    size_t block_size;
+    unsigned int block_shift;
+    shard_t shards[BCACHE_SHARDS];
+    prefetch_t queue[PREFETCH_QUEUE];
+    size_t queue_head;
+    size_t queue_length;
+    bool stopping;
+    pthread_t prefetcher;
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond;
+} bcache_t;
+
+static bcache_t bcache_s;
+
+/* Mixes the bits of a block number, so neighbours go to different shards */
+static uint64_t block_hash(uint64_t block) {
+    block ^= block >> 33;
+    block *= 0xff51afd7ed558ccdULL;
+    block ^= block >> 33;
+
+    return block;
+}
+
+static shard_t *block_shard(uint64_t block) {
+    return &bcache_s.shards[block_hash(block) % BCACHE_SHARDS];
+}
+
+static size_t *shard_bucket(shard_t *shard, uint64_t block) {
+    return &shard->s_buckets[(block_hash(block) / BCACHE_SHARDS) & shard->s_bucket_mask];
+}
+
+static char *frame_data(shard_t *shard, size_t frame) {
+    return shard->s_data + (frame << bcache_s.block_shift);
+}
+
+static size_t shard_find(shard_t *shard, uint64_t block) {
+    size_t frame = *shard_bucket(shard, block);
+
+    while (frame != FRAME_NONE && shard->s_frames[frame].f_block != block) {
+        frame = shard->s_frames[frame].f_next;
+    }
+
+    return frame;
+}
+
+/* Takes a frame out of its hash chain and marks it unused */
+static void shard_unlink(shard_t *shard, size_t frame) {
+    size_t *link = shard_bucket(shard, shard->s_frames[frame].f_block);
+
+    while (*link != frame) {
+        link = &shard->s_frames[*link].f_next;
+    }
+
+    *link = shard->s_frames[frame].f_next;
+
+    if (shard->s_frames[frame].f_dirty) {
+        shard->s_dirty--;
+    }
+
+    shard->s_frames[frame].f_valid = false;
+    shard->s_frames[frame].f_dirty = false;
+}
+
+static int frame_write_back(shard_t *shard, size_t frame) {
+    frame_t *entry = &shard->s_frames[frame];
+
+    if (bdev_write(bcache_s.device, entry->f_block << bcache_s.block_shift, frame_data(shard, frame),
+                   bcache_s.block_size) == -1) {
+        return -1;
+    }
+
+    entry->f_dirty = false;
+    shard->s_dirty--;
+    shard->s_written++;
+
+    return 0;
+}
+
+/*
+ * Picks a frame to reuse with the CLOCK hand: unused frames first, then the
+ * first one not referenced since the hand last passed it. A dirty victim is
+ * written back before it is given out, unless write_back is false, in which
+ * case dirty frames are passed over (and no frame may be found).
+ * Returns: the frame, unused, or FRAME_NONE if there is none or the write
+ * back failed
+ */
+static size_t shard_victim(shard_t *shard, bool write_back) {
+    for (size_t step = 0; write_back || step < 2 * shard->s_frame_count; step++) {
+        size_t frame = shard->s_hand;
+        frame_t *entry = &shard->s_frames[frame];
+
+        shard->s_hand = (shard->s_hand + 1) % shard->s_frame_count;
+
+        if (!entry->f_valid) {
+            return frame;
+        }
+
+        if (entry->f_referenced) {
+            entry->f_referenced = false;
+            continue;
+        }
+
+        if (entry->f_dirty && !write_back) {
+            continue;
+        }
+
+        if (entry->f_dirty && frame_write_back(shard, frame) == -1) {
+            return FRAME_NONE;
+        }
+
+        shard_unlink(shard, frame);
+
+        return frame;
+    }
+
+    return FRAME_NONE;
+}
+
+/* Puts an unused frame in the hash chain of a block */
+static void shard_insert(shard_t *shard, size_t frame, uint64_t block, bool referenced) {
+    size_t *bucket = shard_bucket(shard, block);
+    frame_t *entry = &shard->s_frames[frame];
+
+    entry->f_block = block;
+    entry->f_next = *bucket;
+    entry->f_valid = true;
+    entry->f_dirty = false;
+    entry->f_referenced = referenced;
+    *bucket = frame;
+}
+
+/*
+ * Finds the frame caching a block, loading it on a miss
+ * Must be called with the shard's mutex held.
+ * Inputs:
+ *  - shard, block
+ *  - fill: whether a missing block must be read (false when the caller is
+ *    about to overwrite all of it)
+ *  - missed: incremented when the block was not cached
+ * Returns: the frame, FRAME_NONE on error
+ */
+static size_t shard_get(shard_t *shard, uint64_t block, bool fill, int *missed) {
+    size_t frame = shard_find(shard, block);
+
+    if (frame != FRAME_NONE) {
+        shard->s_frames[frame].f_referenced = true;
+        return frame;
+    }
+
+    (*missed)++;
+    frame = shard_victim(shard, true);
+
+    if (frame == FRAME_NONE ||
+        (fill && bdev_read(bcache_s.device, block << bcache_s.block_shift, frame_data(shard, frame),
+                           bcache_s.block_size) == -1)) {
+        return FRAME_NONE;
+    }
+
+    shard_insert(shard, frame, block, true);
+
+    return frame;
+}
+
+static bool block_cached(uint64_t block) {
+    shard_t *shard = block_shard(block);
+
+    pthread_mutex_lock(&shard->s_mutex);
+
+    bool cached = shard_find(shard, block) != FRAME_NONE;
+
+    pthread_mutex_unlock(&shard->s_mutex);
+
+    return cached;
+}
+
+/*
+ * Reads a run of blocks that are not cached with one device read and
+ * caches them, unreferenced, so CLOCK takes them first if they go unused.
+ * A block is skipped if it got cached meanwhile, or if its shard wrote a
+ * block back or freed one since the read began (the copy may be stale);
+ * only clean frames are reused, so the prefetch never writes back itself.
+ */
+static void prefetch_run(char *buffer, uint64_t block, size_t count) {
+    uint64_t written[BCACHE_SHARDS];
+
+    for (size_t i = 0; i < BCACHE_SHARDS; i++) {
+        pthread_mutex_lock(&bcache_s.shards[i].s_mutex);
+        written[i] = bcache_s.shards[i].s_written;
+        pthread_mutex_unlock(&bcache_s.shards[i].s_mutex);
+    }
+
+    if (bdev_read(bcache_s.device, block << bcache_s.block_shift, buffer, count << bcache_s.block_shift) == -1) {
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        shard_t *shard = block_shard(block + i);
+
+        pthread_mutex_lock(&shard->s_mutex);
+
+        if (shard->s_written == written[shard - bcache_s.shards] && shard_find(shard, block + i) == FRAME_NONE) {
+            size_t frame = shard_victim(shard, false);
+
+            if (frame != FRAME_NONE) {
+                memcpy(frame_data(shard, frame), buffer + (i << bcache_s.block_shift), bcache_s.block_size);
+                shard_insert(shard, frame, block + i, false);
+            }
+        }
+
+        pthread_mutex_unlock(&shard->s_mutex);
+    }
+}
+
+/* Prefetch thread: reads the queued runs, skipping blocks already cached */
+static void *prefetcher(void *arg) {
+    (void)arg;
+
+    size_t chunk = PREFETCH_CHUNK > bcache_s.block_size ? PREFETCH_CHUNK >> bcache_s.block_shift : 1;
+    void *buffer = NULL;
+
+    if (posix_memalign(&buffer, BDEV_DIRECT_ALIGN, chunk << bcache_s.block_shift) != 0) {
+        printf("[ prefetcher ] Error : out of memory\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&bcache_s.queue_mutex);
+
+    for (;;) {
+        while (bcache_s.queue_length == 0 && !bcache_s.stopping) {
+            pthread_cond_wait(&bcache_s.queue_cond, &bcache_s.queue_mutex);
+        }
+
+        if (bcache_s.stopping) {
+            break;
+        }
+
+        prefetch_t request = bcache_s.queue[bcache_s.queue_head];
+
+        bcache_s.queue_head = (bcache_s.queue_head + 1) % PREFETCH_QUEUE;
+        bcache_s.queue_length--;
+
+        pthread_mutex_unlock(&bcache_s.queue_mutex);
+
+        uint64_t block = request.p_block;
+        uint64_t end = request.p_block + request.p_count;
+
+        while (block < end) {
+            while (block < end && block_cached(block)) {
+                block++;
+            }
+
+            size_t count = 0;
+
+            while (block + count < end && count < chunk && !block_cached(block + count)) {
+                count++;
+            }
+
+            if (count > 0) {
+                prefetch_run((char *)buffer, block, count);
+            }
+
+            block += count;
+        }
+
+        pthread_mutex_lock(&bcache_s.queue_mutex);
+    }
+
+    pthread_mutex_unlock(&bcache_s.queue_mutex);
+    free(buffer);
+
+    return NULL;
+}
+
+static void shard_free(shard_t *shard) {
+    free(shard->s_frames);
+    free(shard->s_data);
+    free(shard->s_buckets);
+    shard->s_frames = NULL;
+    shard->s_data = NULL;
+    shard->s_buckets = NULL;
+}
+
+/*
+ * Starts an empty cache in front of a device
+ * Inputs:
+ *  - device
+ *  - block_size: size of a cached block, a power of two
+ *  - budget: bytes of block contents the cache may keep (at least one
+ *    block per shard is kept)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int bcache_init(block_device_t *device, size_t block_size, size_t budget) {
+    size_t frames = (budget / block_size + BCACHE_SHARDS - 1) / BCACHE_SHARDS;
+    size_t buckets = 1;
+
+    if (frames == 0) {
+        frames = 1;
+    }
+
+    while (buckets < frames) {
+        buckets <<= 1;
+    }
+
+    bcache_s.device = device;
+    bcache_s.block_size = block_size;
+    bcache_s.block_shift = (unsigned int)__builtin_ctzll(block_size);
+
+    for (size_t i = 0; i < BCACHE_SHARDS; i++) {
+        shard_t *shard = &bcache_s.shards[i];
+        void *data = NULL;
+
+        shard->s_frames = calloc(frames, sizeof(frame_t));
+        shard->s_buckets = malloc(buckets * sizeof(size_t));
+        shard->s_data = posix_memalign(&data, BDEV_DIRECT_ALIGN, frames * block_size) == 0 ? data : NULL;
+        shard->s_frame_count = frames;
+        shard->s_bucket_mask = buckets - 1;
+        shard->s_hand = 0;
+        shard->s_dirty = 0;
+        shard->s_written = 0;
+
+        if (shard->s_frames == NULL || shard->s_buckets == NULL || shard->s_data == NULL) {
+            printf("[ bcache_init ] Error : out of memory\n");
+
+            for (size_t j = 0; j <= i; j++) {
+                shard_free(&bcache_s.shards[j]);
+            }
+
+            return -1;
+        }
+
+        for (size_t b = 0; b < buckets; b++) {
+            shard->s_buckets[b] = FRAME_NONE;
+        }
+
+        pthread_mutex_init(&shard->s_mutex, NULL);
+    }
+
+    bcache_s.queue_head = 0;
+    bcache_s.queue_length = 0;
+    bcache_s.stopping = false;
+    pthread_mutex_init(&bcache_s.queue_mutex, NULL);
+    pthread_cond_init(&bcache_s.queue_cond, NULL);
+
+    if (pthread_create(&bcache_s.prefetcher, NULL, prefetcher, NULL) != 0) {
+        printf("[ bcache_init ] Error : could not start the prefetch thread\n");
+        bcache_s.stopping = true;
+        bcache_destroy();
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Stops the prefetch thread, writes every dirty block back and frees the cache */
+void bcache_destroy() {
+    if (!bcache_s.stopping) {
+        pthread_mutex_lock(&bcache_s.queue_mutex);
+        bcache_s.stopping = true;
+        pthread_cond_broadcast(&bcache_s.queue_cond);
+        pthread_mutex_unlock(&bcache_s.queue_mutex);
+        pthread_join(bcache_s.prefetcher, NULL);
+    }
+
+    pthread_mutex_destroy(&bcache_s.queue_mutex);
+    pthread_cond_destroy(&bcache_s.queue_cond);
+    bcache_flush();
+
+    for (size_t i = 0; i < BCACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&bcache_s.shards[i].s_mutex);
+        shard_free(&bcache_s.shards[i]);
+    }
+}
+
+/*
+ * Reads a range of the device, serving cached blocks from memory
+ * Returns: how many blocks had to be read from the device, -1 on error
+ */
+int bcache_read(uint64_t offset, void *buffer, size_t length) {
+    int missed = 0;
+    size_t done = 0;
+
+    while (done < length) {
+        uint64_t block = offset >> bcache_s.block_shift;
+        size_t in_block = (size_t)(offset & (bcache_s.block_size - 1));
+        size_t chunk = bcache_s.block_size - in_block;
+        shard_t *shard = block_shard(block);
+
+        if (chunk > length - done) {
+            chunk = length - done;
+        }
+
+        pthread_mutex_lock(&shard->s_mutex);
+
+        size_t frame = shard_get(shard, block, true, &missed);
+
+        if (frame != FRAME_NONE) {
+            memcpy((char *)buffer + done, frame_data(shard, frame) + in_block, chunk);
+        }
+
+        pthread_mutex_unlock(&shard->s_mutex);
+
+        if (frame == FRAME_NONE) {
+            return -1;
+        }
+
+        offset += chunk;
+        done += chunk;
+    }
+
+    return missed;
+}
+
+/*
+ * Writes a range of the device into the cache; the blocks are only marked
+ * dirty. Whole blocks are not read first.
+ * Inputs:
+ *  - offset, length: the range
+ *  - buffer: its new contents, NULL to fill it with zeros
+ * Returns: how many blocks had to be read from the device, -1 on error
+ */
+int bcache_write(uint64_t offset, void const *buffer, size_t length) {
+    int missed = 0;
+    size_t done = 0;
+
+    while (done < length) {
+        uint64_t block = offset >> bcache_s.block_shift;
+        size_t in_block = (size_t)(offset & (bcache_s.block_size - 1));
+        size_t chunk = bcache_s.block_size - in_block;
+        shard_t *shard = block_shard(block);
+
+        if (chunk > length - done) {
+            chunk = length - done;
+        }
+
+        pthread_mutex_lock(&shard->s_mutex);
+
+        size_t frame = shard_get(shard, block, chunk < bcache_s.block_size, &missed);
+
+        if (frame != FRAME_NONE) {
+            char *target = frame_data(shard, frame) + in_block;
+
+            if (buffer == NULL) {
+                memset(target, 0, chunk);
+            } else {
+                memcpy(target, (char const *)buffer + done, chunk);
+            }
+
+            if (!shard->s_frames[frame].f_dirty) {
+                shard->s_frames[frame].f_dirty = true;
+                shard->s_dirty++;
+            }
+        }
+
+        pthread_mutex_unlock(&shard->s_mutex);
+
+        if (frame == FRAME_NONE) {
+            return -1;
+        }
+
+        offset += chunk;
+        done += chunk;
+    }
+
+    return missed;
+}
+
+/*
+ * Writes every dirty block back to the device (without syncing it)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int bcache_flush() {
+    int result = 0;
+
+    for (size_t i = 0; i < BCACHE_SHARDS; i++) {
+        shard_t *shard = &bcache_s.shards[i];
+
+        pthread_mutex_lock(&shard->s_mutex);
+
+        for (size_t frame = 0; shard->s_dirty > 0 && frame < shard->s_frame_count; frame++) {
+            if (shard->s_frames[frame].f_valid && shard->s_frames[frame].f_dirty &&
+                frame_write_back(shard, frame) == -1) {
+                result = -1;
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&shard->s_mutex);
+    }
+
+    return result;
+}
+
+/*
+ * Drops a run of blocks from the cache, writing the dirty ones back first
+ * if write_back is set
+ */
+static void bcache_drop(uint64_t block, size_t count, bool write_back) {
+
+    /* a run longer than the cache is cheaper to check frame by frame */
+    if (count > bcache_s.shards[0].s_frame_count * BCACHE_SHARDS) {
+        for (size_t i = 0; i < BCACHE_SHARDS; i++) {
+            shard_t *shard = &bcache_s.shards[i];
+
+            pthread_mutex_lock(&shard->s_mutex);
+
+            for (size_t frame = 0; frame < shard->s_frame_count; frame++) {
+                frame_t *entry = &shard->s_frames[frame];
+
+                if (entry->f_valid && entry->f_block >= block && entry->f_block < block + count &&
+                    (!write_back || !entry->f_dirty || frame_write_back(shard, frame) == 0)) {
+                    shard_unlink(shard, frame);
+                    shard->s_written++;
+                }
+            }
+
+            pthread_mutex_unlock(&shard->s_mutex);
+        }
+
+        return;
+    }
+
+    for (uint64_t b = block; b < block + count; b++) {
+        shard_t *shard = block_shard(b);
+
+        pthread_mutex_lock(&shard->s_mutex);
+
+        size_t frame = shard_find(shard, b);
+
+        if (frame != FRAME_NONE &&
+            (!write_back || !shard->s_frames[frame].f_dirty || frame_write_back(shard, frame) == 0)) {
+            shard_unlink(shard, frame);
+            shard->s_written++;
+        }
+
+        pthread_mutex_unlock(&shard->s_mutex);
+    }
+}
+
+/*
+ * Drops a run of blocks that were freed, dirty or not
+ */
+void bcache_invalidate(uint64_t block, size_t count) {
+    bcache_drop(block, count, false);
+}
+
+/*
+ * Drops a run of blocks that will not be needed soon, writing the dirty
+ * ones back (a block whose write back fails stays cached)
+ */
+void bcache_release(uint64_t block, size_t count) {
+    bcache_drop(block, count, true);
+}
+
+/*
+ * Asks the prefetch thread to read a run of blocks into the cache; returns
+ * at once, and the request is dropped if too many are waiting
+ */
+void bcache_prefetch(uint64_t block, size_t count) {
+    pthread_mutex_lock(&bcache_s.queue_mutex);
+
+    if (bcache_s.queue_length < PREFETCH_QUEUE) {
+        prefetch_t request = {block, count};
+
+        bcache_s.queue[(bcache_s.queue_head + bcache_s.queue_length) % PREFETCH_QUEUE] = request;
+        bcache_s.queue_length++;
+        pthread_cond_signal(&bcache_s.queue_cond);
+    }
+
+    pthread_mutex_unlock(&bcache_s.queue_mutex);
+}
@@ -0,0 +1,30 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "bdev.h"
+
+/*
+ * Buffer cache
+ * Keeps recently used data blocks of a block device in memory, within a
+ * fixed budget. Blocks hash to one of BCACHE_SHARDS shards, each with its
+ * own lock, hash table and frames, and a CLOCK hand picks the frame to
+ * reuse in each shard. Writes only change the cached copy and mark it
+ * dirty; dirty blocks reach the device when their frame is reused or on
+ * bcache_flush, which runs before every journal commit so file data is on
+ * disk before the metadata that points to it.
+ * A prefetch thread reads runs of blocks ahead of sequential readers
+ * (bcache_prefetch) with one device read per run.
+ * Offsets and lengths are in bytes from the first data block.
+ */
+
+int bcache_init(block_device_t *device, size_t block_size, size_t budget);
+void bcache_destroy();
+
+int bcache_read(uint64_t offset, void *buffer, size_t length);
+int bcache_write(uint64_t offset, void const *buffer, size_t length);
+int bcache_flush();
+void bcache_invalidate(uint64_t block, size_t count);
+void bcache_release(uint64_t block, size_t count);
+void bcache_prefetch(uint64_t block, size_t count);
+
+#endif // BCACHE_H
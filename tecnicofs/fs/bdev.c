@@ -0,0 +1,512 @@
+#define _GNU_SOURCE
+#include "bdev.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define BDEV_STRIPES (64)
+#define BDEV_BOUNCE_SIZE (1 << 20)
+#define BDEV_ZERO_SIZE (1 << 16)
+
+typedef struct {
+    int (*read)(block_device_t *device, uint64_t offset, void *buffer, size_t length);
+    int (*write)(block_device_t *device, uint64_t offset, void const *buffer, size_t length);
+    int (*flush)(block_device_t *device);
+    void (*discard)(block_device_t *device, uint64_t offset, size_t length);
+    void *(*map)(block_device_t *device, uint64_t offset);
+    void (*advise)(block_device_t *device, uint64_t offset, size_t length, bdev_advice_t advice);
+} bdev_ops_t;
+
+/*
+ * Block device
+ * bd_base : the memory (BDEV_MEMORY) or mapping (BDEV_MMAP) holding the blocks
+ * bd_fd : the image file; BDEV_DIRECT opens its own, which it closes
+ * bd_start : where the device starts in that file
+ * bd_stripes : serialize the read-modify-write cycles of BDEV_DIRECT on the
+ *              same aligned unit
+ */
+struct block_device {
+    bdev_ops_t const *bd_ops;
+    bdev_type_t bd_type;
+    uint64_t bd_size;
+    char *bd_base;
+    int bd_fd;
+    uint64_t bd_start;
+    pthread_mutex_t bd_stripes[BDEV_STRIPES];
+};
+
+static char const zeros[BDEV_ZERO_SIZE];
+
+/* BDEV_MEMORY and BDEV_MMAP: the blocks are memory */
+
+static int memory_read(block_device_t *device, uint64_t offset, void *buffer, size_t length) {
+    memcpy(buffer, device->bd_base + offset, length);
+    return 0;
+}
+
+static int memory_write(block_device_t *device, uint64_t offset, void const *buffer, size_t length) {
+    memcpy(device->bd_base + offset, buffer, length);
+    return 0;
+}
+
+static int memory_flush(block_device_t *device) {
+    (void)device;
+    return 0;
+}
+
+/* the range must be page aligned; failing only means the memory stays in use */
+static void memory_discard(block_device_t *device, uint64_t offset, size_t length) {
+    madvise(device->bd_base + offset, length, MADV_DONTNEED);
+}
+
+static void *memory_map(block_device_t *device, uint64_t offset) {
+    return device->bd_base + offset;
+}
+
+static void memory_advise(block_device_t *device, uint64_t offset, size_t length, bdev_advice_t advice) {
+    (void)device;
+    (void)offset;
+    (void)length;
+    (void)advice;
+}
+
+static int mmap_flush(block_device_t *device) {
+    if (msync(device->bd_base, device->bd_size, MS_SYNC) == -1) {
+        printf("[ mmap_flush ] Error : %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* changes to the mapping reach the file by themselves, so it is not handed out */
+static void *mmap_map(block_device_t *device, uint64_t offset) {
+    (void)device;
+    (void)offset;
+    return NULL;
+}
+
+/* madvise wants a page aligned start, so the range is widened down to one;
+ * dropping mapped pages leaves them in the file's page cache */
+static void mmap_advise(block_device_t *device, uint64_t offset, size_t length, bdev_advice_t advice) {
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset / page_size * page_size;
+
+    madvise(device->bd_base + start, length + (size_t)(offset - start),
+            advice == BDEV_WILLNEED ? MADV_WILLNEED : MADV_DONTNEED);
+}
+
+/* BDEV_PREAD and BDEV_DIRECT: the blocks are a range of a file */
+
+static int file_pread(int fd, void *buffer, size_t length, uint64_t position) {
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t read_now = pread(fd, (char *)buffer + done, length - done, (off_t)(position + done));
+
+        if (read_now == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (read_now <= 0) {
+            printf("[ file_pread ] Error : %s\n", read_now == 0 ? "short read" : strerror(errno));
+            return -1;
+        }
+
+        done += (size_t)read_now;
+    }
+
+    return 0;
+}
+
+static int file_pwrite(int fd, void const *buffer, size_t length, uint64_t position) {
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t written = pwrite(fd, (char const *)buffer + done, length - done, (off_t)(position + done));
+
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            printf("[ file_pwrite ] Error : %s\n", written == 0 ? "short write" : strerror(errno));
+            return -1;
+        }
+
+        done += (size_t)written;
+    }
+
+    return 0;
+}
+
+static int pread_read(block_device_t *device, uint64_t offset, void *buffer, size_t length) {
+    return file_pread(device->bd_fd, buffer, length, device->bd_start + offset);
+}
+
+static int pread_write(block_device_t *device, uint64_t offset, void const *buffer, size_t length) {
+    return file_pwrite(device->bd_fd, buffer, length, device->bd_start + offset);
+}
+
+static int file_flush(block_device_t *device) {
+    if (fdatasync(device->bd_fd) == -1) {
+        printf("[ file_flush ] Error : %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* only drops the cached pages; the file keeps its contents */
+static void file_discard(block_device_t *device, uint64_t offset, size_t length) {
+    posix_fadvise(device->bd_fd, (off_t)(device->bd_start + offset), (off_t)length, POSIX_FADV_DONTNEED);
+}
+
+static void *file_map(block_device_t *device, uint64_t offset) {
+    (void)device;
+    (void)offset;
+    return NULL;
+}
+
+static void pread_advise(block_device_t *device, uint64_t offset, size_t length, bdev_advice_t advice) {
+    posix_fadvise(device->bd_fd, (off_t)(device->bd_start + offset), (off_t)length,
+                  advice == BDEV_WILLNEED ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+}
+
+/* O_DIRECT bypasses the page cache, so there is nothing to prepare */
+static void direct_advise(block_device_t *device, uint64_t offset, size_t length, bdev_advice_t advice) {
+    (void)device;
+    (void)offset;
+    (void)length;
+    (void)advice;
+}
+
+static bool direct_aligned(uint64_t offset, void const *buffer, size_t length) {
+    return offset % BDEV_DIRECT_ALIGN == 0 && length % BDEV_DIRECT_ALIGN == 0 &&
+           (uintptr_t)buffer % BDEV_DIRECT_ALIGN == 0;
+}
+
+/*
+ * Allocates a bounce buffer for a range: as large as the aligned units that
+ * cover it (at least one), up to BDEV_BOUNCE_SIZE
+ */
+static char *direct_bounce(uint64_t offset, size_t length) {
+    uint64_t unit = offset / BDEV_DIRECT_ALIGN * BDEV_DIRECT_ALIGN;
+    uint64_t unit_end = (offset + length + BDEV_DIRECT_ALIGN - 1) / BDEV_DIRECT_ALIGN * BDEV_DIRECT_ALIGN;
+    size_t size = unit_end - unit > BDEV_BOUNCE_SIZE ? BDEV_BOUNCE_SIZE : (size_t)(unit_end - unit);
+
+    if (size < BDEV_DIRECT_ALIGN) {
+        size = BDEV_DIRECT_ALIGN;
+    }
+
+    void *bounce = NULL;
+
+    if (posix_memalign(&bounce, BDEV_DIRECT_ALIGN, size) != 0) {
+        printf("[ direct_bounce ] Error : out of memory\n");
+        return NULL;
+    }
+
+    return (char *)bounce;
+}
+
+/* Reads through a bounce buffer that covers the aligned units of the range */
+static int direct_read(block_device_t *device, uint64_t offset, void *buffer, size_t length) {
+    if (direct_aligned(offset, buffer, length)) {
+        return file_pread(device->bd_fd, buffer, length, device->bd_start + offset);
+    }
+
+    uint64_t end = offset + length;
+    uint64_t unit = offset / BDEV_DIRECT_ALIGN * BDEV_DIRECT_ALIGN;
+    char *bounce = direct_bounce(offset, length);
+
+    if (bounce == NULL) {
+        return -1;
+    }
+
+    int result = 0;
+
+    while (result == 0 && unit < end) {
+        uint64_t unit_end = (end + BDEV_DIRECT_ALIGN - 1) / BDEV_DIRECT_ALIGN * BDEV_DIRECT_ALIGN;
+        size_t chunk = unit_end - unit > BDEV_BOUNCE_SIZE ? BDEV_BOUNCE_SIZE : (size_t)(unit_end - unit);
+        uint64_t from = unit > offset ? unit : offset;
+        uint64_t to = unit + chunk < end ? unit + chunk : end;
+
+        result = file_pread(device->bd_fd, bounce, chunk, device->bd_start + unit);
+
+        if (result == 0) {
+            memcpy((char *)buffer + (from - offset), bounce + (from - unit), to - from);
+        }
+
+        unit += chunk;
+    }
+
+    free(bounce);
+
+    return result;
+}
+
+/*
+ * Writes part of a single aligned unit: reads it, changes the range and
+ * writes it back, holding the unit's stripe
+ */
+static int direct_write_partial(block_device_t *device, char *bounce, uint64_t unit, uint64_t from,
+                                char const *data, size_t length) {
+    pthread_mutex_t *stripe = &device->bd_stripes[(unit / BDEV_DIRECT_ALIGN) % BDEV_STRIPES];
+
+    pthread_mutex_lock(stripe);
+
+    int result = file_pread(device->bd_fd, bounce, BDEV_DIRECT_ALIGN, device->bd_start + unit);
+
+    if (result == 0) {
+        memcpy(bounce + (from - unit), data, length);
+        result = file_pwrite(device->bd_fd, bounce, BDEV_DIRECT_ALIGN, device->bd_start + unit);
+    }
+
+    pthread_mutex_unlock(stripe);
+
+    return result;
+}
+
+/*
+ * Writes whole aligned units through a bounce buffer; a partial unit at
+ * either end is read, changed and written back
+ */
+static int direct_write(block_device_t *device, uint64_t offset, void const *buffer, size_t length) {
+    if (direct_aligned(offset, buffer, length)) {
+        return file_pwrite(device->bd_fd, buffer, length, device->bd_start + offset);
+    }
+
+    char *bounce = direct_bounce(offset, length);
+
+    if (bounce == NULL) {
+        return -1;
+    }
+
+    char const *data = (char const *)buffer;
+    uint64_t end = offset + length;
+    uint64_t position = offset;
+    int result = 0;
+
+    if (position % BDEV_DIRECT_ALIGN != 0 || end - position < BDEV_DIRECT_ALIGN) {
+        uint64_t unit = position / BDEV_DIRECT_ALIGN * BDEV_DIRECT_ALIGN;
+        uint64_t to = unit + BDEV_DIRECT_ALIGN < end ? unit + BDEV_DIRECT_ALIGN : end;
+
+        result = direct_write_partial(device, bounce, unit, position, data, to - position);
+        data += to - position;
+        position = to;
+    }
+
+    uint64_t whole_end = end / BDEV_DIRECT_ALIGN * BDEV_DIRECT_ALIGN;
+
+    while (result == 0 && position < whole_end) {
+        size_t chunk = whole_end - position > BDEV_BOUNCE_SIZE ? BDEV_BOUNCE_SIZE : (size_t)(whole_end - position);
+
+        memcpy(bounce, data, chunk);
+        result = file_pwrite(device->bd_fd, bounce, chunk, device->bd_start + position);
+        data += chunk;
+        position += chunk;
+    }
+
+    if (result == 0 && position < end) {
+        result = direct_write_partial(device, bounce, position, position, data, end - position);
+    }
+
+    free(bounce);
+
+    return result;
+}
+
+static bdev_ops_t const memory_ops = {memory_read, memory_write, memory_flush, memory_discard, memory_map,
+                                      memory_advise};
+static bdev_ops_t const mmap_ops = {memory_read, memory_write, mmap_flush, memory_discard, mmap_map, mmap_advise};
+static bdev_ops_t const pread_ops = {pread_read, pread_write, file_flush, file_discard, file_map, pread_advise};
+static bdev_ops_t const direct_ops = {direct_read, direct_write, file_flush, file_discard, file_map, direct_advise};
+
+static block_device_t *bdev_alloc(bdev_type_t type, bdev_ops_t const *ops, uint64_t size) {
+    block_device_t *device = malloc(sizeof(block_device_t));
+
+    if (device == NULL) {
+        printf("[ bdev_alloc ] Error : out of memory\n");
+        return NULL;
+    }
+
+    device->bd_ops = ops;
+    device->bd_type = type;
+    device->bd_size = size;
+    device->bd_base = NULL;
+    device->bd_fd = -1;
+    device->bd_start = 0;
+
+    for (size_t i = 0; i < BDEV_STRIPES; i++) {
+        pthread_mutex_init(&device->bd_stripes[i], NULL);
+    }
+
+    return device;
+}
+
+/*
+ * Opens a device over a region of memory, which stays owned by the caller
+ * Returns: the device, NULL on error
+ */
+block_device_t *bdev_open_memory(void *base, uint64_t size) {
+    block_device_t *device = bdev_alloc(BDEV_MEMORY, &memory_ops, size);
+
+    if (device != NULL) {
+        device->bd_base = (char *)base;
+    }
+
+    return device;
+}
+
+/*
+ * Opens a device over a range of a file
+ * Inputs:
+ *  - type: BDEV_MMAP, BDEV_PREAD or BDEV_DIRECT
+ *  - fd: the file, open for reading and writing; it stays owned by the caller
+ *  - path: its name (BDEV_DIRECT opens it again)
+ *  - start, size: the range, page aligned
+ * Returns: the device, NULL on error
+ */
+block_device_t *bdev_open_file(bdev_type_t type, int fd, char const *path, uint64_t start, uint64_t size) {
+    bdev_ops_t const *ops = NULL;
+
+    switch (type) {
+    case BDEV_MMAP:
+        ops = &mmap_ops;
+        break;
+    case BDEV_PREAD:
+        ops = &pread_ops;
+        break;
+    case BDEV_DIRECT:
+        ops = &direct_ops;
+        break;
+    case BDEV_MEMORY:
+    default:
+        printf("[ bdev_open_file ] Error : not a file backend\n");
+        return NULL;
+    }
+
+    block_device_t *device = bdev_alloc(type, ops, size);
+
+    if (device == NULL) {
+        return NULL;
+    }
+
+    device->bd_fd = fd;
+    device->bd_start = start;
+
+    if (type == BDEV_MMAP) {
+        void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)start);
+
+        device->bd_base = base == MAP_FAILED ? NULL : (char *)base;
+    } else if (type == BDEV_DIRECT) {
+        device->bd_fd = open(path, O_RDWR | O_DIRECT);
+    }
+
+    if ((type == BDEV_MMAP && device->bd_base == NULL) || device->bd_fd == -1) {
+        printf("[ bdev_open_file ] Error : %s\n", strerror(errno));
+        bdev_close(device);
+        return NULL;
+    }
+
+    return device;
+}
+
+/* Closes a device; writes it took are not flushed */
+void bdev_close(block_device_t *device) {
+    if (device == NULL) {
+        return;
+    }
+
+    if (device->bd_type == BDEV_MMAP && device->bd_base != NULL) {
+        munmap(device->bd_base, device->bd_size);
+    }
+
+    if (device->bd_type == BDEV_DIRECT && device->bd_fd != -1) {
+        close(device->bd_fd);
+    }
+
+    for (size_t i = 0; i < BDEV_STRIPES; i++) {
+        pthread_mutex_destroy(&device->bd_stripes[i]);
+    }
+
+    free(device);
+}
+
+/*
+ * Reads a range of the device
+ * Returns: 0 if successful, -1 otherwise
+ */
+int bdev_read(block_device_t *device, uint64_t offset, void *buffer, size_t length) {
+    return length == 0 ? 0 : device->bd_ops->read(device, offset, buffer, length);
+}
+
+/*
+ * Writes a range of the device
+ * Returns: 0 if successful, -1 otherwise
+ */
+int bdev_write(block_device_t *device, uint64_t offset, void const *buffer, size_t length) {
+    return length == 0 ? 0 : device->bd_ops->write(device, offset, buffer, length);
+}
+
+/*
+ * Fills a range of the device with zeros
+ * Returns: 0 if successful, -1 otherwise
+ */
+int bdev_zero(block_device_t *device, uint64_t offset, size_t length) {
+    void *mapped = device->bd_ops->map(device, offset);
+
+    if (mapped != NULL) {
+        memset(mapped, 0, length);
+        return 0;
+    }
+
+    while (length > 0) {
+        size_t chunk = length > BDEV_ZERO_SIZE ? BDEV_ZERO_SIZE : length;
+
+        if (device->bd_ops->write(device, offset, zeros, chunk) == -1) {
+            return -1;
+        }
+
+        offset += chunk;
+        length -= chunk;
+    }
+
+    return 0;
+}
+
+/*
+ * Makes every write the device took durable
+ * Returns: 0 if successful, -1 otherwise
+ */
+int bdev_flush(block_device_t *device) {
+    return device->bd_ops->flush(device);
+}
+
+/* Tells the device a page aligned range holds nothing of use */
+void bdev_discard(block_device_t *device, uint64_t offset, size_t length) {
+    if (length > 0) {
+        device->bd_ops->discard(device, offset, length);
+    }
+}
+
+/*
+ * Returns: the address of a byte of the device, if its blocks are memory
+ * the FS may change in place (BDEV_MEMORY), NULL otherwise
+ */
+void *bdev_map(block_device_t *device, uint64_t offset) {
+    return device->bd_ops->map(device, offset);
+}
+
+/* Tells the device a range will be read soon, or not for a while */
+void bdev_advise(block_device_t *device, uint64_t offset, size_t length, bdev_advice_t advice) {
+    if (length > 0) {
+        device->bd_ops->advise(device, offset, length, advice);
+    }
+}
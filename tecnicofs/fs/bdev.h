@@ -0,0 +1,41 @@
+#ifndef BDEV_H
+#define BDEV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Block devices
+ * The data blocks of a volume live on a block device, reached only through
+ * the operations below. Offsets and lengths are in bytes from the first data
+ * block. Writes reach the device before they return, flush makes them
+ * durable and discard tells the device a range is no longer needed (reading
+ * it again may give anything); advise only hints how a range will be used.
+ * Backends:
+ *  - BDEV_MEMORY : a region of memory (in-memory volumes)
+ *  - BDEV_MMAP : a shared mapping of the image file's data region
+ *  - BDEV_PREAD : pread/pwrite on the image file
+ *  - BDEV_DIRECT : O_DIRECT on the image file through aligned bounce
+ *    buffers, bypassing the page cache
+ */
+typedef enum { BDEV_MEMORY = 0, BDEV_MMAP = 1, BDEV_PREAD = 2, BDEV_DIRECT = 3 } bdev_type_t;
+
+typedef enum { BDEV_WILLNEED, BDEV_DONTNEED } bdev_advice_t;
+
+#define BDEV_DIRECT_ALIGN (4096) // BDEV_DIRECT needs blocks of at least this size
+
+typedef struct block_device block_device_t;
+
+block_device_t *bdev_open_memory(void *base, uint64_t size);
+block_device_t *bdev_open_file(bdev_type_t type, int fd, char const *path, uint64_t start, uint64_t size);
+void bdev_close(block_device_t *device);
+
+int bdev_read(block_device_t *device, uint64_t offset, void *buffer, size_t length);
+int bdev_write(block_device_t *device, uint64_t offset, void const *buffer, size_t length);
+int bdev_zero(block_device_t *device, uint64_t offset, size_t length);
+int bdev_flush(block_device_t *device);
+void bdev_discard(block_device_t *device, uint64_t offset, size_t length);
+void *bdev_map(block_device_t *device, uint64_t offset);
+void bdev_advise(block_device_t *device, uint64_t offset, size_t length, bdev_advice_t advice);
+
+#endif // BDEV_H
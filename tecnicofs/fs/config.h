@@ -4,6 +4,7 @@
 /* FS root inode number */
 #define ROOT_DIR_INUM (0)
 
+/* Default volume geometry (tfs_init); tfs_init_with_params picks another */
 #define BLOCK_SIZE (1024)
 #define DATA_BLOCKS (1024)
 #define INODE_TABLE_SIZE (50)
@@ -12,12 +13,31 @@
 
 #define DELAY (5000)
 
-#define INT_SIZE (4)
-#define MAX_DATA_BLOCKS_FOR_INODE (10 + BLOCK_SIZE / INT_SIZE)
-#define MAX_BYTES (272384)
-#define MAX_DIRECT_BLOCKS (10)
-#define MAX_BYTES_DIRECT_DATA (10240)
-#define I_BLOCK_SIZE (11)
+/* Cache line size: per-file state touched by different threads is laid
+ * out a line apart, so threads on different files do not share lines */
+#define CACHE_LINE (64)
+
+#define INODE_EXTENTS (4)
+#define EXTENT_TREE_MAX_DEPTH (3)
+#define MAX_DATA_BLOCKS_FOR_INODE (4294967295ULL)
+
+/* Journal region of image-backed volumes */
+#define JOURNAL_SIZE (4 << 20)
+
+/* Default buffer cache budget of pread/O_DIRECT images */
+#define CACHE_SIZE (16 << 20)
+
+/* Readahead window of sequential readers, in blocks */
+#define READAHEAD_MIN (4)
+#define READAHEAD_MAX (64)
+
+/* Write-back buffering of small writes: bytes held per file, and how old
+ * (in milliseconds) a buffer may get before the flusher writes it */
+#define WRITEBACK_SIZE (64 << 10)
+#define WRITEBACK_AGE_MS (200)
+
+/* Blocks mapped ahead of a file's appenders each time they run out */
+#define APPEND_RESERVE (16)
 
 #define BUFFER_SIZE (100)
 
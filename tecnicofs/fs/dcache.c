@@ -0,0 +1,221 @@
+#include "dcache.h"
+#include "epoch.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DCACHE_BUCKETS (1024)
+#define DCACHE_LOCKS (64)
+#define DCACHE_MAX_NEGATIVE (4096)
+
+/*
+ * Cached name
+ * d_inumber : i-number the name maps to, -1 for a name known not to exist
+ * (a negative entry); it changes in place when the name is created
+ */
+typedef struct dentry {
+    _Atomic(struct dentry *) d_next;
+    int d_parent;
+    atomic_int d_inumber;
+    char d_name[MAX_FILE_NAME];
+} dentry_t;
+
+typedef struct {
+    _Atomic(dentry_t *) buckets[DCACHE_BUCKETS];
+    pthread_mutex_t locks[DCACHE_LOCKS];
+    atomic_int negative_entries;
+} dcache_t;
+
+static dcache_t dcache_s;
+
+/* FNV-1a over the parent i-number and the part of the name that fits in a
+ * directory entry */
+static uint32_t dcache_hash(int parent, char const *name) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(parent); i++) {
+        hash ^= ((uint32_t)parent >> (8 * i)) & 0xff;
+        hash *= 16777619u;
+    }
+
+    for (size_t i = 0; i < MAX_FILE_NAME - 1 && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static bool dentry_matches(dentry_t const *dentry, int parent, char const *name) {
+    return dentry->d_parent == parent && strncmp(dentry->d_name, name, MAX_FILE_NAME) == 0;
+}
+
+void dcache_init() {
+
+    epoch_init();
+
+    for (size_t i = 0; i < DCACHE_BUCKETS; i++) {
+        atomic_init(&dcache_s.buckets[i], NULL);
+    }
+
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_init(&dcache_s.locks[i], NULL);
+    }
+
+    atomic_init(&dcache_s.negative_entries, 0);
+}
+
+/*
+ * Frees every cached entry. No lookup may be running.
+ */
+void dcache_destroy() {
+
+    for (size_t i = 0; i < DCACHE_BUCKETS; i++) {
+        dentry_t *dentry = atomic_load(&dcache_s.buckets[i]);
+
+        while (dentry != NULL) {
+            dentry_t *next = atomic_load(&dentry->d_next);
+            free(dentry);
+            dentry = next;
+        }
+
+        atomic_store(&dcache_s.buckets[i], NULL);
+    }
+
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_destroy(&dcache_s.locks[i]);
+    }
+
+    epoch_destroy();
+}
+
+/* Looks for a name in the cache, without taking any lock
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name to search
+ * 	Returns the cached i-number (-1 if the name is known not to exist),
+ * 	DCACHE_MISS if the name is not cached
+ */
+int dcache_lookup(int parent, char const *name) {
+
+    uint32_t bucket = dcache_hash(parent, name) % DCACHE_BUCKETS;
+    int inumber = DCACHE_MISS;
+
+    epoch_enter();
+
+    dentry_t *dentry = atomic_load_explicit(&dcache_s.buckets[bucket], memory_order_acquire);
+
+    while (dentry != NULL) {
+        if (dentry_matches(dentry, parent, name)) {
+            inumber = atomic_load_explicit(&dentry->d_inumber, memory_order_acquire);
+            break;
+        }
+        dentry = atomic_load_explicit(&dentry->d_next, memory_order_acquire);
+    }
+
+    epoch_exit();
+
+    return inumber;
+}
+
+/* Caches a name (or updates it, if already cached)
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name
+ * 	- i-number the name maps to, -1 to remember that it does not exist
+ * 	  (negative entries are capped at DCACHE_MAX_NEGATIVE)
+ */
+void dcache_insert(int parent, char const *name, int inumber) {
+
+    /* a name too long for a directory entry would be cached truncated,
+     * shadowing the shorter name */
+    if (strnlen(name, MAX_FILE_NAME) >= MAX_FILE_NAME) {
+        return;
+    }
+
+    uint32_t bucket = dcache_hash(parent, name) % DCACHE_BUCKETS;
+    pthread_mutex_t *lock = &dcache_s.locks[bucket % DCACHE_LOCKS];
+
+    pthread_mutex_lock(lock);
+
+    for (dentry_t *d = atomic_load(&dcache_s.buckets[bucket]); d != NULL; d = atomic_load(&d->d_next)) {
+        if (dentry_matches(d, parent, name)) {
+            int old = atomic_exchange(&d->d_inumber, inumber);
+
+            if (old == -1 && inumber != -1) {
+                atomic_fetch_sub(&dcache_s.negative_entries, 1);
+            } else if (old != -1 && inumber == -1) {
+                atomic_fetch_add(&dcache_s.negative_entries, 1);
+            }
+
+            pthread_mutex_unlock(lock);
+            return;
+        }
+    }
+
+    if (inumber == -1) {
+        if (atomic_fetch_add(&dcache_s.negative_entries, 1) >= DCACHE_MAX_NEGATIVE) {
+            atomic_fetch_sub(&dcache_s.negative_entries, 1);
+            pthread_mutex_unlock(lock);
+            return;
+        }
+    }
+
+    dentry_t *dentry = (dentry_t *)malloc(sizeof(dentry_t));
+
+    if (dentry == NULL) {
+        /* the cache is only an accelerator: not caching is fine */
+        if (inumber == -1) {
+            atomic_fetch_sub(&dcache_s.negative_entries, 1);
+        }
+        pthread_mutex_unlock(lock);
+        return;
+    }
+
+    memset(dentry->d_name, 0, sizeof(dentry->d_name));
+    strncpy(dentry->d_name, name, MAX_FILE_NAME - 1);
+    dentry->d_parent = parent;
+    atomic_init(&dentry->d_inumber, inumber);
+    atomic_init(&dentry->d_next, atomic_load(&dcache_s.buckets[bucket]));
+
+    /* publishes the fully built entry */
+    atomic_store_explicit(&dcache_s.buckets[bucket], dentry, memory_order_release);
+
+    pthread_mutex_unlock(lock);
+}
+
+/* Drops a name from the cache; the entry is freed after a grace period
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name
+ */
+void dcache_remove(int parent, char const *name) {
+
+    uint32_t bucket = dcache_hash(parent, name) % DCACHE_BUCKETS;
+    pthread_mutex_t *lock = &dcache_s.locks[bucket % DCACHE_LOCKS];
+
+    pthread_mutex_lock(lock);
+
+    _Atomic(dentry_t *) *link = &dcache_s.buckets[bucket];
+    dentry_t *dentry = atomic_load(link);
+
+    while (dentry != NULL && !dentry_matches(dentry, parent, name)) {
+        link = &dentry->d_next;
+        dentry = atomic_load(link);
+    }
+
+    if (dentry != NULL) {
+        if (atomic_load(&dentry->d_inumber) == -1) {
+            atomic_fetch_sub(&dcache_s.negative_entries, 1);
+        }
+
+        /* readers already on the entry keep walking from it safely */
+        atomic_store_explicit(link, atomic_load(&dentry->d_next), memory_order_release);
+        epoch_retire(dentry, free);
+    }
+
+    pthread_mutex_unlock(lock);
+}
@@ -0,0 +1,24 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "config.h"
+
+/*
+ * Directory entry cache
+ * In-memory hash table mapping (parent i-number, name) to an i-number,
+ * or to -1 for names known not to exist (negative entries).
+ * Lookups take no lock at all: chains are published with release stores
+ * and walked inside an epoch, and removed entries are only freed after a
+ * grace period. Writers serialize on striped mutexes.
+ */
+
+#define DCACHE_MISS (-2)
+
+void dcache_init();
+void dcache_destroy();
+
+int dcache_lookup(int parent, char const *name);
+void dcache_insert(int parent, char const *name, int inumber);
+void dcache_remove(int parent, char const *name);
+
+#endif // DCACHE_H
@@ -0,0 +1,234 @@
+#include "epoch.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Per-thread record
+ * er_state : (epoch << 1) | 1 while inside a critical section, 0 outside
+ * er_in_use : whether a live thread owns the record
+ * Records are never freed, only recycled when their thread exits, so the
+ * list can be walked without locks.
+ */
+typedef struct epoch_record {
+    _Atomic uint64_t er_state;
+    atomic_bool er_in_use;
+    unsigned er_nesting;
+    struct epoch_record *er_next;
+} epoch_record_t;
+
+/* A node waiting for its grace period */
+typedef struct retired_node {
+    void *rn_ptr;
+    void (*rn_free)(void *);
+    uint64_t rn_epoch;
+    struct retired_node *rn_next;
+} retired_node_t;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(epoch_record_t *) records = NULL;
+
+static retired_node_t *limbo = NULL;
+static pthread_mutex_t limbo_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local epoch_record_t *my_record = NULL;
+
+static void record_release(void *record) {
+    atomic_store(&((epoch_record_t *)record)->er_in_use, false);
+}
+
+static void record_key_create() { pthread_key_create(&record_key, record_release); }
+
+/*
+ * Gets the calling thread's record, recycling one left by a dead thread
+ * or pushing a new one to the list
+ */
+static epoch_record_t *record_get() {
+
+    if (my_record != NULL) {
+        return my_record;
+    }
+
+    pthread_once(&record_key_once, record_key_create);
+
+    for (epoch_record_t *r = atomic_load(&records); r != NULL; r = r->er_next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&r->er_in_use, &expected, true)) {
+            my_record = r;
+            break;
+        }
+    }
+
+    if (my_record == NULL) {
+        epoch_record_t *r = (epoch_record_t *)calloc(1, sizeof(epoch_record_t));
+
+        if (r == NULL) {
+            abort();
+        }
+
+        atomic_init(&r->er_state, 0);
+        atomic_init(&r->er_in_use, true);
+        r->er_next = atomic_load(&records);
+
+        while (!atomic_compare_exchange_weak(&records, &r->er_next, r)) {
+        }
+
+        my_record = r;
+    }
+
+    my_record->er_nesting = 0;
+    pthread_setspecific(record_key, my_record);
+
+    return my_record;
+}
+
+void epoch_init() { pthread_once(&record_key_once, record_key_create); }
+
+/*
+ * Frees every retired node. Only called when no reader can be active.
+ */
+void epoch_destroy() {
+
+    pthread_mutex_lock(&limbo_mutex);
+
+    while (limbo != NULL) {
+        retired_node_t *node = limbo;
+        limbo = node->rn_next;
+        node->rn_free(node->rn_ptr);
+        free(node);
+    }
+
+    pthread_mutex_unlock(&limbo_mutex);
+}
+
+void epoch_enter() {
+
+    epoch_record_t *r = record_get();
+
+    if (r->er_nesting++ > 0) {
+        return;
+    }
+
+    atomic_store(&r->er_state, (atomic_load(&global_epoch) << 1) | 1);
+    /* the announcement must be visible before any shared pointer is read */
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit() {
+
+    epoch_record_t *r = record_get();
+
+    if (--r->er_nesting > 0) {
+        return;
+    }
+
+    atomic_store_explicit(&r->er_state, 0, memory_order_release);
+}
+
+/*
+ * Moves the global epoch forward if every active reader has already seen
+ * the current one
+ */
+static uint64_t epoch_try_advance() {
+
+    uint64_t epoch = atomic_load(&global_epoch);
+
+    for (epoch_record_t *r = atomic_load(&records); r != NULL; r = r->er_next) {
+        uint64_t state = atomic_load(&r->er_state);
+
+        if ((state & 1) && (state >> 1) != epoch) {
+            return epoch;
+        }
+    }
+
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+
+    return atomic_load(&global_epoch);
+}
+
+/*
+ * Frees the nodes retired two epochs before a given one.
+ * Must be called with limbo_mutex held.
+ */
+static void limbo_collect(uint64_t epoch) {
+
+    retired_node_t **link = &limbo;
+
+    while (*link != NULL) {
+        retired_node_t *current = *link;
+
+        if (current->rn_epoch + 2 <= epoch) {
+            *link = current->rn_next;
+            current->rn_free(current->rn_ptr);
+            free(current);
+        } else {
+            link = &current->rn_next;
+        }
+    }
+}
+
+/*
+ * Schedules a node, already unreachable for new readers, to be freed after
+ * a grace period. Nodes retired two epochs ago are freed on the way.
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+
+    retired_node_t *node = (retired_node_t *)malloc(sizeof(retired_node_t));
+
+    if (node == NULL) {
+        abort();
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    node->rn_ptr = ptr;
+    node->rn_free = free_fn;
+    node->rn_epoch = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&limbo_mutex);
+
+    node->rn_next = limbo;
+    limbo = node;
+
+    limbo_collect(epoch_try_advance());
+
+    pthread_mutex_unlock(&limbo_mutex);
+}
+
+/*
+ * Frees the retired nodes whose grace period is over, moving the epoch as
+ * far forward as the active readers let it: with none active, every node
+ * retired so far goes.
+ * Returns: the epoch reached
+ */
+uint64_t epoch_reclaim() {
+
+    pthread_mutex_lock(&limbo_mutex);
+
+    epoch_try_advance();
+    uint64_t epoch = epoch_try_advance();
+
+    limbo_collect(epoch);
+
+    pthread_mutex_unlock(&limbo_mutex);
+
+    return epoch;
+}
+
+/*
+ * Waits for a grace period, freeing every node retired before the call.
+ * Must not be called inside a critical section.
+ */
+void epoch_barrier() {
+
+    uint64_t target = atomic_load(&global_epoch) + 2;
+
+    while (epoch_reclaim() < target) {
+        sched_yield();
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+
+/*
+ * Epoch-based reclamation
+ * Readers wrap their lock-free traversals in epoch_enter()/epoch_exit().
+ * Writers unlink a node so no new reader can reach it and hand it to
+ * epoch_retire(); it is only freed after every reader that could still be
+ * looking at it has left its critical section (a grace period).
+ */
+
+void epoch_init();
+void epoch_destroy();
+
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+uint64_t epoch_reclaim();
+void epoch_barrier();
+
+#endif // EPOCH_H
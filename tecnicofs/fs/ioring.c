@@ -0,0 +1,231 @@
+#include "ioring.h"
+#include "operations.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Ring
+ * Both queues are circular arrays of r_entries slots, indexed by counters
+ * that only grow:
+ *  - r_sq[r_sq_head, r_sq_submitted) : submitted, waiting for a worker
+ *  - r_sq[r_sq_submitted, r_sq_prepared) : handed out by tfs_ring_get_sqe
+ *  - r_cq[r_cq_head, r_cq_tail) : completions not reaped yet
+ * r_in_flight counts the submitted requests not reaped yet, so prepared and
+ * in flight requests never take more than r_entries slots and a completion
+ * always finds room.
+ * Everything is protected by r_mutex; workers wait on r_work, reapers on
+ * r_done.
+ */
+struct tfs_ring {
+    unsigned r_entries;
+    tfs_sqe_t *r_sq;
+    tfs_cqe_t *r_cq;
+    uint64_t r_sq_head;
+    uint64_t r_sq_submitted;
+    uint64_t r_sq_prepared;
+    uint64_t r_cq_head;
+    uint64_t r_cq_tail;
+    uint64_t r_in_flight;
+    bool r_stopping;
+    unsigned r_workers;
+    pthread_t *r_threads;
+    pthread_mutex_t r_mutex;
+    pthread_cond_t r_work;
+    pthread_cond_t r_done;
+};
+
+/* Runs a request with the matching synchronous call */
+static ssize_t ring_run(tfs_sqe_t const *sqe) {
+    switch (sqe->sqe_op) {
+    case TFS_OP_OPEN:
+        return tfs_open(sqe->sqe_path, sqe->sqe_flags);
+    case TFS_OP_CLOSE:
+        return tfs_close(sqe->sqe_fhandle);
+    case TFS_OP_READ:
+        return tfs_read(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_length);
+    case TFS_OP_WRITE:
+        return tfs_write(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_length);
+    case TFS_OP_PREAD:
+        return tfs_pread(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_length, sqe->sqe_offset);
+    case TFS_OP_PWRITE:
+        return tfs_pwrite(sqe->sqe_fhandle, sqe->sqe_buffer, sqe->sqe_length, sqe->sqe_offset);
+    default:
+        printf("[ tfs_ring ] Error : invalid operation\n");
+        return -1;
+    }
+}
+
+/* Worker thread: takes submitted requests in order until the ring stops and
+ * none is left */
+static void *ring_worker(void *arg) {
+    tfs_ring_t *ring = arg;
+
+    pthread_mutex_lock(&ring->r_mutex);
+
+    for (;;) {
+        while (ring->r_sq_head == ring->r_sq_submitted && !ring->r_stopping) {
+            pthread_cond_wait(&ring->r_work, &ring->r_mutex);
+        }
+
+        if (ring->r_sq_head == ring->r_sq_submitted) {
+            break;
+        }
+
+        tfs_sqe_t sqe = ring->r_sq[ring->r_sq_head++ % ring->r_entries];
+
+        pthread_mutex_unlock(&ring->r_mutex);
+
+        tfs_cqe_t cqe = {sqe.sqe_user_data, ring_run(&sqe)};
+
+        pthread_mutex_lock(&ring->r_mutex);
+
+        ring->r_cq[ring->r_cq_tail++ % ring->r_entries] = cqe;
+        pthread_cond_broadcast(&ring->r_done);
+    }
+
+    pthread_mutex_unlock(&ring->r_mutex);
+
+    return NULL;
+}
+
+tfs_ring_t *tfs_ring_create(unsigned entries, unsigned workers) {
+
+    if (entries == 0 || workers == 0) {
+        printf("[ tfs_ring_create ] Error : a ring needs entries and workers\n");
+        return NULL;
+    }
+
+    tfs_ring_t *ring = calloc(1, sizeof(tfs_ring_t));
+
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->r_entries = entries;
+    ring->r_sq = calloc(entries, sizeof(tfs_sqe_t));
+    ring->r_cq = calloc(entries, sizeof(tfs_cqe_t));
+    ring->r_threads = calloc(workers, sizeof(pthread_t));
+
+    if (ring->r_sq == NULL || ring->r_cq == NULL || ring->r_threads == NULL) {
+        tfs_ring_destroy(ring);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ring->r_mutex, NULL);
+    pthread_cond_init(&ring->r_work, NULL);
+    pthread_cond_init(&ring->r_done, NULL);
+
+    for (; ring->r_workers < workers; ring->r_workers++) {
+        if (pthread_create(&ring->r_threads[ring->r_workers], NULL, ring_worker, ring) != 0) {
+            printf("[ tfs_ring_create ] Error : could not start the workers\n");
+            tfs_ring_destroy(ring);
+            return NULL;
+        }
+    }
+
+    return ring;
+}
+
+void tfs_ring_destroy(tfs_ring_t *ring) {
+
+    if (ring == NULL) {
+        return;
+    }
+
+    if (ring->r_threads != NULL && ring->r_sq != NULL && ring->r_cq != NULL) {
+        pthread_mutex_lock(&ring->r_mutex);
+        ring->r_stopping = true;
+        pthread_cond_broadcast(&ring->r_work);
+        pthread_mutex_unlock(&ring->r_mutex);
+
+        for (unsigned i = 0; i < ring->r_workers; i++) {
+            pthread_join(ring->r_threads[i], NULL);
+        }
+
+        pthread_mutex_destroy(&ring->r_mutex);
+        pthread_cond_destroy(&ring->r_work);
+        pthread_cond_destroy(&ring->r_done);
+    }
+
+    free(ring->r_sq);
+    free(ring->r_cq);
+    free(ring->r_threads);
+    free(ring);
+}
+
+tfs_sqe_t *tfs_ring_get_sqe(tfs_ring_t *ring) {
+
+    tfs_sqe_t *sqe = NULL;
+
+    pthread_mutex_lock(&ring->r_mutex);
+
+    if (ring->r_sq_prepared - ring->r_sq_submitted + ring->r_in_flight < ring->r_entries) {
+        sqe = &ring->r_sq[ring->r_sq_prepared++ % ring->r_entries];
+    }
+
+    pthread_mutex_unlock(&ring->r_mutex);
+
+    return sqe;
+}
+
+unsigned tfs_ring_submit(tfs_ring_t *ring) {
+
+    pthread_mutex_lock(&ring->r_mutex);
+
+    unsigned submitted = (unsigned)(ring->r_sq_prepared - ring->r_sq_submitted);
+
+    ring->r_sq_submitted = ring->r_sq_prepared;
+    ring->r_in_flight += submitted;
+
+    if (submitted > 0) {
+        pthread_cond_broadcast(&ring->r_work);
+    }
+
+    pthread_mutex_unlock(&ring->r_mutex);
+
+    return submitted;
+}
+
+/* Takes the oldest completion; must be called with the ring locked */
+static void ring_reap(tfs_ring_t *ring, tfs_cqe_t *cqe) {
+    *cqe = ring->r_cq[ring->r_cq_head++ % ring->r_entries];
+    ring->r_in_flight--;
+}
+
+int tfs_ring_wait_cqe(tfs_ring_t *ring, tfs_cqe_t *cqe) {
+
+    pthread_mutex_lock(&ring->r_mutex);
+
+    while (ring->r_cq_head == ring->r_cq_tail && ring->r_in_flight > 0) {
+        pthread_cond_wait(&ring->r_done, &ring->r_mutex);
+    }
+
+    if (ring->r_cq_head == ring->r_cq_tail) {
+        pthread_mutex_unlock(&ring->r_mutex);
+        return -1;
+    }
+
+    ring_reap(ring, cqe);
+
+    pthread_mutex_unlock(&ring->r_mutex);
+
+    return 0;
+}
+
+int tfs_ring_peek_cqe(tfs_ring_t *ring, tfs_cqe_t *cqe) {
+
+    pthread_mutex_lock(&ring->r_mutex);
+
+    if (ring->r_cq_head == ring->r_cq_tail) {
+        pthread_mutex_unlock(&ring->r_mutex);
+        return -1;
+    }
+
+    ring_reap(ring, cqe);
+
+    pthread_mutex_unlock(&ring->r_mutex);
+
+    return 0;
+}
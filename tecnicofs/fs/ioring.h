@@ -0,0 +1,98 @@
+#ifndef IORING_H
+#define IORING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Asynchronous I/O rings
+ * Requests are prepared in the slots of a submission queue (tfs_ring_get_sqe)
+ * and handed over in batches (tfs_ring_submit) to the ring's pool of worker
+ * threads, which run them with the usual calls (tfs_open, tfs_close,
+ * tfs_read, tfs_write, tfs_pread, tfs_pwrite) and post each result to the completion queue, where
+ * it is reaped (tfs_ring_wait_cqe, tfs_ring_peek_cqe). A single thread can so
+ * keep as many operations in flight as the ring has entries.
+ * Requests run concurrently and complete in any order: a request that
+ * depends on another one (a read on the handle an open returns, or two
+ * writes at the shared offset of a handle; positional ones do not share
+ * it) must only be submitted after the
+ * first one completes. One thread at a time prepares and submits requests;
+ * any thread can reap them.
+ */
+
+typedef enum { TFS_OP_OPEN, TFS_OP_CLOSE, TFS_OP_READ, TFS_OP_WRITE, TFS_OP_PREAD, TFS_OP_PWRITE } tfs_op_t;
+
+/*
+ * Submission queue entry
+ * sqe_op : what to do
+ * sqe_fhandle : file handle (every operation but TFS_OP_OPEN)
+ * sqe_buffer, sqe_length : data to read into or write
+ * sqe_offset : where to read or write (TFS_OP_PREAD, TFS_OP_PWRITE)
+ * sqe_path, sqe_flags : file to open (TFS_OP_OPEN); the path must stay
+ *                       valid until the request completes, as the buffer
+ * sqe_user_data : passed back untouched in the completion
+ */
+typedef struct {
+    tfs_op_t sqe_op;
+    int sqe_fhandle;
+    void *sqe_buffer;
+    size_t sqe_length;
+    uint64_t sqe_offset;
+    char const *sqe_path;
+    int sqe_flags;
+    uint64_t sqe_user_data;
+} tfs_sqe_t;
+
+/*
+ * Completion queue entry
+ * cqe_result : what the call returned (the file handle, 0 or the number of
+ *              bytes), -1 if it failed
+ */
+typedef struct {
+    uint64_t cqe_user_data;
+    ssize_t cqe_result;
+} tfs_cqe_t;
+
+typedef struct tfs_ring tfs_ring_t;
+
+/*
+ * Creates a ring
+ * Input:
+ *  - entries: most requests prepared or in flight (not reaped) at a time
+ *  - workers: threads running the requests
+ * Returns the ring, NULL if it could not be created
+ */
+tfs_ring_t *tfs_ring_create(unsigned entries, unsigned workers);
+
+/*
+ * Waits for the submitted requests to complete and frees the ring; their
+ * completions and the prepared requests are dropped
+ */
+void tfs_ring_destroy(tfs_ring_t *ring);
+
+/*
+ * Returns the next free submission queue entry, to be filled in and then
+ * submitted, or NULL if every entry is prepared or in flight
+ */
+tfs_sqe_t *tfs_ring_get_sqe(tfs_ring_t *ring);
+
+/*
+ * Hands every prepared request over to the workers
+ * Returns the number of requests submitted
+ */
+unsigned tfs_ring_submit(tfs_ring_t *ring);
+
+/*
+ * Reaps a completion, waiting for one if there is none yet
+ * Returns 0 if successful, -1 if no request is in flight
+ */
+int tfs_ring_wait_cqe(tfs_ring_t *ring, tfs_cqe_t *cqe);
+
+/*
+ * Reaps a completion if there is one
+ * Returns 0 if successful, -1 if there is none
+ */
+int tfs_ring_peek_cqe(tfs_ring_t *ring, tfs_cqe_t *cqe);
+
+#endif // IORING_H
@@ -0,0 +1,582 @@
+#include "journal.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC (0x4c4e524a53464354ULL) // "TCFSJRNL"
+#define RECORD_DATA (1)
+#define RECORD_REVOKE (2)
+
+/*
+ * Journal header, at the start of the journal region
+ * jh_sequence : sequence number of the first transaction after it; older
+ *               transactions left in the region were already checkpointed
+ */
+typedef struct {
+    uint64_t jh_magic;
+    uint64_t jh_sequence;
+} journal_header_t;
+
+/*
+ * Transaction header, followed by th_length bytes of records; a transaction
+ * is committed once the whole of it (checked with th_checksum) is on disk
+ */
+typedef struct {
+    uint64_t th_magic;
+    uint64_t th_sequence;
+    uint64_t th_length;
+    uint64_t th_checksum;
+} transaction_header_t;
+
+/*
+ * Record: the new contents of a range of the volume (RECORD_DATA, followed
+ * by the r_length bytes), or a range of data blocks that was freed
+ * (RECORD_REVOKE), so older records for it must not be replayed over what
+ * the blocks hold next
+ */
+typedef struct {
+    uint64_t r_offset;
+    uint32_t r_length;
+    uint32_t r_type;
+} record_t;
+
+/* Growable byte buffer */
+typedef struct {
+    char *b_data;
+    size_t b_length;
+    size_t b_capacity;
+} buffer_t;
+
+/*
+ * Journal state
+ * running : records of the transaction operations are joining
+ * handles : operations still running in it
+ * running_id : its number; durable_id is the last one on disk
+ * lost : records of the running transaction were dropped (out of memory),
+ *        so it must not commit
+ * failed_id : first transaction that could not be committed (0 for none);
+ *             later ones build on it, so none is written until the next
+ *             mount and all of them fail
+ * closing : the running transaction waits for its handles to stop, and new
+ *           operations wait for the next one
+ * writing : a leader is writing a transaction (or a checkpoint)
+ * pending : records committed since the last checkpoint
+ * writeback : writes file data held in memory before a commit
+ */
+typedef struct {
+    bool enabled;
+    int fd;
+    size_t offset;
+    size_t size;
+    size_t head;
+    uint64_t sequence;
+    buffer_t running;
+    buffer_t pending;
+    size_t handles;
+    uint64_t running_id;
+    uint64_t durable_id;
+    uint64_t failed_id;
+    bool lost;
+    bool closing;
+    bool writing;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int (*writeback)();
+} journal_t;
+
+static journal_t journal_s;
+
+/* nesting of journal_start calls in this thread */
+static _Thread_local unsigned handle_depth;
+
+static bool buffer_append(buffer_t *buffer, void const *data, size_t length) {
+    if (buffer->b_length + length > buffer->b_capacity) {
+        size_t capacity = buffer->b_capacity == 0 ? 4096 : buffer->b_capacity;
+
+        while (capacity < buffer->b_length + length) {
+            capacity *= 2;
+        }
+
+        char *grown = realloc(buffer->b_data, capacity);
+
+        if (grown == NULL) {
+            return false;
+        }
+
+        buffer->b_data = grown;
+        buffer->b_capacity = capacity;
+    }
+
+    memcpy(buffer->b_data + buffer->b_length, data, length);
+    buffer->b_length += length;
+
+    return true;
+}
+
+static void buffer_free(buffer_t *buffer) {
+    free(buffer->b_data);
+    buffer->b_data = NULL;
+    buffer->b_length = 0;
+    buffer->b_capacity = 0;
+}
+
+/* FNV-1a over a transaction's records */
+static uint64_t journal_checksum(char const *data, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static int journal_pwrite(void const *data, size_t length, size_t offset) {
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t written = pwrite(journal_s.fd, (char const *)data + done, length - done, (off_t)(offset + done));
+
+        if (written == -1) {
+            printf("[ journal ] Error : %s\n", strerror(errno));
+            return -1;
+        }
+
+        done += (size_t)written;
+    }
+
+    return 0;
+}
+
+/* A revoke found while applying records, and where it was */
+typedef struct {
+    size_t rv_position;
+    uint64_t rv_offset;
+    uint64_t rv_length;
+} revoke_t;
+
+/*
+ * Whether the record at a given position is cancelled by a revoke that
+ * comes after it (revokes are sorted by position)
+ */
+static bool record_revoked(revoke_t const *revokes, size_t count, size_t position, record_t const *record) {
+    for (size_t i = 0; i < count; i++) {
+        if (revokes[i].rv_position > position && revokes[i].rv_offset < record->r_offset + record->r_length &&
+            record->r_offset < revokes[i].rv_offset + revokes[i].rv_length) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Writes records to their home locations in the image, in order, skipping
+ * the ones a later revoke cancels
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_apply(char const *records, size_t length) {
+
+    buffer_t revokes = {NULL, 0, 0};
+    size_t position = 0;
+
+    while (position + sizeof(record_t) <= length) {
+        record_t record;
+
+        memcpy(&record, records + position, sizeof(record));
+
+        if (record.r_type == RECORD_REVOKE) {
+            revoke_t revoke = {position, record.r_offset, record.r_length};
+
+            if (!buffer_append(&revokes, &revoke, sizeof(revoke))) {
+                buffer_free(&revokes);
+                return -1;
+            }
+        }
+
+        position += sizeof(record) + (record.r_type == RECORD_DATA ? record.r_length : 0);
+    }
+
+    revoke_t const *revoke_list = (revoke_t const *)(void const *)revokes.b_data;
+    size_t revoke_count = revokes.b_length / sizeof(revoke_t);
+    size_t first_revoke = 0;
+    int result = 0;
+
+    position = 0;
+
+    while (result == 0 && position + sizeof(record_t) <= length) {
+        record_t record;
+        size_t record_position = position;
+
+        memcpy(&record, records + position, sizeof(record));
+        position += sizeof(record);
+
+        if (record.r_type != RECORD_DATA) {
+            first_revoke++;
+            continue;
+        }
+
+        if (!record_revoked(revoke_list + first_revoke, revoke_count - first_revoke, record_position, &record)) {
+            result = journal_pwrite(records + position, record.r_length, record.r_offset);
+        }
+
+        position += record.r_length;
+    }
+
+    buffer_free(&revokes);
+
+    return result;
+}
+
+/*
+ * Starts an empty journal whose first transaction will have a given number
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_reset(uint64_t sequence) {
+    journal_header_t header = {JOURNAL_MAGIC, sequence};
+
+    if (journal_pwrite(&header, sizeof(header), journal_s.offset) == -1 || fdatasync(journal_s.fd) == -1) {
+        return -1;
+    }
+
+    journal_s.sequence = sequence;
+    journal_s.head = sizeof(header);
+
+    return 0;
+}
+
+/*
+ * Writes every transaction committed since the last checkpoint to its home
+ * location, then empties the journal
+ * Must be called by the leader (writing set).
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_checkpoint() {
+    if (journal_apply(journal_s.pending.b_data, journal_s.pending.b_length) == -1 ||
+        fdatasync(journal_s.fd) == -1) {
+        return -1;
+    }
+
+    journal_s.pending.b_length = 0;
+
+    return journal_reset(journal_s.sequence);
+}
+
+/*
+ * Reads the committed transactions left in the journal and replays them.
+ * The scan stops at the first transaction that is torn, has a bad checksum
+ * or an unexpected number, so only the tail written since the last
+ * checkpoint is read.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_replay() {
+
+    journal_header_t header;
+
+    if (pread(journal_s.fd, &header, sizeof(header), (off_t)journal_s.offset) != (ssize_t)sizeof(header) ||
+        header.jh_magic != JOURNAL_MAGIC) {
+        /* a freshly formatted image */
+        return journal_reset(1);
+    }
+
+    size_t position = sizeof(header);
+    uint64_t sequence = header.jh_sequence;
+    buffer_t records = {NULL, 0, 0};
+
+    while (position + sizeof(transaction_header_t) <= journal_s.size) {
+        transaction_header_t transaction;
+
+        if (pread(journal_s.fd, &transaction, sizeof(transaction), (off_t)(journal_s.offset + position)) !=
+                (ssize_t)sizeof(transaction) ||
+            transaction.th_magic != JOURNAL_MAGIC || transaction.th_sequence != sequence ||
+            transaction.th_length > journal_s.size - position - sizeof(transaction)) {
+            break;
+        }
+
+        size_t start = records.b_length;
+        char *data = malloc(transaction.th_length);
+
+        if (data == NULL ||
+            pread(journal_s.fd, data, transaction.th_length, (off_t)(journal_s.offset + position + sizeof(transaction))) !=
+                (ssize_t)transaction.th_length ||
+            journal_checksum(data, transaction.th_length) != transaction.th_checksum ||
+            !buffer_append(&records, data, transaction.th_length)) {
+            records.b_length = start;
+            free(data);
+            break;
+        }
+
+        free(data);
+        position += sizeof(transaction) + transaction.th_length;
+        sequence++;
+    }
+
+    journal_s.sequence = sequence;
+
+    int result = journal_apply(records.b_data, records.b_length) == -1 || fdatasync(journal_s.fd) == -1
+                     ? -1
+                     : journal_reset(sequence);
+
+    buffer_free(&records);
+
+    return result;
+}
+
+/*
+ * Opens the journal of an image-backed volume, replaying it
+ * Inputs:
+ *  - fd: the image file
+ *  - offset, size: the journal region of the image
+ * Returns: 0 if successful, -1 otherwise
+ */
+int journal_open(int fd, size_t offset, size_t size) {
+
+    journal_s.fd = fd;
+    journal_s.offset = offset;
+    journal_s.size = size;
+    journal_s.handles = 0;
+    journal_s.running_id = 1;
+    journal_s.durable_id = 0;
+    journal_s.failed_id = 0;
+    journal_s.lost = false;
+    journal_s.closing = false;
+    journal_s.writing = false;
+
+    pthread_mutex_init(&journal_s.mutex, NULL);
+    pthread_cond_init(&journal_s.cond, NULL);
+
+    if (journal_replay() == -1) {
+        pthread_mutex_destroy(&journal_s.mutex);
+        pthread_cond_destroy(&journal_s.cond);
+        return -1;
+    }
+
+    journal_s.enabled = true;
+
+    return 0;
+}
+
+/*
+ * Commits what is left and checkpoints the journal
+ * Returns: 0 if successful, -1 otherwise
+ */
+int journal_close() {
+
+    if (!journal_s.enabled) {
+        return 0;
+    }
+
+    journal_start();
+    int result = journal_stop();
+
+    if (journal_checkpoint() == -1) {
+        result = -1;
+    }
+
+    journal_s.enabled = false;
+    buffer_free(&journal_s.running);
+    buffer_free(&journal_s.pending);
+    pthread_mutex_destroy(&journal_s.mutex);
+    pthread_cond_destroy(&journal_s.cond);
+
+    return result;
+}
+
+/*
+ * Sets the function that writes file data still held in memory (see
+ * bcache.h) to the image; it runs before each commit, NULL for none
+ */
+void journal_set_writeback(int (*writeback)()) {
+    journal_s.writeback = writeback;
+}
+
+/*
+ * Joins the running transaction; operations call it before taking any lock.
+ * Calls nest, only the outermost one counts.
+ */
+void journal_start() {
+
+    if (!journal_s.enabled || handle_depth++ > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal_s.mutex);
+
+    while (journal_s.closing) {
+        pthread_cond_wait(&journal_s.cond, &journal_s.mutex);
+    }
+
+    journal_s.handles++;
+
+    pthread_mutex_unlock(&journal_s.mutex);
+}
+
+/*
+ * Writes a closed transaction to the journal and syncs it, checkpointing
+ * first if it does not fit
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_write(buffer_t const *records) {
+
+    if (records->b_length == 0) {
+        return 0;
+    }
+
+    transaction_header_t transaction = {JOURNAL_MAGIC, journal_s.sequence, records->b_length,
+                                        journal_checksum(records->b_data, records->b_length)};
+    size_t length = sizeof(transaction) + records->b_length;
+
+    if (journal_s.writeback != NULL && journal_s.writeback() == -1) {
+        return -1;
+    }
+
+    if (journal_s.head + length > journal_s.size && journal_checkpoint() == -1) {
+        return -1;
+    }
+
+    if (journal_s.head + length > journal_s.size) {
+        printf("[ journal_write ] Error : transaction larger than the journal\n");
+        return -1;
+    }
+
+    if (journal_pwrite(&transaction, sizeof(transaction), journal_s.offset + journal_s.head) == -1 ||
+        journal_pwrite(records->b_data, records->b_length, journal_s.offset + journal_s.head + sizeof(transaction)) == -1 ||
+        fdatasync(journal_s.fd) == -1) {
+        return -1;
+    }
+
+    journal_s.head += length;
+    journal_s.sequence++;
+
+    return buffer_append(&journal_s.pending, records->b_data, records->b_length) ? 0 : -1;
+}
+
+/* Whether a transaction failed to commit; must be called with the mutex held */
+static bool journal_failed(uint64_t id) {
+    return journal_s.failed_id != 0 && id >= journal_s.failed_id;
+}
+
+/*
+ * Leaves the running transaction and waits until it is on disk. The first
+ * thread to wait while no commit is under way closes the transaction and
+ * writes it for everybody who joined it.
+ * Returns: 0 if successful, -1 if the commit failed (for every operation
+ * that joined the transaction)
+ */
+int journal_stop() {
+
+    if (!journal_s.enabled || --handle_depth > 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal_s.mutex);
+
+    uint64_t id = journal_s.running_id;
+
+    journal_s.handles--;
+    pthread_cond_broadcast(&journal_s.cond);
+
+    while (journal_s.durable_id < id && !journal_failed(id)) {
+        if (journal_s.closing || journal_s.writing) {
+            pthread_cond_wait(&journal_s.cond, &journal_s.mutex);
+            continue;
+        }
+
+        /* leader: close the transaction and wait for its last handles */
+        journal_s.closing = true;
+
+        while (journal_s.handles > 0) {
+            pthread_cond_wait(&journal_s.cond, &journal_s.mutex);
+        }
+
+        buffer_t records = journal_s.running;
+        uint64_t closed = journal_s.running_id;
+        bool lost = journal_s.lost;
+
+        journal_s.running.b_data = NULL;
+        journal_s.running.b_length = 0;
+        journal_s.running.b_capacity = 0;
+        journal_s.running_id++;
+        journal_s.lost = false;
+        journal_s.closing = false;
+        journal_s.writing = true;
+        pthread_cond_broadcast(&journal_s.cond);
+
+        pthread_mutex_unlock(&journal_s.mutex);
+
+        int written = lost ? -1 : journal_write(&records);
+        buffer_free(&records);
+
+        pthread_mutex_lock(&journal_s.mutex);
+
+        journal_s.writing = false;
+
+        if (written == -1) {
+            printf("[ journal_stop ] Error : commit failed, journal stopped until the next mount\n");
+            journal_s.failed_id = closed;
+        } else {
+            journal_s.durable_id = closed;
+        }
+
+        pthread_cond_broadcast(&journal_s.cond);
+    }
+
+    int result = journal_failed(id) ? -1 : 0;
+
+    pthread_mutex_unlock(&journal_s.mutex);
+
+    return result;
+}
+
+/*
+ * Appends a record to the running transaction. A record that does not fit
+ * in memory is taken out whole (a header without its data would be replayed
+ * as valid) and the transaction is marked lost, so it fails to commit.
+ * Nothing is recorded once the journal has stopped.
+ */
+static void journal_record(uint64_t offset, void const *data, size_t length, uint32_t type) {
+
+    if (!journal_s.enabled || length == 0) {
+        return;
+    }
+
+    record_t record = {offset, (uint32_t)length, type};
+
+    pthread_mutex_lock(&journal_s.mutex);
+
+    size_t start = journal_s.running.b_length;
+
+    if (journal_s.failed_id == 0 && !journal_s.lost &&
+        (!buffer_append(&journal_s.running, &record, sizeof(record)) ||
+         (type == RECORD_DATA && !buffer_append(&journal_s.running, data, length)))) {
+        printf("[ journal_record ] Error : out of memory\n");
+        journal_s.running.b_length = start;
+        journal_s.lost = true;
+    }
+
+    pthread_mutex_unlock(&journal_s.mutex);
+}
+
+/*
+ * Records the new contents of a range of the image; the caller must still
+ * hold the lock that protects the range
+ * Inputs:
+ *  - offset: where the range lives in the image
+ *  - data, length: its new contents
+ */
+void journal_log(uint64_t offset, void const *data, size_t length) {
+    journal_record(offset, data, length, RECORD_DATA);
+}
+
+/*
+ * Records that a range of data blocks (offset in the image) was freed
+ */
+void journal_revoke(uint64_t offset, size_t length) {
+    journal_record(offset, NULL, length, RECORD_REVOKE);
+}
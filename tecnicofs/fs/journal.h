@@ -0,0 +1,35 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Metadata journal (write-ahead, redo only)
+ * Changes to the i-node and block bitmaps, the i-node table, directory
+ * blocks and extent tree nodes are recorded (journal_log) right after they
+ * are made in memory, while the lock protecting them is still held. Every
+ * operation running at the same time joins the same transaction, which is
+ * written to the journal with a single sync once they have all stopped
+ * (group commit). Metadata reaches its home location in the image only at
+ * checkpoints, when the journal fills up or the volume is closed; file data
+ * is written in place before the transaction that references it commits
+ * (data still held in memory is written by the writeback hook first).
+ * Mounting replays the committed transactions left in the journal.
+ * A transaction that cannot be committed fails for every operation that
+ * joined it, and the journal stops: later transactions fail as well.
+ * The journal is only active for image-backed volumes; otherwise every
+ * call returns at once.
+ */
+
+int journal_open(int fd, size_t offset, size_t size);
+int journal_close();
+void journal_set_writeback(int (*writeback)());
+
+void journal_start();
+int journal_stop();
+
+void journal_log(uint64_t offset, void const *data, size_t length);
+void journal_revoke(uint64_t offset, size_t length);
+
+#endif // JOURNAL_H
@@ -1,10 +1,45 @@
 #include "operations.h"
+#include "journal.h"
+#include <limits.h>
 
 int tfs_init() {
-    state_init();
+    tfs_params_t params = tfs_default_params();
+
+    return tfs_init_with_params(&params);
+}
+
+tfs_params_t tfs_default_params() {
+    tfs_params_t params = {
+        .block_size = BLOCK_SIZE,
+        .data_blocks = DATA_BLOCKS,
+        .inode_table_size = INODE_TABLE_SIZE,
+        .max_open_files = MAX_OPEN_FILES,
+        .image_path = NULL,
+        .backend = BDEV_MMAP,
+        .cache_size = CACHE_SIZE,
+    };
+
+    return params;
+}
+
+int tfs_init_with_params(tfs_params_t const *params) {
+    int mounted = state_init(params);
+
+    if (mounted == -1) {
+        return -1;
+    }
+
+    /* a mounted image already has its root directory */
+    if (mounted == 1) {
+        return 0;
+    }
+
     /* create root inode */
+    journal_start();
+
     int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
+
+    if (journal_stop() == -1 || root != ROOT_DIR_INUM) {
         return -1;
     }
 
@@ -20,26 +55,136 @@ static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
 
+/*
+ * Copies the next component of a path name to 'component'
+ * (MAX_FILE_NAME bytes), skipping any leading '/'
+ * Returns a pointer past the component, NULL if there is none or it does
+ * not fit in a directory entry
+ */
+static char const *path_component(char const *path, char *component) {
+    while (*path == '/') {
+        path++;
+    }
+
+    size_t len = strcspn(path, "/");
+
+    if (len == 0 || len >= MAX_FILE_NAME) {
+        return NULL;
+    }
+
+    memcpy(component, path, len);
+    component[len] = '\0';
+
+    return path + len;
+}
+
+/*
+ * Resolves every component of a path name except the last one
+ * Input:
+ *  - name: absolute path name
+ *  - last: where to copy the last component (MAX_FILE_NAME bytes)
+ * Returns the inumber of the parent directory, -1 if unsuccessful
+ */
+static int lookup_parent(char const *name, char *last) {
+    int inum = ROOT_DIR_INUM;
+    char next[MAX_FILE_NAME];
+
+    char const *path = path_component(name, last);
+
+    if (path == NULL) {
+        return -1;
+    }
+
+    /* every level is a (usually lock-free) dentry cache lookup */
+    for (char const *rest = path_component(path, next); rest != NULL;
+         rest = path_component(path, next)) {
+
+        inum = find_in_dir(inum, last);
+
+        if (inum == -1) {
+            return -1;
+        }
+
+        memcpy(last, next, MAX_FILE_NAME);
+        path = rest;
+    }
+
+    /* only trailing slashes may be left */
+    if (path[strspn(path, "/")] != '\0') {
+        return -1;
+    }
+
+    return inum;
+}
+
 int tfs_lookup(char const *name) {
+    char last[MAX_FILE_NAME];
+
     if (!valid_pathname(name)) {
         return -1;
     }
 
-    // skip the initial '/' character
-    name++;
+    int parent = lookup_parent(name, last);
 
-    return find_in_dir(ROOT_DIR_INUM, name);
+    if (parent == -1) {
+        return -1;
+    }
+
+    return find_in_dir(parent, last);
 }
 
-int tfs_open(char const *name, int flags) {
-    int inum;
-    size_t offset;
+/*
+ * Creates a directory inside the running journal transaction
+ */
+static int make_dir(char const *name) {
+    char last[MAX_FILE_NAME];
 
-    /* Checks if the path name is valid */
+    int parent = lookup_parent(name, last);
+
+    if (parent == -1) {
+        return -1;
+    }
+
+    int inum = inode_create(T_DIRECTORY);
+
+    if (inum == -1) {
+        return -1;
+    }
+
+    /* fails if the name already exists */
+    if (add_dir_entry(parent, inum, last) == -1) {
+        inode_delete(inum);
+        return -1;
+    }
+
+    return 0;
+}
+
+int tfs_mkdir(char const *name) {
     if (!valid_pathname(name)) {
         return -1;
     }
 
+    /* every change is made durable by the same group commit */
+    journal_start();
+
+    int result = make_dir(name);
+
+    if (journal_stop() == -1) {
+        return -1;
+    }
+
+    return result;
+}
+
+/*
+ * Looks up (or creates) a file and opens it, inside the running journal
+ * transaction
+ */
+static int open_path(char const *name, int flags) {
+    int inum;
+    uint64_t offset;
+
     inum = tfs_lookup(name);
 
     if (inum >= 0) {
@@ -50,55 +195,75 @@ int tfs_open(char const *name, int flags) {
 
         inode_allocation_map_unlock(READ);
 
-        /* The file already exists */
         if (inode == NULL) {
             return -1;
         }
-        
-        if (inode_lock(inode, MUTEX) != 0) {
+
+        /* the type and size are read without locking the file */
+        inode_type type;
+        uint64_t size = inode_stat(inode, &type);
+
+        /* The file already exists */
+        if (type != T_FILE) {
             return -1;
         }
-
         
-        /* Trucate (if requested) */
+        /* Trucate (if requested); truncating drops the write-back buffer,
+         * taken with the same lock as writes */
         if (flags & TFS_O_TRUNC) {
 
-            if (inode->i_size > 0) {
-                if (data_block_free(inode->i_data_block) == -1) {
+            if (inode_lock(inode, WRITE) != 0) {
+                return -1;
+            }
 
-                    if (inode_unlock(inode, MUTEX) != 0) {
+            if (inode_size(inode) > 0) {
+                if (inode_truncate(inode) == -1) {
+
+                    if (inode_unlock(inode, WRITE) != 0) {
                         return -1;
                     }
                     return -1;
                 }
+            }
 
-                inode->i_size = 0;
+            if (inode_unlock(inode, WRITE) != 0) {
+                return -1;
             }
+
+            size = 0;
         }
         /* Determine initial offset */
         if (flags & TFS_O_APPEND) {
-            offset = inode->i_size;
+            offset = size;
         } else {
             offset = 0;
         }
 
-        if (inode_unlock(inode, MUTEX) != 0) {
-            return -1;
-        }
-
     } 
     else if (flags & TFS_O_CREAT) {
         /* The file doesn't exist; the flags specify that it should be created*/
+        char last[MAX_FILE_NAME];
+        int parent = lookup_parent(name, last);
+
+        if (parent == -1) {
+            return -1;
+        }
+
         /* Create inode */
         inum = inode_create(T_FILE);
 
         if (inum == -1) {
             return -1;
         }
-        /* Add entry in the root directory */
-        if (add_dir_entry(ROOT_DIR_INUM, inum, name + 1) == -1) {
+        /* Add entry in the parent directory */
+        if (add_dir_entry(parent, inum, last) == -1) {
             inode_delete(inum);
-            return -1;
+
+            /* Another thread may have created the same name meanwhile */
+            inum = find_in_dir(parent, last);
+            if (inum == -1) {
+                return -1;
+            }
         }
         offset = 0;
     } else {
@@ -110,7 +275,7 @@ int tfs_open(char const *name, int flags) {
 
     file_allocation_map_lock(MUTEX);
 
-    int fhandle = add_to_open_file_table(inum, offset);
+    int fhandle = add_to_open_file_table(inum, offset, (flags & TFS_O_APPEND) != 0);
 
     file_allocation_map_unlock(MUTEX);
     
@@ -121,20 +286,32 @@ int tfs_open(char const *name, int flags) {
      * opened but it remains created */
 }
 
-int tfs_close(int fhandle) { return remove_from_open_file_table(fhandle); }
+int tfs_open(char const *name, int flags) {
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    /* Checks if the path name is valid */
+    if (!valid_pathname(name)) {
+        return -1;
+    }
 
-    ssize_t direct_bytes = 0;
-    ssize_t indirect_bytes = 0;
-    size_t direct_size = 0;
-    size_t indirect_size = 0;
+    journal_start();
 
-    if (to_write == 0) {
-        printf("[ tfs_write ] %s", NOTHING_TO_WRITE);
+    int fhandle = open_path(name, flags);
+
+    if (journal_stop() == -1) {
+        if (fhandle != -1) {
+            remove_from_open_file_table(fhandle);
+        }
         return -1;
     }
 
+    return fhandle;
+}
+
+/*
+ * Writes the write-back buffer of an open file's inode, inside the running
+ * journal transaction
+ */
+static int file_writeback(int fhandle) {
 
     if (file_allocation_map_lock(READ) != 0) return -1;
 
@@ -146,139 +323,244 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
         return -1;
     }
 
-
     if (open_file_lock(file, MUTEX) != 0) {
         return -1;
     }
 
     inode_t *inode = inode_get(file->of_inumber);
 
-    if (inode == NULL) {
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    if (inode == NULL || inode_lock(inode, WRITE) != 0) {
+        open_file_unlock(file, MUTEX);
         return -1;
-    }   
+    }
 
-    if (inode_lock(inode, READ) != 0) {
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    int result = inode_writeback(inode);
+
+    if (inode_unlock(inode, WRITE) != 0) {
+        open_file_unlock(file, MUTEX);
         return -1;
     }
 
-    if (inode->i_size + to_write <= MAX_BYTES_DIRECT_DATA) {
+    if (open_file_unlock(file, MUTEX) != 0) {
+        return -1;
+    }
 
-        direct_bytes = tfs_write_direct_region(inode, file, buffer, to_write);
+    return result;
+}
 
-        if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+int tfs_close(int fhandle) {
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    journal_start();
 
-        if (direct_bytes == -1) {
-            return -1;
-        }
+    int result = file_writeback(fhandle);
 
-        to_write = (size_t)direct_bytes;
+    if (journal_stop() == -1) {
+        result = -1;
     }
 
-    else if (inode->i_size >= MAX_BYTES_DIRECT_DATA) {
+    /* the handle goes away even if its writes could not be written */
+    if (remove_from_open_file_table(fhandle) == -1) {
+        return -1;
+    }
 
-        if (inode->i_block[MAX_DIRECT_BLOCKS] == -1) {
-            tfs_handle_indirect_block(inode);
-        }
-        
-        indirect_bytes = tfs_write_indirect_region(inode, file, buffer, to_write);
+    return result;
+}
 
-        if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+int tfs_fsync(int fhandle) {
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    journal_start();
 
-        if (indirect_bytes == -1) {
-            return -1;
-        }
+    int result = file_writeback(fhandle);
 
-        to_write = (size_t) indirect_bytes;
+    if (journal_stop() == -1 || result == -1) {
+        printf("[ tfs_fsync ] %s", WRITE_ERROR);
+        return -1;
+    }
+
+    return state_sync();
+}
 
+/*
+ * Writes to an inode at a given offset, gathering the data from an array of
+ * iovecs. A write over data the file already stores changes nothing but
+ * that data: it holds the inode shared and locks only its byte range, so
+ * writers to different parts of a file run at the same time. Any other
+ * write may map blocks or change the size, and needs the inode exclusively:
+ * it goes through the inode's combiner, so contending writers take the
+ * lock once for a whole batch.
+ */
+static ssize_t inode_write(inode_t *inode, extent_cache_t *cache, uint64_t offset, struct iovec const *iov,
+                           int iovcnt) {
+
+    size_t length = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
     }
 
-    else {
+    if (inode_lock(inode, READ) != 0) {
+        return -1;
+    }
 
-        direct_size = MAX_BYTES_DIRECT_DATA - inode->i_size;;
-        indirect_size = to_write - direct_size;
+    if (inode_overwrites(inode, offset, length)) {
+        ssize_t written_bytes = inode_overwritev_at(inode, cache, offset, iov, iovcnt);
 
-        direct_bytes = tfs_write_direct_region(inode, file, buffer, direct_size);
-        
-        if (inode->i_block[MAX_DIRECT_BLOCKS] == -1) {
-            tfs_handle_indirect_block(inode);
-        }
+        return inode_unlock(inode, READ) != 0 ? -1 : written_bytes;
+    }
 
-        if (direct_bytes == -1) {
-            printf("[ tfs_write ] %s", WRITE_ERROR);
+    if (inode_unlock(inode, READ) != 0) {
+        return -1;
+    }
 
-            if (inode_unlock(inode, READ) != 0) {
-                if (open_file_unlock(file, MUTEX) != 0) {
-                    return -1;
-                }
-                return -1;
-            }    
+    return inode_combine_writev(inode, cache, offset, iov, iovcnt);
+}
 
-            if (open_file_unlock(file, MUTEX) != 0) {
+/*
+ * Writes to an open file inside the running journal transaction, gathering
+ * the data from an array of iovecs
+ */
+static ssize_t file_write(int fhandle, struct iovec const *iov, int iovcnt) {
+
+    ssize_t written_bytes = 0;
+
+
+    if (file_allocation_map_lock(READ) != 0) return -1;
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+
+    if (file_allocation_map_unlock(READ) != 0) return -1;
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    /* appends reserve their own range, so they do not hold the handle
+     * while they copy the data; the offset moves past it after */
+    if (file->of_append) {
+        uint64_t end = 0;
+        inode_t *inode = inode_get(file->of_inumber);
+
+        written_bytes = inode == NULL ? -1 : inode_appendv(inode, iov, iovcnt, &end);
+
+        if (written_bytes > 0) {
+            if (open_file_lock(file, MUTEX) != 0) {
                 return -1;
             }
-            return -1;
-        }
 
-       indirect_bytes = tfs_write_indirect_region(inode, file, buffer + direct_size, indirect_size);
+            file->of_offset = end;
 
-       if (inode_unlock(inode, READ) != 0) {
             if (open_file_unlock(file, MUTEX) != 0) {
                 return -1;
             }
-            return -1;
-        }    
+        }
+
+        if (written_bytes == -1) {
+            printf("[ tfs_write ] %s", WRITE_ERROR);
+        }
+
+        return written_bytes;
+    }
 
+    if (open_file_lock(file, MUTEX) != 0) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(file->of_inumber);
+
+    if (inode == NULL) {
         if (open_file_unlock(file, MUTEX) != 0) {
             return -1;
         }
+        return -1;
+    }   
+
+    written_bytes = inode_write(inode, &file->of_extent_cache, file->of_offset, iov, iovcnt);
+
+    if (written_bytes > 0) {
+        file->of_offset += (uint64_t)written_bytes;
+    }
+
+    if (open_file_unlock(file, MUTEX) != 0) {
+        return -1;
+    }
+
+    if (written_bytes == -1) {
+        printf("[ tfs_write ] %s", WRITE_ERROR);
+        return -1;
+    }
     
-        if (indirect_bytes == -1) {
-            printf("[ tfs_write ] %s", WRITE_ERROR);
-            return -1;
+    return written_bytes;
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+
+    if (to_write == 0) {
+        printf("[ tfs_write ] %s", NOTHING_TO_WRITE);
+        return -1;
+    }
+
+    struct iovec iov = {(void *)buffer, to_write};
+
+    /* the data goes to the image before the size and block map that
+     * reference it are committed */
+    journal_start();
+
+    ssize_t written_bytes = file_write(fhandle, &iov, 1);
+
+    if (journal_stop() == -1) {
+        return -1;
+    }
+
+    return written_bytes;
+}
+
+/*
+ * Checks an array of iovecs: there must be some, and the bytes they cover
+ * must fit in an ssize_t
+ * Returns the number of bytes they cover, 0 if the array is invalid
+ */
+static size_t iov_check(struct iovec const *iov, int iovcnt) {
+    size_t length = 0;
+
+    if (iov == NULL || iovcnt <= 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > (size_t)SSIZE_MAX - length) {
+            return 0;
         }
 
-        to_write = (size_t)(direct_bytes + indirect_bytes);
+        length += iov[i].iov_len;
     }
-    
-    return (ssize_t)to_write;
+
+    return length;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
 
-    size_t to_read = 0;
-    size_t total_read = 0;
-    ssize_t direct_read = 0;
-    ssize_t indirect_read = 0;
+    if (iov_check(iov, iovcnt) == 0) {
+        printf("[ tfs_writev ] %s", NOTHING_TO_WRITE);
+        return -1;
+    }
 
-    if (len == 0) {
-        printf("[ tfs_read ] %s", NOTHING_TO_READ);
+    journal_start();
+
+    ssize_t written_bytes = file_write(fhandle, iov, iovcnt);
+
+    if (journal_stop() == -1) {
         return -1;
-    } 
+    }
+
+    return written_bytes;
+}
+
+/*
+ * Reads from an open file into an array of iovecs
+ */
+static ssize_t file_read(int fhandle, struct iovec const *iov, int iovcnt) {
 
+    ssize_t total_read = 0;
 
     if (file_allocation_map_lock(READ) != 0) return -1;
 
@@ -303,120 +585,184 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
         return -1;
     }
 
-    if (inode_lock(inode, READ) != 0) {
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;    
-        }
-        return -1;    
+    /* The file may have been truncated by another handle: nothing is
+     * read past its end. The inode is only locked if the read cannot do
+     * without it (see inode_readv) */
+    total_read = tfs_read_region(inode, file, iov, iovcnt);
+
+    if (open_file_unlock(file, MUTEX) != 0) {
+        return -1;
     }
 
+    if (total_read == -1) {
+        printf("[ tfs_read ] %s", READ_ERROR);
+        return -1;
+    }
 
-    to_read = inode->i_size - file->of_offset; 
+    return total_read;
+}
 
-    if (to_read > len) {
-        to_read = len;
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+
+    if (len == 0) {
+        printf("[ tfs_read ] %s", NOTHING_TO_READ);
+        return -1;
     } 
 
+    struct iovec iov = {buffer, len};
 
-    if (file->of_offset + to_read <= MAX_BYTES_DIRECT_DATA) {
+    return file_read(fhandle, &iov, 1);
+}
 
-        direct_read = tfs_read_direct_region(file, to_read, buffer);  
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
 
-        if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+    if (iov_check(iov, iovcnt) == 0) {
+        printf("[ tfs_readv ] %s", NOTHING_TO_READ);
+        return -1;
+    }
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    return file_read(fhandle, iov, iovcnt);
+}
 
-        if (direct_read == -1) {
-            printf("[ tfs_read ] %s", READ_ERROR);
-            return -1;
-        }
+/*
+ * Returns the inode of an open file, without locking the file entry: the
+ * i-number of an entry does not change while it is open
+ */
+static inode_t *file_inode(int fhandle) {
+
+    if (file_allocation_map_lock(READ) != 0) return NULL;
 
-        total_read = (size_t) direct_read;
+    open_file_entry_t *file = get_open_file_entry(fhandle);
 
+    if (file_allocation_map_unlock(READ) != 0) return NULL;
+
+    if (file == NULL) {
+        return NULL;
     }
 
-    else if (file->of_offset >= MAX_BYTES_DIRECT_DATA) {
+    return inode_get(file->of_inumber);
+}
 
-        indirect_read = tfs_read_indirect_region(file, to_read, buffer);
+/*
+ * Writes to an open file at a given offset inside the running journal
+ * transaction
+ */
+static ssize_t file_pwrite(int fhandle, void const *buffer, size_t to_write, uint64_t offset) {
 
-        if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+    inode_t *inode = file_inode(fhandle);
+    struct iovec iov = {(void *)buffer, to_write};
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    if (inode == NULL) {
+        return -1;
+    }
 
-        if (indirect_read == -1) {
-            printf("[ tfs_read ] %s", READ_ERROR);
-            return -1;
-        } 
+    ssize_t written_bytes = inode_write(inode, NULL, offset, &iov, 1);
 
-        total_read = (size_t) indirect_read;
+    if (written_bytes == -1) {
+        printf("[ tfs_pwrite ] %s", WRITE_ERROR);
+        return -1;
     }
 
-    else {
+    return written_bytes;
+}
 
-        size_t bytes_to_read_in_direct_region = 0;
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, uint64_t offset) {
 
-        if (to_read + file->of_offset > MAX_BYTES_DIRECT_DATA) {
-            bytes_to_read_in_direct_region = MAX_BYTES_DIRECT_DATA - file->of_offset;
-        }
+    if (len == 0) {
+        printf("[ tfs_pwrite ] %s", NOTHING_TO_WRITE);
+        return -1;
+    }
 
-        to_read -= bytes_to_read_in_direct_region;
+    journal_start();
 
-        direct_read = tfs_read_direct_region(file, bytes_to_read_in_direct_region, buffer);
+    ssize_t written_bytes = file_pwrite(fhandle, buffer, len, offset);
 
-        if (direct_read == -1) {
+    if (journal_stop() == -1) {
+        return -1;
+    }
 
-            if (inode_unlock(inode, READ) != 0) {
-                if (open_file_unlock(file, MUTEX) != 0) {
-                    return -1;
-                }
-                return -1;
-            }    
+    return written_bytes;
+}
 
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, uint64_t offset) {
 
-        total_read = (size_t) (direct_read);
-      
-        indirect_read = tfs_read_indirect_region(file, to_read, buffer + total_read);
+    if (len == 0) {
+        printf("[ tfs_pread ] %s", NOTHING_TO_READ);
+        return -1;
+    }
 
-        if (inode_unlock(inode, READ) != 0) {
-            if (open_file_unlock(file, MUTEX) != 0) {
-                return -1;
-            }
-            return -1;
-        }    
+    inode_t *inode = file_inode(fhandle);
 
-        if (open_file_unlock(file, MUTEX) != 0) {
-            return -1;
-        }
+    if (inode == NULL) {
+        return -1;
+    }
 
-        if (indirect_read == -1){
-            printf("[ tfs_read ] %s", READ_ERROR);
-            return -1;
-        }
+    struct iovec iov = {buffer, len};
+    ssize_t total_read = inode_readv(inode, NULL, offset, &iov, 1);
 
-        total_read += ((size_t)indirect_read);
+    if (total_read == -1) {
+        printf("[ tfs_pread ] %s", READ_ERROR);
+        return -1;
     }
-    return (ssize_t)total_read;
+
+    return total_read;
 }
 
+int tfs_fadvise(int fhandle, uint64_t offset, uint64_t len, int advice) {
+
+    if (advice != TFS_FADV_NORMAL && advice != TFS_FADV_SEQUENTIAL && advice != TFS_FADV_RANDOM &&
+        advice != TFS_FADV_WILLNEED && advice != TFS_FADV_DONTNEED) {
+        printf("[ tfs_fadvise ] Error : invalid advice\n");
+        return -1;
+    }
+
+    if (file_allocation_map_lock(READ) != 0) return -1;
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+
+    if (file_allocation_map_unlock(READ) != 0) return -1;
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    if (open_file_lock(file, MUTEX) != 0) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(file->of_inumber);
+
+    if (inode == NULL || inode_lock(inode, READ) != 0) {
+        open_file_unlock(file, MUTEX);
+        return -1;
+    }
+
+    switch (advice) {
+    case TFS_FADV_SEQUENTIAL:
+        file_set_access(file, ACCESS_SEQUENTIAL);
+        break;
+    case TFS_FADV_RANDOM:
+        file_set_access(file, ACCESS_RANDOM);
+        break;
+    case TFS_FADV_WILLNEED:
+        inode_advise(inode, offset, len, BDEV_WILLNEED);
+        break;
+    case TFS_FADV_DONTNEED:
+        inode_advise(inode, offset, len, BDEV_DONTNEED);
+        break;
+    case TFS_FADV_NORMAL:
+    default:
+        file_set_access(file, ACCESS_NORMAL);
+        break;
+    }
+
+    if (inode_unlock(inode, READ) != 0) {
+        open_file_unlock(file, MUTEX);
+        return -1;
+    }
+
+    return open_file_unlock(file, MUTEX) != 0 ? -1 : 0;
+}
 
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
 
@@ -464,11 +810,11 @@ int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
 
     pthread_mutex_unlock(&file->open_file_mutex);    
 
-    pthread_rwlock_rdlock(&inode->inode_rwlock);
+    inode_lock(inode, READ);
 
-    total_size_to_read = (ssize_t) inode->i_size;
+    total_size_to_read = (ssize_t) inode_size(inode);
 
-    pthread_rwlock_unlock(&inode->inode_rwlock);
+    inode_unlock(inode, READ);
 
 
     do {
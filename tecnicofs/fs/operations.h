@@ -16,12 +16,41 @@ enum {
     TFS_O_APPEND = 0b100,
 };
 
+enum {
+    TFS_FADV_NORMAL = 0,
+    TFS_FADV_SEQUENTIAL = 1,
+    TFS_FADV_RANDOM = 2,
+    TFS_FADV_WILLNEED = 3,
+    TFS_FADV_DONTNEED = 4,
+};
+
 /*
  * Initializes tecnicofs
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_init();
 
+/*
+ * Default volume geometry, the one tfs_init uses (see config.h)
+ */
+tfs_params_t tfs_default_params();
+
+/*
+ * Initializes tecnicofs with a given volume geometry
+ * Input:
+ *  - params: block size (a power of two, 512 bytes to 1 MiB), number of
+ *    data blocks, number of i-nodes and size of the open file table; the
+ *    usual way is to start from tfs_default_params() and change some fields.
+ *    With an image_path the volume lives in that file: an existing image is
+ *    mounted as it is (keeping its own geometry) and an empty or missing
+ *    one is formatted. Its data blocks are reached through the chosen
+ *    backend (a shared mapping by default, pread/pwrite, or O_DIRECT, which
+ *    needs blocks of at least 4 KiB); the last two keep the blocks in use
+ *    in a buffer cache of cache_size bytes. tfs_destroy writes it back.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_init_with_params(tfs_params_t const *params);
+
 /*
  * Destroy tecnicofs
  * Returns 0 if successful, -1 otherwise.
@@ -36,33 +65,48 @@ int tfs_destroy_after_all_closed();
 
 
 /*
- * Looks for a file
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported Input:
- *  - name: absolute path name
+ * Looks for a file (or directory)
+ * Input:
+ *  - name: absolute path name; each component is resolved in its parent
+ *    directory, through the dentry cache when possible
  * Returns the inumber of the file, -1 if unsuccessful
  */
 int tfs_lookup(char const *name);
 
+/*
+ * Creates a directory
+ * Input:
+ *  - name: absolute path name; the parent directory must already exist
+ * Returns 0 if successful, -1 otherwise (also if the name already exists).
+ */
+int tfs_mkdir(char const *name);
+
 /*
  * Opens a file
  * Input:
  *  - name: absolute path name
  *  - flags: can be a combination (with bitwise or) of the following flags:
- *    - append mode (TFS_O_APPEND)
+ *    - append mode (TFS_O_APPEND): every write goes to the end of the
+ *      file as it is then, even with other handles appending at the same
+ *      time, and writes on different handles copy their data concurrently;
+ *      an append shows up once the ones started before it are done
+ *      (tfs_pwrite still writes where it is told)
  *    - truncate file contents (TFS_O_TRUNC)
  *    - create file if it does not exist (TFS_O_CREAT)
  */
 int tfs_open(char const *name, int flags);
 
-/* Closes a file
+/* Closes a file, writing what is left in its write-back buffer
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
- * Returns 0 if successful, -1 otherwise.
+ * Returns 0 if successful, -1 otherwise (the handle is closed anyway).
  */
 int tfs_close(int fhandle);
 
-/* Writes to an open file, starting at the current offset
+/* Writes to an open file, starting at the current offset. Small writes
+ * are held in the file's write-back buffer (its blocks are allocated when
+ * the buffer is written: once it fills up or is some time old, and on
+ * tfs_close or tfs_fsync); every handle reads them at once.
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
  * 	- buffer containing the contents to write
@@ -72,6 +116,14 @@ int tfs_close(int fhandle);
  */
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
 
+/* Makes everything written to an open file durable: its write-back buffer
+ * is written and, for image-backed volumes, committed and synced
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
 /* Reads from an open file, starting at the current offset
  * * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
@@ -83,6 +135,72 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes to an open file, starting at the current offset, gathering the
+ * data from several buffers; the whole write is done at once, as a single
+ * tfs_write of the buffers one after the other would
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- array of iovecs (base and length of each buffer)
+ * 	- number of iovecs
+ * 	Returns the number of bytes that were written (can be lower than the
+ * 	total if the maximum file size is exceeded), or -1 in case of error
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Reads from an open file, starting at the current offset, scattering the
+ * data into several buffers, which are filled one after the other
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- array of iovecs (base and length of each buffer)
+ * 	- number of iovecs
+ * 	Returns the number of bytes that were read (can be lower than the total
+ * 	if the file size was reached), or -1 in case of error
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Writes to an open file at a given offset, leaving the file's current
+ * offset alone: threads sharing a handle can write at once. The offset is
+ * used even on a handle opened with TFS_O_APPEND, as POSIX pwrite does;
+ * only tfs_write and tfs_writev append
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset to write at (past the end, the gap reads as zeros)
+ * 	Returns the number of bytes that were written (can be lower than
+ * 	'len' if the maximum file size is exceeded), or -1 in case of error
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, uint64_t offset);
+
+/* Reads from an open file at a given offset, leaving the file's current
+ * offset alone: threads sharing a handle can read at once
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset to read from
+ * 	Returns the number of bytes that were copied from the file to the buffer
+ * 	(can be lower than 'len' if the file size was reached), or -1 in case of
+ * 	error
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, uint64_t offset);
+
+/* Tells how an open file will be read
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset and length of the range the advice is about (only used by
+ * 	  TFS_FADV_WILLNEED and TFS_FADV_DONTNEED)
+ * 	- advice:
+ * 	  - TFS_FADV_SEQUENTIAL: read ahead as far as possible from the start
+ * 	  - TFS_FADV_RANDOM: never read ahead
+ * 	  - TFS_FADV_NORMAL: read ahead once reads are seen to be sequential
+ * 	  - TFS_FADV_WILLNEED: start reading the range in the background
+ * 	  - TFS_FADV_DONTNEED: the range will not be read soon, its cached
+ * 	    blocks can go
+ * 	Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fadvise(int fhandle, uint64_t offset, uint64_t len, int advice);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
  * Devolve 0 em caso de sucesso, -1 em caso de erro.
@@ -1,50 +1,357 @@
 #include "state.h"
+#include "dcache.h"
+#include "volume.h"
+#include "journal.h"
+#include "bcache.h"
+#include "epoch.h"
+#include <stddef.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+
+#define BITMAP_WORD_BITS (64)
+#define BITMAP_WORDS(bits) (((bits) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+#define MIN_BLOCK_SIZE (512)
+#define MAX_BLOCK_SIZE (1 << 20)
+
+/* Sizes derived from the volume geometry. The block size is a power of
+ * two, so offsets are split into block and offset with a shift and a mask */
+#define FS_BLOCK_SIZE (fs_params.block_size)
+#define FS_BLOCK_INDEX(offset) ((offset) >> block_shift)
+#define FS_BLOCK_OFFSET(offset) ((size_t)((offset) & (fs_params.block_size - 1)))
+#define FS_BLOCK_START(block) ((uint64_t)(block) << block_shift)
+#define MAX_BYTES (MAX_DATA_BLOCKS_FOR_INODE << block_shift)
+#define MAX_DIR_ENTRIES ((FS_BLOCK_SIZE - sizeof(dir_bucket_t)) / sizeof(dir_entry_t))
+#define EXTENT_NODE_ENTRIES ((FS_BLOCK_SIZE - sizeof(extent_node_t)) / sizeof(extent_t))
+
+/* Volume geometry, fixed by state_init */
+static tfs_params_t fs_params;
+static unsigned int block_shift;
+
+/* Mapping holding the persistent state below */
+static volume_t volume_s;
+
+/* Persistent FS state: every table points into the volume mapping, which
+ * is backed by an image file or, by default, by memory, and the data blocks
+ * are on the volume's block device */
 
-#define FIRST_INDIRECT_BLOCK (12)
-#define REFERENCE_BLOCK_INDEX (11)
-
-/* Persistent FS state  (in reality, it should be maintained in secondary
- * memory; for simplicity, this project maintains it in primary memory) */
+/*
+ * Locks of an i-node (volatile), a cache line apart from the next one's
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_rwlock_t il_rwlock;
+    pthread_mutex_t il_mutex;
+} inode_locks_t;
 
-/* I-node table */
+/*
+ * I-node table
+ * freeinode_ts : one bit per i-node (1 = TAKEN), claimed with compare-and-swap
+ * inode_locks : one per i-node
+ */
 typedef struct {
-    inode_t inode_table[INODE_TABLE_SIZE];
-    allocation_state_t freeinode_ts[INODE_TABLE_SIZE];
+    inode_t *inode_table;
+    inode_locks_t *inode_locks;
+    _Atomic uint64_t *freeinode_ts;
+    size_t free_words;
     pthread_mutex_t inode_table_mutex;
     pthread_rwlock_t inode_table_rwlock;
 } inode_table_t;
 
 static inode_table_t inode_table_s;
 
+/*
+ * Data blocks
+ * device : where the blocks are
+ * cached : whether file data goes through the buffer cache
+ * readahead : whether reading ahead helps (the device is not memory, and
+ *             O_DIRECT reads ahead into the buffer cache only)
+ * fs_data : room for every block; directory and extent tree blocks are
+ *           changed there (see data_block_get)
+ * resident : one bit per block read into fs_data (NULL when fs_data is
+ *            the device itself)
+ * free_blocks : one bit per block (1 = TAKEN), scanned a word at a time
+ * retired : one bit per block freed while readers without the inode lock
+ *           may still be reading it; it is not handed out again until
+ *           they are done (see data_block_retire_n)
+ * retired_count : number of bits set in retired
+ * next_fit : block where the next allocation starts looking
+ */
 typedef struct {
-    allocation_state_t fs_data[BLOCK_SIZE * DATA_BLOCKS];
-    allocation_state_t free_blocks[DATA_BLOCKS];
+    block_device_t *device;
+    bool cached;
+    bool readahead;
+    char *fs_data;
+    _Atomic uint64_t *resident;
+    uint64_t *free_blocks;
+    uint64_t *retired;
+    size_t retired_count;
+    size_t free_words;
+    size_t next_fit;
     pthread_mutex_t data_blocks_mutex;
+    pthread_mutex_t resident_mutex;
 } data_blocks_t;
 
 static data_blocks_t data_blocks_s;
 
 /* Volatile FS state */
 
+/*
+ * Byte range held in a range lock, by the thread that owns it (it lives on
+ * that thread's stack)
+ */
+typedef struct range {
+    uint64_t r_start;
+    uint64_t r_end;
+    bool r_write;
+    struct range *r_next;
+} range_t;
+
+/*
+ * Byte-range lock of a file
+ * Writes inside the stored contents of a file hold its rwlock shared (see
+ * inode_overwritev_at), so they and the reads keep out of each other's way
+ * on the bytes they touch instead. A range waits until no held range
+ * overlapping it is a write (any overlapping range, if it is a write).
+ * Reads only take a range while such writes run (see inode_readv_at).
+ * rl_held : ranges held, in no particular order
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) range_t *rl_held;
+    unsigned rl_waiters;
+    pthread_mutex_t rl_mutex;
+    pthread_cond_t rl_cond;
+} range_lock_t;
+
+/*
+ * Appends to a file (volatile)
+ * Each append reserves the bytes it writes by moving ap_tail past them with
+ * a compare-and-swap, so appenders holding the file's rwlock shared copy
+ * their data at the same time, into blocks mapped beforehand (up to
+ * ap_mapped). Appends become part of the file in the order they were
+ * reserved: ap_size moves past a range once it and every range before it
+ * are written. i_size catches up with ap_size when the file is written
+ * back (see inode_writeback), so the file's size is the larger of the two.
+ * ap_tail : end of the last range reserved
+ * ap_size : end of the ranges written
+ * ap_mapped : bytes the mapped blocks are known to cover
+ * With the i-node write-locked no append is running, and ap_tail and
+ * ap_size both are where the stored contents end.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t ap_tail;
+    _Atomic uint64_t ap_size;
+    _Atomic uint64_t ap_mapped;
+    pthread_mutex_t ap_mutex;
+    pthread_cond_t ap_cond;
+} append_t;
+
+/*
+ * Write needing its file exclusively, waiting for the combiner (see
+ * inode_combine_writev); it lives on the writer's stack
+ */
+typedef struct write_request {
+    uint64_t wr_offset;
+    struct iovec const *wr_iov;
+    int wr_iovcnt;
+    extent_cache_t *wr_cache;
+    ssize_t wr_result;
+    bool wr_done;
+    struct write_request *wr_next;
+} write_request_t;
+
+/*
+ * Combiner of a file's writes (volatile)
+ * Writes that need the file's rwlock exclusively are published here rather
+ * than each queuing for it. The writer finding no combiner running becomes
+ * the combiner: it takes the lock once and applies every write published
+ * until then, its own included, while the others wait to be told they are
+ * done.
+ * cb_pending, cb_last : writes published, oldest first
+ * cb_active : whether a combiner is running
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) write_request_t *cb_pending;
+    write_request_t *cb_last;
+    bool cb_active;
+    pthread_mutex_t cb_mutex;
+    pthread_cond_t cb_cond;
+} combiner_t;
+
+/* Extent of a published block-map root (see inode_meta_t) */
+typedef struct {
+    _Atomic uint32_t pe_logical;
+    _Atomic int pe_start;
+    _Atomic uint32_t pe_length;
+} published_extent_t;
+
+/*
+ * Published metadata of an i-node (volatile)
+ * Metadata only changes with the i-node's rwlock held exclusively, and a
+ * copy of the type, the size and the block-map root is published here
+ * before the lock is let go (see inode_publish), under a sequence lock:
+ * im_seq is odd while the copy changes. Readers that need nothing else
+ * take no lock and write nothing shared; they start over if im_seq moved
+ * under them (see inode_stat).
+ * The i-nodes in use are published when the volume is mounted, the others
+ * when they are created.
+ * Data reads take no lock either while nothing changes the contents (see
+ * inode_readv): im_started and im_finished count what may change them as
+ * it starts and finishes, that is, every exclusive hold of the rwlock and
+ * every write inside the stored contents (see inode_overwritev_at).
+ * im_size : what inode_size was (later appends are in ap_size)
+ * im_stored : what inode_stored_size was
+ * im_wb_offset, im_wb_length : the bytes the write-back buffer held
+ * im_extents, im_extent_count, im_tree_depth, im_map_generation : the
+ *   block-map root (see inode_t)
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t im_seq;
+    _Atomic int im_type;
+    _Atomic uint64_t im_size;
+    _Atomic uint64_t im_stored;
+    _Atomic uint64_t im_wb_offset;
+    _Atomic uint64_t im_wb_length;
+    published_extent_t im_extents[INODE_EXTENTS];
+    _Atomic uint32_t im_extent_count;
+    _Atomic uint32_t im_tree_depth;
+    _Atomic uint64_t im_map_generation;
+    _Atomic uint64_t im_started;
+    _Atomic uint64_t im_finished;
+} inode_meta_t;
+
+/*
+ * range_locks, appends, combiners, inode_meta : one per i-node, each
+ * entry on cache lines of its own (see table_alloc)
+ */
 typedef struct {
-    open_file_entry_t open_file_table[MAX_OPEN_FILES];
-    char free_open_file_entries[MAX_OPEN_FILES]; 
+    open_file_entry_t *open_file_table;
+    char *free_open_file_entries;
+    range_lock_t *range_locks;
+    append_t *appends;
+    combiner_t *combiners;
+    inode_meta_t *inode_meta;
     pthread_mutex_t fs_state_mutex; 
     pthread_rwlock_t fs_state_rwlock; 
 } fs_state_t;
 
 static fs_state_t fs_state_s;
 
+/*
+ * Write-back buffer of a file (volatile)
+ * Small writes are gathered here and reach the file's blocks, which are
+ * only allocated then, when the buffer fills up or gets old, or when the
+ * file is closed or synced (see inode_writeback). The buffer always starts
+ * inside the stored contents (see inode_stored_size), so the file's size is
+ * the larger of their end and the buffer's end.
+ * wb_data : WRITEBACK_SIZE bytes, allocated while the buffer is in use
+ * wb_offset, wb_length : range of the file the buffer holds
+ * wb_since : when the buffer stopped being empty
+ * wb_listed : whether the i-node is in the flusher's list
+ * A buffer is protected by its i-node's rwlock, wb_listed by the
+ * writeback mutex.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) char *wb_data;
+    uint64_t wb_offset;
+    size_t wb_length;
+    struct timespec wb_since;
+    bool wb_listed;
+} write_buffer_t;
+
+/*
+ * Write-back buffers, one per i-node, and the thread flushing old ones
+ * dirty : i-nodes whose buffer was in use, or that were appended to, when
+ *         listed
+ * batch : the list the flusher is going through
+ */
+typedef struct {
+    write_buffer_t *buffers;
+    int *dirty;
+    int *batch;
+    size_t dirty_count;
+    bool running;
+    bool stopping;
+    pthread_t flusher;
+    pthread_mutex_t writeback_mutex;
+    pthread_cond_t writeback_cond;
+} writeback_t;
+
+static writeback_t writeback_s;
+
+static int dir_init(inode_t *dir);
+static void inode_publish(inode_t *inode);
+static int writeback_start();
+static void writeback_stop();
+static int writeback_all();
+
+/* Journals a range of metadata, in the volume mapping or in a directory or
+ * extent tree block */
+static void metadata_log(void const *addr, size_t length) {
+    journal_log(volume_offset(&volume_s, addr), addr, length);
+}
+
+/* Returns the locks of an i-node */
+static inode_locks_t *inode_locks(inode_t *inode) {
+    return &inode_table_s.inode_locks[inode - inode_table_s.inode_table];
+}
+
+/* Journals the persistent fields of an i-node (everything but the padding
+ * up to the next cache line) */
+static void journal_inode(inode_t *inode) {
+    metadata_log(inode, offsetof(inode_t, i_map_generation) + sizeof(inode->i_map_generation));
+}
+
+/* Allocates a zeroed table of count entries of size bytes (a multiple of
+ * CACHE_LINE), starting on a cache line, so that no two entries share one
+ * Returns: the table, NULL if it could not be allocated
+ */
+static void *table_alloc(size_t count, size_t size) {
+    void *table = aligned_alloc(CACHE_LINE, count * size);
+
+    if (table != NULL) {
+        memset(table, 0, count * size);
+    }
+
+    return table;
+}
+
+/* Returns the write-back buffer of an i-node */
+static write_buffer_t *inode_write_buffer(inode_t *inode) {
+    return &writeback_s.buffers[inode - inode_table_s.inode_table];
+}
+
+/* Returns the append state of an i-node */
+static append_t *inode_append(inode_t *inode) {
+    return &fs_state_s.appends[inode - inode_table_s.inode_table];
+}
+
+/* Forgets the appends to a file whose contents are thrown away */
+static void append_reset(append_t *ap) {
+    atomic_store(&ap->ap_tail, 0);
+    atomic_store(&ap->ap_size, 0);
+    atomic_store(&ap->ap_mapped, 0);
+}
+
+/* Empties a write-back buffer, throwing away what it holds */
+static void write_buffer_drop(write_buffer_t *wb) {
+    free(wb->wb_data);
+    wb->wb_data = NULL;
+    wb->wb_offset = 0;
+    wb->wb_length = 0;
+}
+
 static inline bool valid_inumber(int inumber) {
-    return inumber >= 0 && inumber < INODE_TABLE_SIZE;
+    return inumber >= 0 && (size_t)inumber < fs_params.inode_table_size;
 }
 
 static inline bool valid_block_number(int block_number) {
-    return block_number >= 0 && block_number < DATA_BLOCKS;
+    return block_number >= 0 && (size_t)block_number < fs_params.data_blocks;
 }
 
 static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+    return file_handle >= 0 && (size_t)file_handle < fs_params.max_open_files;
 }
 
 /**
@@ -75,119 +382,377 @@ static void insert_delay() {
 }
 
 /*
- * Initializes FS state
+ * Checks that a volume geometry can be used: the block size must be a power
+ * of two (between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE) and block numbers,
+ * i-numbers and file handles must fit in an int
+ */
+static bool valid_params(tfs_params_t const *params) {
+    if (params->block_size < MIN_BLOCK_SIZE || params->block_size > MAX_BLOCK_SIZE ||
+        (params->block_size & (params->block_size - 1)) != 0) {
+        printf("[ state_init ] Error : block size must be a power of two between %d and %d\n",
+               MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return false;
+    }
+
+    /* the root directory takes two blocks */
+    if (params->data_blocks < 2 || params->data_blocks > INT_MAX ||
+        params->data_blocks > SIZE_MAX / params->block_size) {
+        printf("[ state_init ] Error : invalid number of data blocks\n");
+        return false;
+    }
+
+    if (params->inode_table_size == 0 || params->inode_table_size > INT_MAX ||
+        params->max_open_files == 0 || params->max_open_files > INT_MAX) {
+        printf("[ state_init ] Error : invalid number of i-nodes or open files\n");
+        return false;
+    }
+
+    if (params->image_path != NULL && params->backend != BDEV_MMAP && params->backend != BDEV_PREAD &&
+        params->backend != BDEV_DIRECT) {
+        printf("[ state_init ] Error : invalid backend\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Releases the volume and the open file table */
+static void state_free() {
+    if (data_blocks_s.cached) {
+        journal_set_writeback(NULL);
+        bcache_destroy();
+        data_blocks_s.cached = false;
+    }
+
+    volume_close(&volume_s);
+
+    for (size_t i = 0; writeback_s.buffers != NULL && i < fs_params.inode_table_size; i++) {
+        free(writeback_s.buffers[i].wb_data);
+    }
+
+    free(writeback_s.buffers);
+    free(writeback_s.dirty);
+    free(writeback_s.batch);
+    free(inode_table_s.inode_locks);
+    free(fs_state_s.open_file_table);
+    free(fs_state_s.free_open_file_entries);
+    free(fs_state_s.range_locks);
+    free(fs_state_s.appends);
+    free(fs_state_s.combiners);
+    free(fs_state_s.inode_meta);
+    free((void *)data_blocks_s.resident);
+    free(data_blocks_s.retired);
+
+    inode_table_s.inode_table = NULL;
+    inode_table_s.freeinode_ts = NULL;
+    inode_table_s.inode_locks = NULL;
+    data_blocks_s.device = NULL;
+    data_blocks_s.fs_data = NULL;
+    data_blocks_s.resident = NULL;
+    data_blocks_s.free_blocks = NULL;
+    data_blocks_s.retired = NULL;
+    fs_state_s.open_file_table = NULL;
+    fs_state_s.free_open_file_entries = NULL;
+    fs_state_s.range_locks = NULL;
+    fs_state_s.appends = NULL;
+    fs_state_s.combiners = NULL;
+    fs_state_s.inode_meta = NULL;
+    writeback_s.buffers = NULL;
+    writeback_s.dirty = NULL;
+    writeback_s.batch = NULL;
+}
+
+/*
+ * Initializes FS state: opens the volume (see volume_open) and allocates
+ * the open file table
+ * Input:
+ *  - params: the volume geometry, and the image file to use if any; an
+ *    existing image keeps its own geometry
+ * Returns: 1 if an existing volume was mounted, 0 if a new one was
+ * created, -1 otherwise
  */
-void state_init() {
+int state_init(tfs_params_t const *params) {
+
+    if (params == NULL || !valid_params(params)) {
+        return -1;
+    }
+
+    fs_params = *params;
+
+    int mounted = volume_open(&fs_params, &volume_s);
+
+    if (mounted == -1) {
+        return -1;
+    }
+
+    if (mounted == 1 && !valid_params(&fs_params)) {
+        volume_close(&volume_s);
+        return -1;
+    }
+
+    block_shift = (unsigned int)__builtin_ctzll(fs_params.block_size);
+
+    inode_table_s.free_words = BITMAP_WORDS(fs_params.inode_table_size);
+    inode_table_s.inode_table = volume_s.v_inode_table;
+    inode_table_s.freeinode_ts = volume_s.v_inode_bitmap;
+
+    data_blocks_s.free_words = BITMAP_WORDS(fs_params.data_blocks);
+    data_blocks_s.device = volume_s.v_device;
+    data_blocks_s.fs_data = volume_s.v_data;
+    data_blocks_s.free_blocks = volume_s.v_block_bitmap;
+    data_blocks_s.resident = NULL;
+    data_blocks_s.retired = calloc(data_blocks_s.free_words, sizeof(uint64_t));
+    data_blocks_s.retired_count = 0;
+
+    if (bdev_map(data_blocks_s.device, 0) == NULL) {
+        data_blocks_s.resident = calloc(data_blocks_s.free_words, sizeof(uint64_t));
+    }
+
+    /* a mapping is already cached by the system */
+    data_blocks_s.cached = fs_params.image_path != NULL && fs_params.cache_size > 0 &&
+                           (fs_params.backend == BDEV_PREAD || fs_params.backend == BDEV_DIRECT);
+
+    if (data_blocks_s.cached && bcache_init(data_blocks_s.device, fs_params.block_size, fs_params.cache_size) == -1) {
+        data_blocks_s.cached = false;
+        state_free();
+        return -1;
+    }
+
+    if (data_blocks_s.cached) {
+        journal_set_writeback(bcache_flush);
+    }
+
+    data_blocks_s.readahead = bdev_map(data_blocks_s.device, 0) == NULL &&
+                              (data_blocks_s.cached || fs_params.backend != BDEV_DIRECT);
+
+    inode_table_s.inode_locks = table_alloc(fs_params.inode_table_size, sizeof(inode_locks_t));
+    fs_state_s.open_file_table = table_alloc(fs_params.max_open_files, sizeof(open_file_entry_t));
+    fs_state_s.free_open_file_entries = calloc(fs_params.max_open_files, sizeof(char));
+    fs_state_s.range_locks = table_alloc(fs_params.inode_table_size, sizeof(range_lock_t));
+    fs_state_s.appends = table_alloc(fs_params.inode_table_size, sizeof(append_t));
+    fs_state_s.combiners = table_alloc(fs_params.inode_table_size, sizeof(combiner_t));
+    fs_state_s.inode_meta = table_alloc(fs_params.inode_table_size, sizeof(inode_meta_t));
+    writeback_s.buffers = table_alloc(fs_params.inode_table_size, sizeof(write_buffer_t));
+    writeback_s.dirty = calloc(fs_params.inode_table_size, sizeof(int));
+    writeback_s.batch = calloc(fs_params.inode_table_size, sizeof(int));
+
+    if (inode_table_s.inode_locks == NULL || fs_state_s.open_file_table == NULL ||
+        fs_state_s.free_open_file_entries == NULL ||
+        fs_state_s.range_locks == NULL || fs_state_s.appends == NULL || fs_state_s.combiners == NULL ||
+        fs_state_s.inode_meta == NULL ||
+        data_blocks_s.retired == NULL ||
+        (bdev_map(data_blocks_s.device, 0) == NULL && data_blocks_s.resident == NULL) ||
+        writeback_s.buffers == NULL || writeback_s.dirty == NULL || writeback_s.batch == NULL) {
+        printf("[ state_init ] Error : %s\n", strerror(errno));
+        state_free();
+        return -1;
+    }
+
+    if (writeback_start() == -1) {
+        state_free();
+        return -1;
+    }
+
+    /* a new volume starts zeroed; only the bits past the last i-node and
+     * the last block are marked as taken, so they are never handed out.
+     * A mounted volume is used as it is, without reading it. */
+    if (!mounted) {
+        for (size_t i = fs_params.inode_table_size; i < inode_table_s.free_words * BITMAP_WORD_BITS; i++) {
+            atomic_fetch_or(&inode_table_s.freeinode_ts[i / BITMAP_WORD_BITS],
+                            (uint64_t)1 << (i % BITMAP_WORD_BITS));
+        }
+
+        for (size_t i = fs_params.data_blocks; i < data_blocks_s.free_words * BITMAP_WORD_BITS; i++) {
+            data_blocks_s.free_blocks[i / BITMAP_WORD_BITS] |= (uint64_t)1 << (i % BITMAP_WORD_BITS);
+        }
+
+        metadata_log((void const *)&inode_table_s.freeinode_ts[inode_table_s.free_words - 1], sizeof(uint64_t));
+        metadata_log(&data_blocks_s.free_blocks[data_blocks_s.free_words - 1], sizeof(uint64_t));
+    }
 
     pthread_mutex_init(&(inode_table_s.inode_table_mutex), NULL);
     pthread_rwlock_init(&(inode_table_s.inode_table_rwlock), NULL);
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table_s.freeinode_ts[i] = FREE;
-        pthread_mutex_init(&(inode_table_s.inode_table[i].inode_mutex), NULL);
-        pthread_rwlock_init(&(inode_table_s.inode_table[i].inode_rwlock), NULL);
+    /* locks are never persistent */
+    for (size_t i = 0; i < fs_params.inode_table_size; i++) {
+        pthread_mutex_init(&(inode_table_s.inode_locks[i].il_mutex), NULL);
+        pthread_rwlock_init(&(inode_table_s.inode_locks[i].il_rwlock), NULL);
+        pthread_mutex_init(&(fs_state_s.range_locks[i].rl_mutex), NULL);
+        pthread_cond_init(&(fs_state_s.range_locks[i].rl_cond), NULL);
+        pthread_mutex_init(&(fs_state_s.appends[i].ap_mutex), NULL);
+        pthread_cond_init(&(fs_state_s.appends[i].ap_cond), NULL);
+        pthread_mutex_init(&(fs_state_s.combiners[i].cb_mutex), NULL);
+        pthread_cond_init(&(fs_state_s.combiners[i].cb_cond), NULL);
+
+        /* only i-nodes in use have a type and size to publish */
+        uint64_t bit = (uint64_t)1 << (i % BITMAP_WORD_BITS);
+
+        if (atomic_load(&inode_table_s.freeinode_ts[i / BITMAP_WORD_BITS]) & bit) {
+            inode_publish(&inode_table_s.inode_table[i]);
+        }
     }
 
     pthread_mutex_init(&(data_blocks_s.data_blocks_mutex), NULL);
+    pthread_mutex_init(&(data_blocks_s.resident_mutex), NULL);
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        data_blocks_s.free_blocks[i] = FREE;
-    }
+    data_blocks_s.next_fit = 0;
 
     pthread_mutex_init(&(fs_state_s.fs_state_mutex), NULL);
     pthread_rwlock_init(&(fs_state_s.fs_state_rwlock), NULL);
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+    for (size_t i = 0; i < fs_params.max_open_files; i++) {
         fs_state_s.free_open_file_entries[i] = FREE;
         pthread_mutex_init(&(fs_state_s.open_file_table[i].open_file_mutex), NULL);
         pthread_rwlock_init(&(fs_state_s.open_file_table[i].open_file_rwlock), NULL);
     }
+
+    dcache_init();
+
+    return mounted;
 }
 
 void state_destroy() { 
 
+    /* buffered writes reach the volume before it is closed */
+    writeback_stop();
+    writeback_all();
+
+    /* no reader is left, so retired blocks are let go while the data
+     * blocks can still be reached */
+    epoch_barrier();
+
     pthread_mutex_destroy(&(inode_table_s.inode_table_mutex));
     pthread_rwlock_destroy(&(inode_table_s.inode_table_rwlock));
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        pthread_mutex_destroy(&(inode_table_s.inode_table[i].inode_mutex));
-        pthread_rwlock_destroy(&(inode_table_s.inode_table[i].inode_rwlock));
+    for (size_t i = 0; i < fs_params.inode_table_size; i++) {
+        pthread_mutex_destroy(&(inode_table_s.inode_locks[i].il_mutex));
+        pthread_rwlock_destroy(&(inode_table_s.inode_locks[i].il_rwlock));
+        pthread_mutex_destroy(&(fs_state_s.range_locks[i].rl_mutex));
+        pthread_cond_destroy(&(fs_state_s.range_locks[i].rl_cond));
+        pthread_mutex_destroy(&(fs_state_s.appends[i].ap_mutex));
+        pthread_cond_destroy(&(fs_state_s.appends[i].ap_cond));
+        pthread_mutex_destroy(&(fs_state_s.combiners[i].cb_mutex));
+        pthread_cond_destroy(&(fs_state_s.combiners[i].cb_cond));
     }
 
     pthread_mutex_destroy(&(fs_state_s.fs_state_mutex));
     pthread_rwlock_destroy(&(fs_state_s.fs_state_rwlock));
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+    for (size_t i = 0; i < fs_params.max_open_files; i++) {
         pthread_mutex_destroy(&(fs_state_s.open_file_table[i].open_file_mutex));
         pthread_rwlock_destroy(&(fs_state_s.open_file_table[i].open_file_rwlock));
 
     }
 
     pthread_mutex_destroy(&(data_blocks_s.data_blocks_mutex));
+    pthread_mutex_destroy(&(data_blocks_s.resident_mutex));
+
+    dcache_destroy();
+
+    state_free();
 }
 
 /*
- * Creates a new i-node in the i-node table.
- * Input:
- *  - n_type: the type of the node (file or directory)
- * Returns:
- *  new i-node's number if successfully created, -1 otherwise
+ * Makes the file data written to the device so far durable: the buffer
+ * cache is written back and the device flushed
+ * Returns: 0 if successful, -1 otherwise
+ */
+int state_sync() {
+    if (data_blocks_s.cached && bcache_flush() == -1) {
+        return -1;
+    }
+
+    return bdev_flush(data_blocks_s.device);
+}
+
+/* Returns the volume geometry the FS was initialized with */
+tfs_params_t const *state_params() {
+    return &fs_params;
+}
+
+/*
+ * Claims the first free i-node number: a free bit is found with a word-wide
+ * scan and taken with compare-and-swap, so creators racing for the same
+ * word simply retry on the next free bit and never block each other.
+ * Returns: the claimed i-node number, -1 if the table is full
  */
+static int inode_claim() {
 
-int inode_create(inode_type n_type) {
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * (int) sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
+    insert_delay(); // simulate storage access delay (to freeinode_ts)
+
+    for (size_t w = 0; w < inode_table_s.free_words; w++) {
+        uint64_t word = atomic_load(&inode_table_s.freeinode_ts[w]);
+
+        while (~word != 0) {
+            int bit_index = __builtin_ctzll(~word);
+            uint64_t bit = (uint64_t)1 << bit_index;
+
+            if (atomic_compare_exchange_weak(&inode_table_s.freeinode_ts[w], &word, word | bit)) {
+                metadata_log((void const *)&inode_table_s.freeinode_ts[w], sizeof(uint64_t));
+                return (int)(w * BITMAP_WORD_BITS) + bit_index;
+            }
+            /* lost the race: word now holds the current value, try again */
         }
+    }
+
+    return -1;
+}
 
-        pthread_mutex_lock(&inode_table_s.inode_table_mutex);
+/*
+ * Returns an i-node number to the free bitmap
+ * Returns: 0 if the i-node was taken, -1 otherwise
+ */
+static int inode_release(int inumber) {
 
-        // Finds first free entry in i-node table 
-        if (inode_table_s.freeinode_ts[inumber] == FREE) {      
-            // Found a free entry, so takes it for the new i-node
-            inode_table_s.freeinode_ts[inumber] = TAKEN;
+    uint64_t bit = (uint64_t)1 << (inumber % BITMAP_WORD_BITS);
+    uint64_t old = atomic_fetch_and(&inode_table_s.freeinode_ts[inumber / BITMAP_WORD_BITS], ~bit);
 
-            insert_delay(); // simulate storage access delay (to i-node)
+    metadata_log((void const *)&inode_table_s.freeinode_ts[inumber / BITMAP_WORD_BITS], sizeof(uint64_t));
 
-            inode_t *local_inode = &(inode_table_s.inode_table[inumber]);
+    return (old & bit) ? 0 : -1;
+}
 
-            local_inode->i_node_type = n_type;
+/*
+ * Creates a new i-node in the i-node table.
+ * Input:
+ *  - n_type: the type of the node (file or directory)
+ * Returns:
+ *  new i-node's number if successfully created, -1 otherwise
+ */
 
-            if (n_type == T_DIRECTORY) {
-                // Initializes directory (filling its block with empty
-                // entries, labeled with inumber==-1) 
-                int b = data_block_alloc();
-                if (b == -1 && ((dir_entry_t *)data_block_get(b)) == NULL) {
-                    inode_table_s.freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
+int inode_create(inode_type n_type) {
 
-                local_inode->i_size = BLOCK_SIZE;
-                local_inode->i_data_block = b;
-                memset(local_inode->i_block, -1, sizeof(local_inode->i_block));
+    int inumber = inode_claim();
 
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+    if (inumber == -1) {
+        return -1;
+    }
 
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
-                }
-            } else {
-                // In case of a new file, simply sets its size to 0 
-                local_inode->i_size = 0;
-                local_inode->i_data_block = -1;
-                memset(local_inode->i_block, -1, sizeof(local_inode->i_block));
+    /* Nobody else can reach the i-node until it is linked in a directory,
+     * so it is initialized without holding any table-wide lock */
+    insert_delay(); // simulate storage access delay (to i-node)
 
-            }
+    inode_t *local_inode = &(inode_table_s.inode_table[inumber]);
 
-            pthread_mutex_unlock(&inode_table_s.inode_table_mutex);
+    local_inode->i_node_type = n_type;
 
-            return inumber;
+    if (n_type == T_DIRECTORY) {
+        // Initializes directory (header and a single empty bucket)
+        if (dir_init(local_inode) == -1) {
+            inode_release(inumber);
+            return -1;
         }
+    } else {
+        // In case of a new file, simply sets its size to 0 
+        local_inode->i_size = 0;
+        inode_extents_init(local_inode);
+    }
 
-        pthread_mutex_unlock(&inode_table_s.inode_table_mutex);
+    inode_publish(local_inode);
 
-    }
-    return -1;
+    journal_inode(local_inode);
+
+    return inumber;
 }
 
 
@@ -201,26 +766,27 @@ int inode_delete(int inumber) {
     // simulate storage access delay (to i-node and freeinode_ts)
     insert_delay();
     insert_delay();
-    
-    pthread_mutex_lock(&(inode_table_s.inode_table_mutex));
 
-    if (!valid_inumber(inumber) || inode_table_s.freeinode_ts[inumber] == FREE) {
-        pthread_mutex_unlock(&(inode_table_s.inode_table_mutex));
+    if (!valid_inumber(inumber)) {
         return -1;
     }
 
-    inode_table_s.freeinode_ts[inumber] = FREE;
-
-    inode_t *local_inode = &inode_table_s.inode_table[inumber];
+    uint64_t bit = (uint64_t)1 << (inumber % BITMAP_WORD_BITS);
 
-    if (local_inode->i_size > 0 && (data_block_free(local_inode->i_data_block) == -1)) {
-        pthread_mutex_unlock(&(inode_table_s.inode_table_mutex));
+    if ((atomic_load(&inode_table_s.freeinode_ts[inumber / BITMAP_WORD_BITS]) & bit) == 0) {
         return -1;
     }
 
-    pthread_mutex_unlock(&(inode_table_s.inode_table_mutex));
+    /* blocks are freed before the number is released, so a new owner of
+     * the i-node never sees them (nor its buffered writes) */
+    write_buffer_drop(&writeback_s.buffers[inumber]);
+    append_reset(&fs_state_s.appends[inumber]);
 
-    return 0;
+    if (inode_blocks_free(&inode_table_s.inode_table[inumber]) == -1) {
+        return -1;
+    }
+
+    return inode_release(inumber);
 }
 
 /*
@@ -240,496 +806,2837 @@ inode_t *inode_get(int inumber) {
 }
 
 /*
- * Adds an entry to the i-node directory data.
- * Input:
- *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry
- * Returns: SUCCESS or FAIL
+ * Hashes a file name (FNV-1a); only the part of the name that fits in a
+ * directory entry is used
  */
-int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
-    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
+static uint32_t dir_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < MAX_FILE_NAME - 1 && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Linear hashing: buckets before the split pointer were already split in
+ * this round, so they are addressed with one more bit of the hash
+ */
+static uint32_t dir_bucket_index(dir_header_t const *header, uint32_t hash) {
+    uint32_t bucket = hash & ((1u << header->dh_level) - 1);
+
+    if (bucket < header->dh_split) {
+        bucket = hash & ((1u << (header->dh_level + 1)) - 1);
+    }
+
+    return bucket;
+}
+
+static dir_header_t *dir_header_get(inode_t *dir) {
+    return (dir_header_t *)data_block_get(inode_block_get(dir, 0));
+}
+
+static int dir_bucket_block(inode_t *dir, uint32_t bucket) {
+    return inode_block_get(dir, bucket + 1);
+}
+
+static void dir_bucket_init(dir_bucket_t *bucket) {
+    bucket->db_count = 0;
+    bucket->db_next = -1;
+}
+
+/* Journals a bucket block: its header and the entries in use */
+static void dir_bucket_log(dir_bucket_t *bucket) {
+    metadata_log(bucket, sizeof(dir_bucket_t) + (size_t)bucket->db_count * sizeof(dir_entry_t));
+}
+
+/*
+ * Initializes an empty directory: a header block and one bucket
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_init(inode_t *dir) {
+
+    dir->i_size = 0;
+    inode_extents_init(dir);
+
+    if (inode_blocks_reserve(dir, 2) == -1) {
         return -1;
     }
 
-    pthread_rwlock_rdlock(&(inode_table_s.inode_table_rwlock));
+    dir->i_size = 2 * FS_BLOCK_SIZE;
 
-    inode_t *local_inode = &(inode_table_s.inode_table[inumber]);
+    dir_header_t *header = dir_header_get(dir);
+    dir_bucket_t *bucket = (dir_bucket_t *)data_block_get(dir_bucket_block(dir, 0));
 
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    if (local_inode->i_node_type != T_DIRECTORY) {
-        pthread_rwlock_unlock(&(inode_table_s.inode_table_rwlock));
+    if (header == NULL || bucket == NULL) {
+        inode_blocks_free(dir);
         return -1;
     }
 
-    if (strlen(sub_name) == 0) {
-        pthread_rwlock_unlock(&(inode_table_s.inode_table_rwlock));
+    header->dh_level = 0;
+    header->dh_split = 0;
+    header->dh_buckets = 1;
+    header->dh_entries = 0;
+
+    dir_bucket_init(bucket);
+
+    metadata_log(header, sizeof(dir_header_t));
+    metadata_log(bucket, sizeof(dir_bucket_t));
+
+    return 0;
+}
+
+/*
+ * Looks for a name in a directory. Caller must hold the directory lock.
+ * Returns: i-number of the entry, -1 if not found
+ */
+static int dir_lookup(inode_t *dir, char const *sub_name) {
+
+    dir_header_t *header = dir_header_get(dir);
+
+    if (header == NULL) {
+        return -1;
+    }
+
+    uint32_t bucket_index = dir_bucket_index(header, dir_hash(sub_name));
+    dir_bucket_t *bucket = (dir_bucket_t *)data_block_get(dir_bucket_block(dir, bucket_index));
+
+    while (bucket != NULL) {
+        for (int i = 0; i < bucket->db_count; i++) {
+            if (strncmp(bucket->db_entries[i].d_name, sub_name, MAX_FILE_NAME) == 0) {
+                return bucket->db_entries[i].d_inumber;
+            }
+        }
+        bucket = (dir_bucket_t *)data_block_get(bucket->db_next);
+    }
+
+    return -1;
+}
+
+/*
+ * Stores an entry in the first block of a bucket's chain with room for
+ * it, chaining a new overflow block if they are all full.
+ * Caller must hold the directory lock.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_bucket_append(inode_t *dir, uint32_t bucket_index, dir_entry_t const *entry) {
+
+    dir_bucket_t *bucket = (dir_bucket_t *)data_block_get(dir_bucket_block(dir, bucket_index));
+
+    if (bucket == NULL) {
+        return -1;
+    }
+
+    while (bucket->db_count == MAX_DIR_ENTRIES && bucket->db_next != -1) {
+        bucket = (dir_bucket_t *)data_block_get(bucket->db_next);
+
+        if (bucket == NULL) {
+            return -1;
+        }
+    }
+
+    if (bucket->db_count == MAX_DIR_ENTRIES) {
+        int overflow_block = data_block_alloc();
+        dir_bucket_t *overflow = (dir_bucket_t *)data_block_get(overflow_block);
+
+        if (overflow == NULL) {
+            return -1;
+        }
+
+        dir_bucket_init(overflow);
+        bucket->db_next = overflow_block;
+        metadata_log(bucket, sizeof(dir_bucket_t));
+        bucket = overflow;
+    }
+
+    bucket->db_entries[bucket->db_count] = *entry;
+    bucket->db_count++;
+
+    metadata_log(&bucket->db_entries[bucket->db_count - 1], sizeof(dir_entry_t));
+    metadata_log(bucket, sizeof(dir_bucket_t));
+
+    return 0;
+}
+
+/*
+ * Splits the bucket under the split pointer, appending a new bucket to the
+ * directory and moving there the entries whose hash now points to it.
+ * Every block the new bucket needs is allocated before anything is moved;
+ * the entries that stay are then packed in the old chain, whose overflow
+ * blocks left empty are freed last.
+ * Caller must hold the directory lock.
+ * Returns: 0 if successful, -1 otherwise (the directory is left as it was)
+ */
+static int dir_split(inode_t *dir, dir_header_t *header) {
+
+    uint32_t new_bucket = header->dh_buckets;
+    uint32_t mask = (1u << (header->dh_level + 1)) - 1;
+
+    if (new_bucket + 2 > fs_params.data_blocks) {
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(local_inode->i_data_block);
+    dir_bucket_t *old = (dir_bucket_t *)data_block_get(dir_bucket_block(dir, header->dh_split));
+
+    if (old == NULL) {
+        return -1;
+    }
+
+    /* take a copy of every entry in the chain being split */
+    size_t count = 0;
+
+    for (dir_bucket_t *b = old; b != NULL; b = (dir_bucket_t *)data_block_get(b->db_next)) {
+        count += (size_t)b->db_count;
+    }
+
+    dir_entry_t *entries = (dir_entry_t *)malloc(count * sizeof(dir_entry_t) + 1);
+
+    if (entries == NULL) {
+        return -1;
+    }
+
+    size_t moving = 0;
+
+    count = 0;
+
+    for (dir_bucket_t *b = old; b != NULL; b = (dir_bucket_t *)data_block_get(b->db_next)) {
+        for (int i = 0; i < b->db_count; i++) {
+            if ((dir_hash(b->db_entries[i].d_name) & mask) == new_bucket) {
+                moving++;
+            }
+        }
+
+        memcpy(&entries[count], b->db_entries, (size_t)b->db_count * sizeof(dir_entry_t));
+        count += (size_t)b->db_count;
+    }
+
+    /* the new bucket's first block, and the overflow blocks its chain needs */
+    size_t overflows = moving == 0 ? 0 : (moving - 1) / MAX_DIR_ENTRIES;
+    int *chain = (int *)malloc((overflows + 1) * sizeof(int));
+    dir_bucket_t **buckets = (dir_bucket_t **)malloc((overflows + 1) * sizeof(dir_bucket_t *));
+
+    if (chain == NULL || buckets == NULL || inode_blocks_reserve(dir, new_bucket + 2) == -1) {
+        free(chain);
+        free(buckets);
+        free(entries);
+        return -1;
+    }
+
+    for (size_t i = 0; i <= overflows; i++) {
+        chain[i] = i == 0 ? dir_bucket_block(dir, new_bucket) : data_block_alloc();
+        buckets[i] = (dir_bucket_t *)data_block_get(chain[i]);
+
+        if (buckets[i] == NULL) {
+            while (--i > 0) {
+                data_block_free(chain[i]);
+            }
+
+            free(chain);
+            free(buckets);
+            free(entries);
+            return -1;
+        }
+
+        dir_bucket_init(buckets[i]);
+    }
+
+    size_t link = 0;
+    size_t kept = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if ((dir_hash(entries[i].d_name) & mask) != new_bucket) {
+            entries[kept++] = entries[i];
+            continue;
+        }
+
+        if (buckets[link]->db_count == MAX_DIR_ENTRIES) {
+            buckets[link]->db_next = chain[link + 1];
+            dir_bucket_log(buckets[link]);
+            link++;
+        }
+
+        buckets[link]->db_entries[buckets[link]->db_count++] = entries[i];
+    }
+
+    dir_bucket_log(buckets[link]);
+    free(chain);
+    free(buckets);
+
+    /* pack the entries that stay in the first blocks of the old chain */
+    dir_bucket_t *b = old;
+    size_t placed = 0;
+
+    for (;;) {
+        size_t n = kept - placed < MAX_DIR_ENTRIES ? kept - placed : MAX_DIR_ENTRIES;
+
+        memcpy(b->db_entries, &entries[placed], n * sizeof(dir_entry_t));
+        b->db_count = (int)n;
+        placed += n;
+
+        if (placed == kept) {
+            break;
+        }
+
+        dir_bucket_log(b);
+        b = (dir_bucket_t *)data_block_get(b->db_next);
+    }
+
+    int overflow_block = b->db_next;
+
+    b->db_next = -1;
+    dir_bucket_log(b);
+
+    while (overflow_block != -1) {
+        dir_bucket_t *overflow = (dir_bucket_t *)data_block_get(overflow_block);
+
+        if (overflow == NULL) {
+            break;
+        }
+
+        int next = overflow->db_next;
+
+        data_block_free(overflow_block);
+        overflow_block = next;
+    }
+
+    free(entries);
+
+    dir->i_size = (new_bucket + 2) * FS_BLOCK_SIZE;
+    journal_inode(dir);
+
+    header->dh_buckets++;
+    header->dh_split++;
+
+    if (header->dh_split == 1u << header->dh_level) {
+        header->dh_level++;
+        header->dh_split = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Adds an entry to the i-node directory data.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
+ * Returns: SUCCESS or FAIL (also if the name already exists)
+ */
+int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
+    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
+        return -1;
+    }
+
+    if (strlen(sub_name) == 0) {
+        return -1;
+    }
+
+    dir_entry_t entry;
+
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.d_name, sub_name, MAX_FILE_NAME - 1);
+    entry.d_inumber = sub_inumber;
+
+    inode_t *local_inode = &(inode_table_s.inode_table[inumber]);
+
+    insert_delay(); // simulate storage access delay to i-node with inumber
+
+    /* Only this directory is locked, so lookups and changes to other
+     * directories (and the open file table) go on in parallel */
+    if (inode_lock(local_inode, WRITE) != 0) {
+        return -1;
+    }
+
+    if (local_inode->i_node_type != T_DIRECTORY) {
+        inode_unlock(local_inode, WRITE);
+        return -1;
+    }
+
+    /* Locates the block containing the directory's hashing state */
+    dir_header_t *header = dir_header_get(local_inode);
+
+    if (header == NULL || dir_lookup(local_inode, entry.d_name) != -1) {
+        inode_unlock(local_inode, WRITE);
+        return -1;
+    }
+
+    if (dir_bucket_append(local_inode, dir_bucket_index(header, dir_hash(entry.d_name)), &entry) == -1) {
+        inode_unlock(local_inode, WRITE);
+        return -1;
+    }
+
+    header->dh_entries++;
+
+    /* Grows the table by one bucket once it is 3/4 full */
+    if (4 * (size_t)header->dh_entries > 3 * (size_t)header->dh_buckets * MAX_DIR_ENTRIES &&
+        dir_split(local_inode, header) == -1) {
+        printf("[ add_dir_entry ] Error : bucket not split, directory left as it was\n");
+    }
+
+    metadata_log(header, sizeof(dir_header_t));
+
+    /* Publishes the name to lock-free lookups (replacing a cached miss) */
+    dcache_insert(inumber, entry.d_name, sub_inumber);
+
+    inode_unlock(local_inode, WRITE);
+
+    return 0;
+}
+
+/*
+ * Removes an entry from the i-node directory data. The hole is filled with
+ * the last entry of the chain, and an overflow block left empty is freed.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_name: name of the sub i-node entry
+ * Returns: SUCCESS or FAIL
+ */
+int clear_dir_entry(int inumber, char const *sub_name) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    inode_t *local_inode = &(inode_table_s.inode_table[inumber]);
+
+    insert_delay(); // simulate storage access delay to i-node with inumber
+
+    if (inode_lock(local_inode, WRITE) != 0) {
+        return -1;
+    }
+
+    dir_header_t *header = NULL;
+
+    if (local_inode->i_node_type == T_DIRECTORY) {
+        header = dir_header_get(local_inode);
+    }
+
+    if (header == NULL) {
+        inode_unlock(local_inode, WRITE);
+        return -1;
+    }
+
+    uint32_t bucket_index = dir_bucket_index(header, dir_hash(sub_name));
+    int block_number = dir_bucket_block(local_inode, bucket_index);
+    int previous_number = -1;
+    dir_bucket_t *found_bucket = NULL;
+    int found_index = -1;
+    dir_bucket_t *bucket = (dir_bucket_t *)data_block_get(block_number);
+
+    /* walks the whole chain: the entry to remove and the last one are needed */
+    while (bucket != NULL) {
+        for (int i = 0; found_bucket == NULL && i < bucket->db_count; i++) {
+            if (strncmp(bucket->db_entries[i].d_name, sub_name, MAX_FILE_NAME) == 0) {
+                found_bucket = bucket;
+                found_index = i;
+            }
+        }
+
+        if (bucket->db_next == -1) {
+            break;
+        }
+
+        previous_number = block_number;
+        block_number = bucket->db_next;
+        bucket = (dir_bucket_t *)data_block_get(block_number);
+    }
+
+    if (found_bucket == NULL || bucket == NULL) {
+        inode_unlock(local_inode, WRITE);
+        return -1;
+    }
+
+    bucket->db_count--;
+    found_bucket->db_entries[found_index] = bucket->db_entries[bucket->db_count];
+
+    metadata_log(&found_bucket->db_entries[found_index], sizeof(dir_entry_t));
+    metadata_log(bucket, sizeof(dir_bucket_t));
+
+    if (bucket->db_count == 0 && previous_number != -1) {
+        dir_bucket_t *previous = (dir_bucket_t *)data_block_get(previous_number);
+
+        if (previous != NULL) {
+            previous->db_next = -1;
+            metadata_log(previous, sizeof(dir_bucket_t));
+            data_block_free(block_number);
+        }
+    }
+
+    header->dh_entries--;
+    metadata_log(header, sizeof(dir_header_t));
+
+    /* Lookups already past the cached entry finish with it; it is freed
+     * once they are all gone */
+    dcache_remove(inumber, sub_name);
+
+    inode_unlock(local_inode, WRITE);
+
+    return 0;
+}
+
+/* Looks for a given name inside a directory
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name to search
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+int find_in_dir(int inumber, char const *sub_name) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    /* Fast path: names already known are resolved without any lock */
+    int sub_inumber = dcache_lookup(inumber, sub_name);
+
+    if (sub_inumber != DCACHE_MISS) {
+        return sub_inumber;
+    }
+
+    insert_delay(); // simulate storage access delay to i-node with inumber
+
+    inode_t *local_inode = &(inode_table_s.inode_table[inumber]);
+
+    /* Lookups share the directory's lock, so they run in parallel */
+    if (inode_lock(local_inode, READ) != 0) {
+        return -1;
+    }
+
+    sub_inumber = -1;
+
+    if (local_inode->i_node_type == T_DIRECTORY) {
+        /* Hashes the name to the one bucket chain that can hold it */
+        sub_inumber = dir_lookup(local_inode, sub_name);
+
+        /* Writers are kept out by the lock, so the answer is still current;
+         * misses are cached too, which keeps repeated probes for missing
+         * names (e.g. TFS_O_CREAT) off the directory blocks */
+        dcache_insert(inumber, sub_name, sub_inumber);
+    }
+
+    inode_unlock(local_inode, READ);
+
+    return sub_inumber;
+}
+
+/* Returns a word of the bitmap with the retired blocks counted as taken */
+static uint64_t free_blocks_word(size_t word) {
+    return data_blocks_s.free_blocks[word] | data_blocks_s.retired[word];
+}
+
+/*
+ * Looks for a run of free blocks in the block bitmap, a word at a time,
+ * starting at the next-fit position and wrapping around once.
+ * The first run with at least 'want' blocks wins; if there is none, the
+ * longest run found is returned instead.
+ * Must be called with data_blocks_mutex held.
+ * Input:
+ *  - want: number of contiguous blocks wanted
+ *  - run_length: where to store the length of the run found (<= want)
+ * Returns: first block of the run, -1 if every block is taken
+ */
+static int free_blocks_find_run(size_t want, size_t *run_length) {
+    size_t const total_bits = data_blocks_s.free_words * BITMAP_WORD_BITS;
+    size_t best_first = 0;
+    size_t best_length = 0;
+    size_t scanned = 0;
+    size_t pos = data_blocks_s.next_fit;
+
+    while (scanned < total_bits) {
+        size_t shift = pos % BITMAP_WORD_BITS;
+        uint64_t free_bits = ~free_blocks_word(pos / BITMAP_WORD_BITS) >> shift;
+
+        if (free_bits == 0) {
+            /* the rest of this word is taken */
+            scanned += BITMAP_WORD_BITS - shift;
+            pos += BITMAP_WORD_BITS - shift;
+            if (pos >= total_bits) {
+                pos = 0;
+            }
+            continue;
+        }
+
+        size_t skip = (size_t)__builtin_ctzll(free_bits);
+        pos += skip;
+        scanned += skip;
+
+        /* pos is free: measure how far the run goes (padding bits are taken) */
+        size_t first = pos;
+        size_t length = 0;
+
+        while (length < want && pos < fs_params.data_blocks) {
+            shift = pos % BITMAP_WORD_BITS;
+            uint64_t taken_bits = free_blocks_word(pos / BITMAP_WORD_BITS) >> shift;
+            size_t span = BITMAP_WORD_BITS - shift;
+            size_t free_span = taken_bits == 0 ? span : (size_t)__builtin_ctzll(taken_bits);
+
+            length += free_span;
+            pos += free_span;
+
+            if (free_span < span) {
+                break;
+            }
+        }
+
+        if (length >= want) {
+            *run_length = want;
+            return (int)first;
+        }
+
+        if (length > best_length) {
+            best_first = first;
+            best_length = length;
+        }
+
+        scanned += length;
+        if (pos >= total_bits) {
+            pos = 0;
+        }
+    }
+
+    if (best_length == 0) {
+        return -1;
+    }
+
+    *run_length = best_length;
+    return (int)best_first;
+}
+
+/*
+ * Sets (or clears) the bitmap bits of a run of blocks, a word at a time.
+ * Must be called with data_blocks_mutex held.
+ */
+static void free_blocks_mark(size_t first, size_t length, allocation_state_t state) {
+    while (length > 0) {
+        size_t shift = first % BITMAP_WORD_BITS;
+        size_t span = BITMAP_WORD_BITS - shift;
+
+        if (span > length) {
+            span = length;
+        }
+
+        uint64_t mask = span == BITMAP_WORD_BITS ? ~(uint64_t)0 : (((uint64_t)1 << span) - 1) << shift;
+
+        if (state == TAKEN) {
+            data_blocks_s.free_blocks[first / BITMAP_WORD_BITS] |= mask;
+        } else {
+            data_blocks_s.free_blocks[first / BITMAP_WORD_BITS] &= ~mask;
+        }
+
+        metadata_log(&data_blocks_s.free_blocks[first / BITMAP_WORD_BITS], sizeof(uint64_t));
+
+        first += span;
+        length -= span;
+    }
+}
+
+/* Whether every block of a range is free in the bitmap, and not retired */
+static bool free_blocks_all_free(size_t first, size_t length) {
+    for (size_t i = first; i < first + length; i++) {
+        if (free_blocks_word(i / BITMAP_WORD_BITS) & ((uint64_t)1 << (i % BITMAP_WORD_BITS))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Gives the memory behind a run of blocks that is about to be freed back to
+ * the system. Only whole pages can go, so the run is widened to the pages it
+ * touches when the rest of them is already free.
+ * Must be called with data_blocks_mutex held and before the run is marked
+ * free, so nobody can reuse the blocks before their pages are dropped.
+ */
+static void free_blocks_discard(size_t first, size_t length) {
+    size_t per_page = volume_s.v_page_size > FS_BLOCK_SIZE ? volume_s.v_page_size >> block_shift : 1;
+    size_t start = first - first % per_page;
+    size_t end = first + length;
+    size_t page_end = (end + per_page - 1) / per_page * per_page;
+
+    if (start < first && !free_blocks_all_free(start, first - start)) {
+        start += per_page;
+    }
+
+    if (page_end > end && (page_end > fs_params.data_blocks || !free_blocks_all_free(end, page_end - end))) {
+        page_end -= per_page;
+    }
+
+    if (page_end > start) {
+        volume_discard(&volume_s, start << block_shift, (page_end - start) << block_shift);
+    }
+}
+
+/*
+ * Forgets the copies of a run of blocks read into fs_data, so a block reused
+ * as a directory or extent tree block is read again, and drops them from the
+ * buffer cache without writing them back.
+ * Must be called with data_blocks_mutex held, before the run is marked free.
+ */
+static void free_blocks_evict(size_t first, size_t length) {
+    if (data_blocks_s.cached) {
+        bcache_invalidate(first, length);
+    }
+
+    if (data_blocks_s.resident == NULL) {
+        return;
+    }
+
+    while (length > 0) {
+        size_t shift = first % BITMAP_WORD_BITS;
+        size_t span = BITMAP_WORD_BITS - shift;
+
+        if (span > length) {
+            span = length;
+        }
+
+        uint64_t mask = span == BITMAP_WORD_BITS ? ~(uint64_t)0 : (((uint64_t)1 << span) - 1) << shift;
+
+        atomic_fetch_and(&data_blocks_s.resident[first / BITMAP_WORD_BITS], ~mask);
+
+        first += span;
+        length -= span;
+    }
+}
+
+/*
+ * Sets (or clears) the retired bits of a run of blocks (see data_blocks_t)
+ * Must be called with data_blocks_mutex held.
+ */
+static void free_blocks_retire(size_t first, size_t length, bool retired) {
+
+    if (retired) {
+        data_blocks_s.retired_count += length;
+    } else {
+        data_blocks_s.retired_count -= length;
+    }
+
+    while (length > 0) {
+        size_t shift = first % BITMAP_WORD_BITS;
+        size_t span = BITMAP_WORD_BITS - shift;
+
+        if (span > length) {
+            span = length;
+        }
+
+        uint64_t mask = span == BITMAP_WORD_BITS ? ~(uint64_t)0 : (((uint64_t)1 << span) - 1) << shift;
+
+        if (retired) {
+            data_blocks_s.retired[first / BITMAP_WORD_BITS] |= mask;
+        } else {
+            data_blocks_s.retired[first / BITMAP_WORD_BITS] &= ~mask;
+        }
+
+        first += span;
+        length -= span;
+    }
+}
+
+/*
+ * Allocated a new data block
+ * Returns: block index if successful, -1 otherwise
+ */
+int data_block_alloc() {
+    int allocated = 0;
+
+    return data_block_alloc_n(1, &allocated);
+}
+
+/*
+ * Allocates a run of contiguous data blocks with a single bitmap scan
+ * Inputs:
+ *  - n: number of blocks wanted
+ *  - allocated: where to store how many blocks were actually allocated; it is
+ *    lower than n when no free run of n blocks exists, in which case the
+ *    longest free run is returned and the caller asks again for the rest
+ * Returns: first block of the run if successful, -1 otherwise
+ */
+int data_block_alloc_n(int n, int *allocated) {
+
+    size_t length = 0;
+
+    if (n <= 0 || allocated == NULL) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay to free_blocks
+
+    pthread_mutex_lock(&(data_blocks_s.data_blocks_mutex));
+
+    int first = free_blocks_find_run((size_t)n, &length);
+
+    /* the only free blocks left may be waiting for their last readers */
+    if (first == -1 && data_blocks_s.retired_count > 0) {
+        pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
+        epoch_barrier();
+        pthread_mutex_lock(&(data_blocks_s.data_blocks_mutex));
+
+        first = free_blocks_find_run((size_t)n, &length);
+    }
+
+    if (first != -1) {
+        free_blocks_mark((size_t)first, length, TAKEN);
+        data_blocks_s.next_fit = ((size_t)first + length) % fs_params.data_blocks;
+    }
+
+    pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
+
+    *allocated = (int)length;
+
+    return first;
+}
+
+/* Frees a data block
+ * Input
+ * 	- the block index
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_free(int block_number) {
+
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay to free_blocks
+
+    pthread_mutex_lock(&(data_blocks_s.data_blocks_mutex));
+
+    free_blocks_discard((size_t)block_number, 1);
+    free_blocks_evict((size_t)block_number, 1);
+    free_blocks_mark((size_t)block_number, 1, FREE);
+    journal_revoke(volume_s.v_data_offset + FS_BLOCK_START(block_number), FS_BLOCK_SIZE);
+
+    pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
+
+    return 0;
+}
+
+/* Frees a run of contiguous data blocks
+ * Input
+ * 	- the first block index
+ * 	- the number of blocks
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_free_n(int block_number, int n) {
+
+    if (n <= 0 || !valid_block_number(block_number) || !valid_block_number(block_number + n - 1)) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay to free_blocks
+
+    pthread_mutex_lock(&(data_blocks_s.data_blocks_mutex));
+
+    free_blocks_discard((size_t)block_number, (size_t)n);
+    free_blocks_evict((size_t)block_number, (size_t)n);
+    free_blocks_mark((size_t)block_number, (size_t)n, FREE);
+    journal_revoke(volume_s.v_data_offset + FS_BLOCK_START(block_number), (size_t)n << block_shift);
+
+    pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
+
+    return 0;
+}
+
+/* A run of retired blocks, waiting for its grace period (see epoch.h) */
+typedef struct {
+    size_t rr_first;
+    size_t rr_length;
+} retired_run_t;
+
+/* Hands a run of retired blocks out again, once no reader can see it */
+static void retired_run_reuse(void *ptr) {
+
+    retired_run_t *run = (retired_run_t *)ptr;
+
+    pthread_mutex_lock(&(data_blocks_s.data_blocks_mutex));
+
+    free_blocks_discard(run->rr_first, run->rr_length);
+    free_blocks_evict(run->rr_first, run->rr_length);
+    free_blocks_retire(run->rr_first, run->rr_length, false);
+
+    pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
+
+    free(run);
+}
+
+/* Frees a run of contiguous data blocks that readers without the inode
+ * lock may still be reading (see inode_readv). The run is free on the
+ * volume at once, but it is not handed out again, and its memory and
+ * cached copies stay, until every reader that could see it is done.
+ * Input
+ * 	- the first block index
+ * 	- the number of blocks
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_retire_n(int block_number, int n) {
+
+    if (n <= 0 || !valid_block_number(block_number) || !valid_block_number(block_number + n - 1)) {
+        return -1;
+    }
+
+    retired_run_t *run = (retired_run_t *)malloc(sizeof(retired_run_t));
+
+    if (run == NULL) {
+        printf("[ data_block_retire_n ] Error : %s\n", strerror(errno));
+        return -1;
+    }
+
+    run->rr_first = (size_t)block_number;
+    run->rr_length = (size_t)n;
+
+    insert_delay(); // simulate storage access delay to free_blocks
+
+    pthread_mutex_lock(&(data_blocks_s.data_blocks_mutex));
+
+    free_blocks_retire(run->rr_first, run->rr_length, true);
+    free_blocks_mark(run->rr_first, run->rr_length, FREE);
+    journal_revoke(volume_s.v_data_offset + FS_BLOCK_START(block_number), (size_t)n << block_shift);
+
+    pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
+
+    epoch_retire(run, retired_run_reuse);
+
+    return 0;
+}
+
+/* Returns a pointer to the contents of a directory or extent tree block,
+ * which are changed in place. Unless the device is memory, the block is
+ * read into fs_data the first time and stays there until it is freed; its
+ * changes reach the image only through the journal. File data never goes
+ * through here (see inode_writev_at).
+ * Input:
+ * 	- Block's index
+ * Returns: pointer to the first byte of the block, NULL otherwise
+ */
+void *data_block_get(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return NULL;
+    }
+
+    insert_delay(); // simulate storage access delay to block
+
+    void *mapped = bdev_map(data_blocks_s.device, FS_BLOCK_START(block_number));
+
+    if (mapped != NULL) {
+        return mapped;
+    }
+
+    char *block = data_blocks_s.fs_data + FS_BLOCK_START(block_number);
+    _Atomic uint64_t *word = &data_blocks_s.resident[(size_t)block_number / BITMAP_WORD_BITS];
+    uint64_t bit = (uint64_t)1 << ((size_t)block_number % BITMAP_WORD_BITS);
+
+    if (atomic_load_explicit(word, memory_order_acquire) & bit) {
+        return block;
+    }
+
+    pthread_mutex_lock(&(data_blocks_s.resident_mutex));
+
+    if (!(atomic_load_explicit(word, memory_order_relaxed) & bit)) {
+        if (bdev_read(data_blocks_s.device, FS_BLOCK_START(block_number), block, FS_BLOCK_SIZE) == -1) {
+            pthread_mutex_unlock(&(data_blocks_s.resident_mutex));
+            return NULL;
+        }
+
+        atomic_fetch_or_explicit(word, bit, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&(data_blocks_s.resident_mutex));
+
+    return block;
+}
+
+/* Add new entry to the open file table
+ * Inputs:
+ * 	- I-node number of the file to open
+ * 	- Initial offset
+ * 	- Whether writes append to the file
+ * Returns: file handle if successful, -1 otherwise
+ */
+int add_to_open_file_table(int inumber, uint64_t offset, bool append) {
+
+    for (int i = 0; (size_t)i < fs_params.max_open_files; i++) {
+
+        if (fs_state_s.free_open_file_entries[i] == FREE) {
+            fs_state_s.free_open_file_entries[i] = TAKEN;
+            fs_state_s.open_file_table[i].of_inumber = inumber;
+            fs_state_s.open_file_table[i].of_offset = offset;
+            fs_state_s.open_file_table[i].of_append = append;
+            fs_state_s.open_file_table[i].of_extent_cache.ec_length = 0;
+            fs_state_s.open_file_table[i].of_access = ACCESS_NORMAL;
+            fs_state_s.open_file_table[i].of_ra_next = offset;
+            fs_state_s.open_file_table[i].of_ra_until = 0;
+            fs_state_s.open_file_table[i].of_ra_window = 0;
+
+            return i;
+        }       
+
+    }
+
+    return -1;
+}
+
+/* Frees an entry from the open file table
+ * Inputs:
+ * 	- file handle to free/close
+ * Returns 0 is success, -1 otherwise
+ */
+int remove_from_open_file_table(int fhandle) {
+
+    pthread_mutex_lock(&(fs_state_s.fs_state_mutex));
+
+    if (!valid_file_handle(fhandle) ||
+        fs_state_s.free_open_file_entries[fhandle] != TAKEN) {
+
+        pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
+
+        return -1;
+    }
+
+    fs_state_s.free_open_file_entries[fhandle] = FREE;
+
+    pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
+
+    return 0;
+}
+
+/* Returns pointer to a given entry in the open file table
+ * Inputs:
+ * 	 - file handle
+ * Returns: pointer to the entry if sucessful, NULL otherwise
+ */
+open_file_entry_t *get_open_file_entry(int fhandle) {
+    if (!valid_file_handle(fhandle)) {
+        return NULL;
+    }
+
+    return &(fs_state_s.open_file_table[fhandle]);
+}
+
+
+
+// ------------------------------- AUX FUNCTIONS ---------------------------------------------
+
+/* Leaves an inode with an empty block map. The generation is never reset,
+ * so translations cached for a previous file in the same i-node are
+ * dropped too.
+ */
+void inode_extents_init(inode_t *inode) {
+    inode->i_extent_count = 0;
+    inode->i_tree_depth = 0;
+    inode->i_map_generation++;
+}
+
+/* A node of an extent tree: the root lives in the inode, the other nodes
+ * fill a data block each
+ */
+typedef struct {
+    extent_t *entries;
+    uint32_t *count;
+    uint32_t capacity;
+} extent_tree_node_t;
+
+static extent_tree_node_t extent_tree_root(inode_t *inode) {
+    extent_tree_node_t root = {inode->i_extents, &inode->i_extent_count, INODE_EXTENTS};
+    return root;
+}
+
+/* Block map of a file as a reader sees it: the root of its extent tree,
+ * how many levels hang below the root and the generation of the map.
+ * Readers holding the inode lock use the i-node's own, the others a copy
+ * published with the size (see inode_view_published).
+ */
+typedef struct {
+    extent_tree_node_t bm_root;
+    uint32_t bm_depth;
+    uint64_t bm_generation;
+} block_map_t;
+
+static block_map_t inode_block_map(inode_t *inode) {
+    block_map_t map = {extent_tree_root(inode), inode->i_tree_depth, inode->i_map_generation};
+    return map;
+}
+
+/* Loads the node stored in a given data block
+ * Returns: true if sucessful, false otherwise
+ */
+static bool extent_tree_node(int block_number, extent_tree_node_t *node) {
+    extent_node_t *block = (extent_node_t *)data_block_get(block_number);
+
+    if (block == NULL) {
+        return false;
+    }
+
+    node->entries = block->eh_entries;
+    node->count = &block->eh_count;
+    node->capacity = (uint32_t)EXTENT_NODE_ENTRIES;
+
+    return true;
+}
+
+/* Binary search for the last entry of a (non-empty) node starting at or
+ * before a file block
+ */
+static uint32_t extent_tree_search(extent_tree_node_t const *node, uint64_t block_index) {
+    uint32_t low = 0;
+    uint32_t high = *node->count;
+
+    while (high - low > 1) {
+        uint32_t middle = (low + high) / 2;
+
+        if (node->entries[middle].e_logical <= block_index) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/* Finds the extent mapping a file block, descending one node per level.
+ * A node is never trusted to hold more entries than fit in it: readers
+ * without the inode lock may come across one being changed.
+ * Returns: the extent if the block is mapped, NULL otherwise
+ */
+static extent_t *extent_tree_find(block_map_t const *map, uint64_t block_index) {
+
+    extent_tree_node_t node = map->bm_root;
+
+    for (uint32_t depth = map->bm_depth;; depth--) {
+        if (*node.count == 0 || *node.count > node.capacity) {
+            return NULL;
+        }
+
+        extent_t *entry = &node.entries[extent_tree_search(&node, block_index)];
+
+        if (depth == 0) {
+            if (block_index < entry->e_logical || block_index >= (uint64_t)entry->e_logical + entry->e_length) {
+                return NULL;
+            }
+            return entry;
+        }
+
+        if (!extent_tree_node(entry->e_start, &node)) {
+            return NULL;
+        }
+    }
+}
+
+/* Number of blocks mapped by an inode (the map has no holes, so this is
+ * where its rightmost extent ends)
+ */
+static uint64_t inode_mapped_blocks(inode_t *inode) {
+
+    extent_tree_node_t node = extent_tree_root(inode);
+
+    for (uint32_t depth = inode->i_tree_depth;; depth--) {
+        if (*node.count == 0) {
+            return 0;
+        }
+
+        extent_t *last = &node.entries[*node.count - 1];
+
+        if (depth == 0) {
+            return (uint64_t)last->e_logical + last->e_length;
+        }
+
+        if (!extent_tree_node(last->e_start, &node)) {
+            return 0;
+        }
+    }
+}
+
+/* Finds the data block holding a given block of a file through a block
+ * map (see inode_extent_lookup)
+ */
+static int block_map_lookup(block_map_t const *map, uint64_t block_index, extent_cache_t *cache,
+                            size_t *run_length) {
+
+    extent_t extent;
+
+    if (cache != NULL && cache->ec_generation == map->bm_generation &&
+        block_index >= cache->ec_logical && block_index < (uint64_t)cache->ec_logical + cache->ec_length) {
+
+        extent.e_logical = cache->ec_logical;
+        extent.e_start = cache->ec_start;
+        extent.e_length = cache->ec_length;
+    } else {
+        extent_t *found = extent_tree_find(map, block_index);
+
+        if (found == NULL) {
+            return -1;
+        }
+
+        extent = *found;
+
+        if (cache != NULL) {
+            cache->ec_generation = map->bm_generation;
+            cache->ec_logical = extent.e_logical;
+            cache->ec_start = extent.e_start;
+            cache->ec_length = extent.e_length;
+        }
+    }
+
+    uint32_t skip = (uint32_t)(block_index - extent.e_logical);
+
+    if (run_length != NULL) {
+        *run_length = extent.e_length - skip;
+    }
+
+    return extent.e_start + (int)skip;
+}
+
+/* Finds the data block holding a given block of an inode's contents, and
+ * how many blocks after it are physically contiguous
+ * Inputs:
+ *   - inode
+ *   - index of the block inside the file (0 is the first block)
+ *   - extent cached by the caller, checked first and refreshed on a miss
+ *     (can be NULL)
+ *   - where to store the length of the contiguous run starting at the
+ *     block (can be NULL)
+ * Returns: block number if the block is mapped, -1 otherwise
+ */
+int inode_extent_lookup(inode_t *inode, uint64_t block_index, extent_cache_t *cache, size_t *run_length) {
+    block_map_t map = inode_block_map(inode);
+
+    return block_map_lookup(&map, block_index, cache, run_length);
+}
+
+/* Returns the data block holding a given block of an inode's contents
+ * Inputs:
+ *   - inode
+ *   - index of the block inside the file (0 is the first block)
+ * Returns: block number if the block is mapped, -1 otherwise
+ */
+int inode_block_get(inode_t *inode, uint64_t block_index) {
+    return inode_extent_lookup(inode, block_index, NULL, NULL);
+}
+
+/* Moves the root's entries to a new node right below it, making the tree
+ * one level deeper
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+static int extent_tree_grow(inode_t *inode) {
+
+    if (inode->i_tree_depth == EXTENT_TREE_MAX_DEPTH) {
+        printf("[ extent_tree_grow ] Error : block map is full\n");
+        return -1;
+    }
+
+    int block_number = data_block_alloc();
+    extent_node_t *node = (extent_node_t *)data_block_get(block_number);
+
+    if (node == NULL) {
+        printf("[ extent_tree_grow ] Error : alloc block failed\n");
+        return -1;
+    }
+
+    node->eh_count = inode->i_extent_count;
+    node->eh_depth = inode->i_tree_depth;
+    memcpy(node->eh_entries, inode->i_extents, inode->i_extent_count * sizeof(extent_t));
+    metadata_log(node, sizeof(extent_node_t) + node->eh_count * sizeof(extent_t));
+
+    inode->i_extents[0].e_logical = 0;
+    inode->i_extents[0].e_start = block_number;
+    inode->i_extents[0].e_length = 0;
+    inode->i_extent_count = 1;
+    inode->i_tree_depth++;
+
+    return 0;
+}
+
+/* Appends a run of blocks to the end of an inode's block map, growing the
+ * last extent when the run is physically next to it. Otherwise the new
+ * extent goes to the lowest node on the rightmost path with a free slot,
+ * under a fresh chain of nodes if that node is not a leaf.
+ * Returns: 0 if sucessful, -1 otherwise (no room for another extent)
+ */
+static int inode_extent_append(inode_t *inode, int block_number, uint32_t length) {
+
+    extent_tree_node_t path[EXTENT_TREE_MAX_DEPTH + 1];
+    uint32_t depth = inode->i_tree_depth;
+
+    path[0] = extent_tree_root(inode);
+
+    for (uint32_t level = 0; level < depth; level++) {
+        if (*path[level].count == 0 ||
+            !extent_tree_node(path[level].entries[*path[level].count - 1].e_start, &path[level + 1])) {
+            return -1;
+        }
+    }
+
+    extent_tree_node_t *leaf = &path[depth];
+    uint64_t mapped = 0;
+
+    if (*leaf->count > 0) {
+        extent_t *last = &leaf->entries[*leaf->count - 1];
+
+        if (last->e_start + (int)last->e_length == block_number && last->e_length <= UINT32_MAX - length) {
+            last->e_length += length;
+            metadata_log(last, sizeof(extent_t));
+            return 0;
+        }
+
+        mapped = (uint64_t)last->e_logical + last->e_length;
+    }
+
+    int level = (int)depth;
+
+    while (level >= 0 && *path[level].count == path[level].capacity) {
+        level--;
+    }
+
+    if (level < 0) {
+        if (extent_tree_grow(inode) == -1) {
+            return -1;
+        }
+        return inode_extent_append(inode, block_number, length);
+    }
+
+    /* build the new nodes bottom-up, each one holding the previous */
+    extent_t entry = {(uint32_t)mapped, block_number, length};
+    int chain[EXTENT_TREE_MAX_DEPTH];
+    uint32_t chain_length = depth - (uint32_t)level;
+
+    for (uint32_t node_depth = 0; node_depth < chain_length; node_depth++) {
+        chain[node_depth] = data_block_alloc();
+        extent_node_t *node = (extent_node_t *)data_block_get(chain[node_depth]);
+
+        if (node == NULL) {
+            printf("[ inode_extent_append ] Error : alloc block failed\n");
+            for (uint32_t i = 0; i < node_depth; i++) {
+                data_block_free(chain[i]);
+            }
+            return -1;
+        }
+
+        node->eh_count = 1;
+        node->eh_depth = node_depth;
+        node->eh_entries[0] = entry;
+        metadata_log(node, sizeof(extent_node_t) + sizeof(extent_t));
+
+        entry.e_start = chain[node_depth];
+        entry.e_length = 0;
+    }
+
+    path[level].entries[(*path[level].count)++] = entry;
+
+    metadata_log(&path[level].entries[*path[level].count - 1], sizeof(extent_t));
+    metadata_log(path[level].count, sizeof(uint32_t));
+
+    return 0;
+}
+
+/* Maps data blocks to an inode until its first block_count blocks are all
+ * mapped. Every missing block is asked to the allocator at once, so a
+ * large write usually costs one allocator call and a single extent.
+ * Inputs:
+ *   - inode
+ *   - number of blocks the file must have mapped
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+int inode_blocks_reserve(inode_t *inode, uint64_t block_count) {
+
+    if (block_count > MAX_DATA_BLOCKS_FOR_INODE) {
+        block_count = MAX_DATA_BLOCKS_FOR_INODE;
+    }
+
+    /* blocks left mapped by a previous failed write are reused */
+    uint64_t mapped = inode_mapped_blocks(inode);
+
+    while (mapped < block_count) {
+        int allocated = 0;
+        uint64_t missing = block_count - mapped;
+        int block_number = data_block_alloc_n(missing > fs_params.data_blocks ? (int)fs_params.data_blocks : (int)missing, &allocated);
+
+        if (block_number == -1) {
+            printf("[ inode_blocks_reserve ] Error : alloc block failed\n");
+            return -1;
+        }
+
+        if (inode_extent_append(inode, block_number, (uint32_t)allocated) == -1) {
+            data_block_free_n(block_number, allocated);
+            return -1;
+        }
+
+        mapped += (uint64_t)allocated;
+    }
+
+    journal_inode(inode);
+
+    return 0;
+}
+
+/* Frees the blocks under a node of an extent tree and, for index nodes,
+ * the child nodes themselves. They are retired (see data_block_retire_n):
+ * readers that found them before the tree was emptied may still use them.
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+static int extent_tree_free(extent_tree_node_t const *node, uint32_t depth) {
+
+    for (uint32_t i = 0; i < *node->count; i++) {
+        extent_t *entry = &node->entries[i];
+
+        if (depth == 0) {
+            if (data_block_retire_n(entry->e_start, (int)entry->e_length) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        extent_tree_node_t child;
+
+        if (!extent_tree_node(entry->e_start, &child) ||
+            extent_tree_free(&child, depth - 1) == -1 ||
+            data_block_retire_n(entry->e_start, 1) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Frees every data block mapped to an inode, a whole extent at a time,
+ * along with the nodes of its extent tree
+ * Inputs:
+ *   - inode
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+int inode_blocks_free(inode_t *inode) {
+
+    extent_tree_node_t root = extent_tree_root(inode);
+
+    if (extent_tree_free(&root, inode->i_tree_depth) == -1) {
+        return -1;
+    }
+
+    inode_extents_init(inode);
+    journal_inode(inode);
+
+    /* with no reader left behind, the blocks can be used again at once */
+    epoch_reclaim();
+
+    return 0;
+}
+
+/* Empties a file
+ * Inputs:
+ *   - inode
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+int inode_truncate(inode_t *inode) {
+
+    write_buffer_drop(inode_write_buffer(inode));
+    append_reset(inode_append(inode));
+
+    if (inode_blocks_free(inode) == -1) {
+        return -1;
+    }
+
+    inode->i_size = 0;
+    journal_inode(inode);
+
+    return 0;
+}
+
+/*
+ * Reads file data from the device, through the buffer cache if there is
+ * one; only blocks that miss it pay the storage access delay
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int data_read(uint64_t offset, void *buffer, size_t length) {
+    if (!data_blocks_s.cached) {
+        insert_delay(); // simulate storage access delay to block
+        return bdev_read(data_blocks_s.device, offset, buffer, length);
+    }
+
+    int missed = bcache_read(offset, buffer, length);
+
+    if (missed > 0) {
+        insert_delay();
+    }
+
+    return missed == -1 ? -1 : 0;
+}
+
+/*
+ * Writes file data (zeros if buffer is NULL) to the device, or to the
+ * buffer cache if there is one
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int data_write(uint64_t offset, void const *buffer, size_t length) {
+    if (!data_blocks_s.cached) {
+        insert_delay(); // simulate storage access delay to block
+        return buffer == NULL ? bdev_zero(data_blocks_s.device, offset, length)
+                              : bdev_write(data_blocks_s.device, offset, buffer, length);
+    }
+
+    int missed = bcache_write(offset, buffer, length);
+
+    if (missed > 0) {
+        insert_delay();
+    }
+
+    return missed == -1 ? -1 : 0;
+}
+
+/* Fills [from, to) of an inode's contents with zeros (used when a write
+ * starts past the end of the file)
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+static int inode_zero_range(inode_t *inode, uint64_t from, uint64_t to) {
+
+    while (from < to) {
+        size_t run = 0;
+        int block = inode_extent_lookup(inode, FS_BLOCK_INDEX(from), NULL, &run);
+
+        if (!valid_block_number(block)) {
+            return -1;
+        }
+
+        size_t block_offset = FS_BLOCK_OFFSET(from);
+        size_t to_zero = run * FS_BLOCK_SIZE - block_offset;
+
+        if (to_zero > to - from) {
+            to_zero = to - from;
+        }
+
+        if (data_write(FS_BLOCK_START(block) + block_offset, NULL, to_zero) == -1) {
+            return -1;
+        }
+
+        from += to_zero;
+    }
+
+    return 0;
+}
+
+/* Writes a range of an inode's contents to its blocks, which must be
+ * mapped. Data is copied a whole contiguous run of blocks at a time.
+ * Inputs:
+ *   - inode
+ *   - extent cache to use for the lookups (NULL for none)
+ *   - offset in the file, buffer and n of bytes to write
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+static int inode_write_range(inode_t *inode, extent_cache_t *cache, uint64_t offset, void const *buffer,
+                             size_t write_size) {
+
+    size_t bytes_written = 0;
+
+    while (bytes_written < write_size) {
+
+        size_t run = 0;
+        int block = inode_extent_lookup(inode, FS_BLOCK_INDEX(offset), cache, &run);
+
+        if (!valid_block_number(block)) {
+            printf("[ inode_write_range ] Error : NULL block\n");
+            return -1;
+        }
+
+        size_t to_write_run = run * FS_BLOCK_SIZE - FS_BLOCK_OFFSET(offset);
+
+        if (to_write_run > write_size - bytes_written) {
+            to_write_run = write_size - bytes_written;
+        }
+
+        if (data_write(FS_BLOCK_START(block) + FS_BLOCK_OFFSET(offset), (char const *)buffer + bytes_written,
+                       to_write_run) == -1) {
+            return -1;
+        }
+
+        offset += to_write_run;
+        bytes_written += to_write_run;
+    }
+
+    return 0;
+}
+
+/* Returns how far the blocks of a file hold its contents: i_size, or the
+ * end of the appends written since i_size was last stored */
+static uint64_t inode_stored_size(inode_t *inode) {
+    uint64_t appended = atomic_load(&inode_append(inode)->ap_size);
+
+    return appended > inode->i_size ? appended : inode->i_size;
+}
+
+/*
+ * Returns the size of a file, counting the writes still in its write-back
+ * buffer
+ * Must be called with the inode locked.
+ */
+uint64_t inode_size(inode_t *inode) {
+    write_buffer_t const *wb = inode_write_buffer(inode);
+    uint64_t stored = inode_stored_size(inode);
+
+    if (wb->wb_length > 0 && wb->wb_offset + wb->wb_length > stored) {
+        return wb->wb_offset + wb->wb_length;
+    }
+
+    return stored;
+}
+
+/* Returns the published metadata of an i-node */
+static inode_meta_t *inode_meta(inode_t *inode) {
+    return &fs_state_s.inode_meta[inode - inode_table_s.inode_table];
+}
+
+/* Publishes the type, the size and the block-map root of an i-node (see
+ * inode_meta_t)
+ * Must be called with the inode write-locked, or before anybody can reach
+ * it.
+ */
+static void inode_publish(inode_t *inode) {
+    inode_meta_t *meta = inode_meta(inode);
+    write_buffer_t const *wb = inode_write_buffer(inode);
+    uint64_t seq = atomic_load_explicit(&meta->im_seq, memory_order_relaxed);
+
+    atomic_store_explicit(&meta->im_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&meta->im_type, (int)inode->i_node_type, memory_order_relaxed);
+    atomic_store_explicit(&meta->im_size, inode_size(inode), memory_order_relaxed);
+    atomic_store_explicit(&meta->im_stored, inode_stored_size(inode), memory_order_relaxed);
+    atomic_store_explicit(&meta->im_wb_offset, wb->wb_offset, memory_order_relaxed);
+    atomic_store_explicit(&meta->im_wb_length, wb->wb_length, memory_order_relaxed);
+
+    for (uint32_t i = 0; i < inode->i_extent_count; i++) {
+        atomic_store_explicit(&meta->im_extents[i].pe_logical, inode->i_extents[i].e_logical, memory_order_relaxed);
+        atomic_store_explicit(&meta->im_extents[i].pe_start, inode->i_extents[i].e_start, memory_order_relaxed);
+        atomic_store_explicit(&meta->im_extents[i].pe_length, inode->i_extents[i].e_length, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&meta->im_extent_count, inode->i_extent_count, memory_order_relaxed);
+    atomic_store_explicit(&meta->im_tree_depth, inode->i_tree_depth, memory_order_relaxed);
+    atomic_store_explicit(&meta->im_map_generation, inode->i_map_generation, memory_order_relaxed);
+
+    atomic_store_explicit(&meta->im_seq, seq + 2, memory_order_release);
+}
+
+/* Counts the start of something that may change the contents of a file
+ * (see inode_meta_t); readers without the lock see it before any byte
+ * changes */
+static void inode_change_start(inode_t *inode) {
+    atomic_fetch_add_explicit(&inode_meta(inode)->im_started, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/* Counts the end of something counted by inode_change_start */
+static void inode_change_finish(inode_t *inode) {
+    atomic_fetch_add_explicit(&inode_meta(inode)->im_finished, 1, memory_order_release);
+}
+
+/*
+ * Reads the type and size of an i-node without locking it (see
+ * inode_meta_t). The size is inode_size's, as of the last time the inode
+ * was write-locked or appended to.
+ * Inputs:
+ *   - inode
+ *   - where to put the type (can be NULL)
+ * Returns: the size
+ */
+uint64_t inode_stat(inode_t *inode, inode_type *type) {
+    inode_meta_t const *meta = inode_meta(inode);
+    uint64_t seq;
+    int meta_type;
+    uint64_t size;
+
+    for (;;) {
+        seq = atomic_load_explicit(&meta->im_seq, memory_order_acquire);
+
+        /* a writer is in the middle of publishing: let it finish */
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        meta_type = atomic_load_explicit(&meta->im_type, memory_order_relaxed);
+        size = atomic_load_explicit(&meta->im_size, memory_order_relaxed);
+
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&meta->im_seq, memory_order_relaxed) == seq) {
+            break;
+        }
+    }
+
+    uint64_t appended = atomic_load(&inode_append(inode)->ap_size);
+
+    if (type != NULL) {
+        *type = (inode_type)meta_type;
+    }
+
+    return appended > size ? appended : size;
+}
+
+/* Makes appends start at the end of the stored contents of a file, after
+ * a write that may have moved it (appends write the buffer back first)
+ * Must be called with the inode write-locked.
+ */
+static void append_sync(inode_t *inode) {
+    append_t *ap = inode_append(inode);
+    uint64_t size = inode_stored_size(inode);
+
+    atomic_store(&ap->ap_tail, size);
+    atomic_store(&ap->ap_size, size);
+}
+
+/* Lists an i-node for the flusher, unless it already is */
+static void writeback_list(int inumber) {
+    pthread_mutex_lock(&writeback_s.writeback_mutex);
+
+    if (!writeback_s.buffers[inumber].wb_listed) {
+        writeback_s.buffers[inumber].wb_listed = true;
+        writeback_s.dirty[writeback_s.dirty_count++] = inumber;
+    }
+
+    pthread_mutex_unlock(&writeback_s.writeback_mutex);
+}
+
+/*
+ * Whether a write of size bytes at offset can join what a write-back
+ * buffer holds: it must start inside or right after it and fit in it
+ */
+static bool write_buffer_fits(write_buffer_t const *wb, uint64_t offset, size_t size) {
+    return offset >= wb->wb_offset && offset <= wb->wb_offset + wb->wb_length &&
+           offset + size - wb->wb_offset <= WRITEBACK_SIZE;
+}
+
+/*
+ * Writes the write-back buffer of a file to its blocks, and stores the size
+ * the appends written since the last time reached. The blocks are only
+ * allocated now (delayed allocation), all at once, so the file gets them
+ * in as few runs as the free space allows.
+ * Must be called with the inode write-locked, inside a journal transaction.
+ * Inputs:
+ *   - inode
+ * Returns: 0 if sucessful (or there was nothing to write), -1 otherwise;
+ * on failure the buffer keeps its contents
+ */
+int inode_writeback(inode_t *inode) {
+
+    write_buffer_t *wb = inode_write_buffer(inode);
+    uint64_t end = inode_stored_size(inode);
+
+    if (wb->wb_length > 0) {
+        uint64_t wb_end = wb->wb_offset + wb->wb_length;
+
+        if (inode_blocks_reserve(inode, FS_BLOCK_INDEX(wb_end + FS_BLOCK_SIZE - 1)) == -1 ||
+            inode_write_range(inode, NULL, wb->wb_offset, wb->wb_data, wb->wb_length) == -1) {
+            printf("[ inode_writeback ] Error : buffered writes not written\n");
+            return -1;
+        }
+
+        if (wb_end > end) {
+            end = wb_end;
+        }
+
+        write_buffer_drop(wb);
+    }
+
+    if (end > inode->i_size) {
+        inode->i_size = end;
+        metadata_log(&inode->i_size, sizeof(inode->i_size));
+    }
+
+    append_sync(inode);
+
+    return 0;
+}
+
+/* Returns the number of bytes an array of iovecs covers */
+static size_t iov_length(struct iovec const *iov, int iovcnt) {
+    size_t length = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        length += iov[i].iov_len;
+    }
+
+    return length;
+}
+
+/* Whether two held ranges keep each other out */
+static bool ranges_conflict(range_t const *a, range_t const *b) {
+    return (a->r_write || b->r_write) && a->r_start < b->r_end && b->r_start < a->r_end;
+}
+
+/*
+ * Locks the bytes [start, end) of a file, shared (READ) or exclusively
+ * (WRITE), waiting for the conflicting ranges to be unlocked
+ * Must be called with the inode locked.
+ * Inputs:
+ *   - inode
+ *   - range : where to keep the range until it is unlocked
+ *   - start, end : the bytes
+ *   - lock_state : READ or WRITE
+ */
+static void inode_range_lock(inode_t *inode, range_t *range, uint64_t start, uint64_t end, lock_state_t lock_state) {
+
+    range_lock_t *lock = &fs_state_s.range_locks[inode - inode_table_s.inode_table];
+
+    range->r_start = start;
+    range->r_end = end;
+    range->r_write = lock_state == WRITE;
+
+    pthread_mutex_lock(&lock->rl_mutex);
+
+    for (range_t const *held = lock->rl_held; held != NULL;) {
+        if (ranges_conflict(held, range)) {
+            lock->rl_waiters++;
+            pthread_cond_wait(&lock->rl_cond, &lock->rl_mutex);
+            lock->rl_waiters--;
+            held = lock->rl_held;
+            continue;
+        }
+
+        held = held->r_next;
+    }
+
+    range->r_next = lock->rl_held;
+    lock->rl_held = range;
+
+    pthread_mutex_unlock(&lock->rl_mutex);
+}
+
+/* Unlocks a range locked with inode_range_lock */
+static void inode_range_unlock(inode_t *inode, range_t *range) {
+
+    range_lock_t *lock = &fs_state_s.range_locks[inode - inode_table_s.inode_table];
+
+    pthread_mutex_lock(&lock->rl_mutex);
+
+    range_t **link = &lock->rl_held;
+
+    while (*link != range) {
+        link = &(*link)->r_next;
+    }
+
+    *link = range->r_next;
+
+    if (lock->rl_waiters > 0) {
+        pthread_cond_broadcast(&lock->rl_cond);
+    }
+
+    pthread_mutex_unlock(&lock->rl_mutex);
+}
+
+/*
+ * Whether a write of length bytes at offset only changes data already
+ * stored: it is inside the file's blocks and misses its write-back buffer,
+ * so it maps nothing and leaves the size alone
+ * Must be called with the inode locked.
+ */
+bool inode_overwrites(inode_t *inode, uint64_t offset, size_t length) {
+
+    write_buffer_t const *wb = inode_write_buffer(inode);
+    uint64_t stored = inode_stored_size(inode);
+
+    if (offset >= stored || length > stored - offset) {
+        return false;
+    }
+
+    return wb->wb_length == 0 || offset + length <= wb->wb_offset || offset >= wb->wb_offset + wb->wb_length;
+}
+
+/*
+ * Writes over data already stored in a file (see inode_overwrites),
+ * gathering it from an array of iovecs. Only the bytes written are locked,
+ * so writes to other parts of the file run at the same time.
+ * Must be called with the inode locked (shared is enough).
+ * Inputs:
+ * 	 - inode
+ *   - extent cache to use for the lookups (NULL for none)
+ *   - offset in the file
+ *   - iovecs holding the data, and how many there are
+ * Returns: total of written bytes if sucessful, -1 otherwise
+ */
+ssize_t inode_overwritev_at(inode_t *inode, extent_cache_t *cache, uint64_t offset, struct iovec const *iov,
+                            int iovcnt) {
+
+    size_t write_size = iov_length(iov, iovcnt);
+    size_t done = 0;
+    ssize_t result = (ssize_t)write_size;
+    range_t range;
+
+    /* reads without a range see the write before any byte changes */
+    inode_change_start(inode);
+
+    inode_range_lock(inode, &range, offset, offset + write_size, WRITE);
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (inode_write_range(inode, cache, offset + done, iov[i].iov_base, iov[i].iov_len) == -1) {
+            result = -1;
+            break;
+        }
+
+        done += iov[i].iov_len;
+    }
+
+    inode_range_unlock(inode, &range);
+
+    inode_change_finish(inode);
+
+    return result;
+}
+
+/* Writes to a file at a given offset, gathering the data from an array of
+ * iovecs. Writes smaller than WRITEBACK_SIZE that do not leave a hole go to
+ * the file's write-back buffer, which is written once it fills up; any
+ * other write goes to the file's blocks, after the buffer, mapping all of
+ * them at once.
+ * Must be called with the inode write-locked.
+ * Inputs:
+ * 	 - inode
+ *   - extent cache to use for the lookups (NULL for none)
+ *   - offset in the file
+ *   - iovecs holding the data, and how many there are
+ * Returns: total of written bytes if sucessful, -1 otherwise
+ */
+ssize_t inode_writev_at(inode_t *inode, extent_cache_t *cache, uint64_t offset, struct iovec const *iov,
+                        int iovcnt) {
+
+    write_buffer_t *wb = inode_write_buffer(inode);
+    size_t write_size = iov_length(iov, iovcnt);
+    size_t done = 0;
+
+    if (offset >= MAX_BYTES) {
+        return 0;
+    }
+
+    if (offset + write_size > MAX_BYTES) {
+        write_size = MAX_BYTES - offset;
+    }
+
+    if (wb->wb_length > 0 && !write_buffer_fits(wb, offset, write_size) && inode_writeback(inode) == -1) {
+        return -1;
+    }
+
+    if (wb->wb_length == 0 && write_size < WRITEBACK_SIZE && offset <= inode_stored_size(inode) &&
+        (wb->wb_data != NULL || (wb->wb_data = malloc(WRITEBACK_SIZE)) != NULL)) {
+        wb->wb_offset = offset;
+        clock_gettime(CLOCK_MONOTONIC, &wb->wb_since);
+        writeback_list((int)(inode - inode_table_s.inode_table));
+    }
+
+    if (wb->wb_data != NULL && write_buffer_fits(wb, offset, write_size)) {
+        for (int i = 0; i < iovcnt && done < write_size; i++) {
+            size_t length = iov[i].iov_len < write_size - done ? iov[i].iov_len : write_size - done;
+
+            memcpy(wb->wb_data + (offset + done - wb->wb_offset), iov[i].iov_base, length);
+            done += length;
+        }
+
+        if (offset + write_size > wb->wb_offset + wb->wb_length) {
+            wb->wb_length = (size_t)(offset + write_size - wb->wb_offset);
+        }
+
+        /* a full buffer is written at once; if that fails, the data stays
+         * buffered and the error comes back on the next write or close */
+        if (wb->wb_length == WRITEBACK_SIZE) {
+            inode_writeback(inode);
+        }
+
+        return (ssize_t)write_size;
+    }
+
+    /* every block the write needs is mapped up front */
+    if (inode_blocks_reserve(inode, FS_BLOCK_INDEX(offset + write_size + FS_BLOCK_SIZE - 1)) == -1) {
+        printf("[ inode_writev_at ] Error writing: %s\n", strerror(errno));
+        return -1;
+    }
+
+    uint64_t stored = inode_stored_size(inode);
+
+    if (offset > stored && inode_zero_range(inode, stored, offset) == -1) {
+        return -1;
+    }
+
+    /* consecutive iovecs mostly land in the extent found for the last one */
+    for (int i = 0; i < iovcnt && done < write_size; i++) {
+        size_t length = iov[i].iov_len < write_size - done ? iov[i].iov_len : write_size - done;
+
+        if (inode_write_range(inode, cache, offset + done, iov[i].iov_base, length) == -1) {
+            return -1;
+        }
+
+        done += length;
+    }
+
+    if (offset + write_size > inode->i_size) {
+        inode->i_size = offset + write_size;
+        metadata_log(&inode->i_size, sizeof(inode->i_size));
+    }
+
+    append_sync(inode);
+
+    return (ssize_t)write_size;
+}
+
+/*
+ * Applies a batch of published writes, in order. A batch too large for
+ * the write-back buffer gets the blocks up to its end mapped first, with a
+ * single walk of the block map and allocator call for all of its writes.
+ * Must be called with the inode write-locked, inside a journal transaction.
+ */
+static void combine_apply(inode_t *inode, write_request_t *batch) {
+
+    if (batch->wr_next != NULL) {
+        uint64_t end = 0;
+        size_t total = 0;
+
+        for (write_request_t const *request = batch; request != NULL; request = request->wr_next) {
+            size_t size = iov_length(request->wr_iov, request->wr_iovcnt);
+
+            total += size;
+
+            if (request->wr_offset + size > end) {
+                end = request->wr_offset + size;
+            }
+        }
+
+        /* a write left unmapped if this fails reports it itself */
+        if (total >= WRITEBACK_SIZE && end <= MAX_BYTES) {
+            inode_blocks_reserve(inode, FS_BLOCK_INDEX(end + FS_BLOCK_SIZE - 1));
+        }
+    }
+
+    for (write_request_t *request = batch; request != NULL; request = request->wr_next) {
+        request->wr_result =
+            inode_writev_at(inode, request->wr_cache, request->wr_offset, request->wr_iov, request->wr_iovcnt);
+    }
+}
+
+/*
+ * Writes to a file at a given offset like inode_writev_at, through the
+ * file's combiner (see combiner_t): under contention, one writer takes the
+ * exclusive lock for a whole batch of writes instead of each taking it in
+ * turn.
+ * Must be called with the inode unlocked, inside a journal transaction.
+ * Inputs:
+ * 	 - inode
+ *   - extent cache to use for the lookups (NULL for none)
+ *   - offset in the file
+ *   - iovecs holding the data, and how many there are
+ * Returns: total of written bytes if sucessful, -1 otherwise
+ */
+ssize_t inode_combine_writev(inode_t *inode, extent_cache_t *cache, uint64_t offset, struct iovec const *iov,
+                             int iovcnt) {
+
+    combiner_t *cb = &fs_state_s.combiners[inode - inode_table_s.inode_table];
+    write_request_t request = {offset, iov, iovcnt, cache, -1, false, NULL};
+
+    pthread_mutex_lock(&cb->cb_mutex);
+
+    if (cb->cb_last == NULL) {
+        cb->cb_pending = &request;
+    } else {
+        cb->cb_last->wr_next = &request;
+    }
+
+    cb->cb_last = &request;
+
+    while (!request.wr_done && cb->cb_active) {
+        pthread_cond_wait(&cb->cb_cond, &cb->cb_mutex);
+    }
+
+    if (!request.wr_done) {
+        write_request_t *batch = cb->cb_pending;
+
+        cb->cb_pending = NULL;
+        cb->cb_last = NULL;
+        cb->cb_active = true;
+
+        pthread_mutex_unlock(&cb->cb_mutex);
+
+        if (inode_lock(inode, WRITE) == 0) {
+            combine_apply(inode, batch);
+
+            if (inode_unlock(inode, WRITE) != 0) {
+                request.wr_result = -1;
+            }
+        }
+
+        pthread_mutex_lock(&cb->cb_mutex);
+
+        /* a request is gone as soon as its writer sees it done */
+        while (batch != NULL) {
+            write_request_t *next = batch->wr_next;
+
+            batch->wr_done = true;
+            batch = next;
+        }
+
+        cb->cb_active = false;
+        pthread_cond_broadcast(&cb->cb_cond);
+    }
+
+    pthread_mutex_unlock(&cb->cb_mutex);
+
+    return request.wr_result;
+}
+
+/*
+ * Writes the write-back buffer of a file back and maps the blocks an
+ * append of size bytes needs, and APPEND_RESERVE more for the next ones
+ * when there is room for them
+ * Must be called with the inode write-locked, inside a journal transaction.
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+static int append_map(inode_t *inode, size_t size) {
+
+    append_t *ap = inode_append(inode);
+
+    if (inode_writeback(inode) == -1) {
+        return -1;
+    }
+
+    uint64_t blocks = FS_BLOCK_INDEX(atomic_load(&ap->ap_tail) + size + FS_BLOCK_SIZE - 1);
+
+    if (blocks + APPEND_RESERVE <= MAX_DATA_BLOCKS_FOR_INODE &&
+        inode_blocks_reserve(inode, blocks + APPEND_RESERVE) == 0) {
+        blocks += APPEND_RESERVE;
+    } else if (inode_blocks_reserve(inode, blocks) == -1) {
+        printf("[ inode_appendv ] Error appending: %s\n", strerror(errno));
+        return -1;
+    }
+
+    atomic_store(&ap->ap_mapped, FS_BLOCK_START(blocks));
+
+    return 0;
+}
+
+/*
+ * Appends to a file, gathering the data from an array of iovecs (see
+ * append_t). Appenders hold the inode shared and only wait for each other
+ * to map more blocks, or to take their turn joining the file; an append
+ * that fails still takes its turn, zeroed.
+ * Must be called with the inode unlocked, inside a journal transaction.
+ * Inputs:
+ *   - inode
+ *   - iovecs holding the data, and how many there are
+ *   - where to put the offset right after the data
+ * Returns: total of written bytes if sucessful, -1 otherwise
+ */
+ssize_t inode_appendv(inode_t *inode, struct iovec const *iov, int iovcnt, uint64_t *end) {
+
+    append_t *ap = inode_append(inode);
+    write_buffer_t const *wb = inode_write_buffer(inode);
+    size_t write_size = iov_length(iov, iovcnt);
+    uint64_t offset;
+    size_t size;
+
+    if (inode_lock(inode, READ) != 0) {
+        return -1;
+    }
+
+    for (;;) {
+        offset = atomic_load(&ap->ap_tail);
+        size = offset >= MAX_BYTES ? 0 : write_size < MAX_BYTES - offset ? write_size : (size_t)(MAX_BYTES - offset);
+
+        if (size == 0) {
+            *end = offset;
+            return inode_unlock(inode, READ) != 0 ? -1 : 0;
+        }
+
+        /* buffered writes go first, or they would be read over the appends */
+        if (wb->wb_length == 0 && offset + size <= atomic_load(&ap->ap_mapped)) {
+            if (atomic_compare_exchange_weak(&ap->ap_tail, &offset, offset + size)) {
+                break;
+            }
+
+            continue;
+        }
+
+        if (inode_unlock(inode, READ) != 0 || inode_lock(inode, WRITE) != 0) {
+            return -1;
+        }
+
+        int mapped = append_map(inode, size);
+
+        if (inode_unlock(inode, WRITE) != 0 || mapped == -1 || inode_lock(inode, READ) != 0) {
+            return -1;
+        }
+    }
+
+    size_t done = 0;
+    int result = 0;
+
+    for (int i = 0; i < iovcnt && done < size; i++) {
+        size_t length = iov[i].iov_len < size - done ? iov[i].iov_len : size - done;
+
+        if (result == 0 && inode_write_range(inode, NULL, offset + done, iov[i].iov_base, length) == -1) {
+            result = -1;
+        }
+
+        done += length;
+    }
+
+    if (result == -1) {
+        inode_zero_range(inode, offset, offset + size);
+    }
 
-    pthread_rwlock_unlock(&(inode_table_s.inode_table_rwlock));
+    /* ranges join the file in the order they were reserved; the ones before
+     * belong to appenders already copying, which never wait for this one */
+    pthread_mutex_lock(&ap->ap_mutex);
 
-    if (dir_entry == NULL) {
-        return -1;
+    while (atomic_load(&ap->ap_size) != offset) {
+        pthread_cond_wait(&ap->ap_cond, &ap->ap_mutex);
     }
 
-    /* Finds and fills the first empty entry */
-    pthread_mutex_lock(&(fs_state_s.fs_state_mutex))
-        
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+    atomic_store(&ap->ap_size, offset + size);
+    pthread_cond_broadcast(&ap->ap_cond);
 
-        if (dir_entry[i].d_inumber == -1) {
+    pthread_mutex_unlock(&ap->ap_mutex);
 
-            dir_entry[i].d_inumber = sub_inumber;
+    if (inode_unlock(inode, READ) != 0) {
+        return -1;
+    }
 
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
+    /* the flusher stores the new size */
+    writeback_list((int)(inode - inode_table_s.inode_table));
 
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
+    *end = offset + size;
 
-            pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
+    return result == -1 ? -1 : (ssize_t)size;
+}
 
-            return 0;
-        }
-    }
-    pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
+/*
+ * What a reader sees of a file: its size, how far its blocks hold it, the
+ * bytes its write-back buffer holds and its block map. Readers holding the
+ * inode lock see the i-node itself (see inode_view_locked); the others a
+ * copy of what was last published (see inode_view_published), whose root
+ * lives in v_root.
+ */
+typedef struct {
+    uint64_t v_size;
+    uint64_t v_stored;
+    uint64_t v_wb_offset;
+    uint64_t v_wb_length;
+    block_map_t v_map;
+    extent_t v_root[INODE_EXTENTS];
+    uint32_t v_root_count;
+} inode_view_t;
 
-    return -1;
+/*
+ * Takes the view of a file of a reader holding the inode lock
+ * Must be called with the inode locked.
+ */
+static void inode_view_locked(inode_t *inode, inode_view_t *view) {
+    write_buffer_t const *wb = inode_write_buffer(inode);
+
+    view->v_size = inode_size(inode);
+    view->v_stored = inode_stored_size(inode);
+    view->v_wb_offset = wb->wb_offset;
+    view->v_wb_length = wb->wb_length;
+    view->v_map = inode_block_map(inode);
 }
 
-/* Looks for a given name inside a directory
- * Input:
- * 	- parent directory's i-node number
- * 	- name to search
- * 	Returns i-number linked to the target name, -1 if not found
+/*
+ * Copies what was last published of a file (see inode_meta_t), making a
+ * single attempt: it fails if the copy was changing meanwhile. Appends
+ * published since are counted as stored.
+ * Returns: true if the view was taken, false otherwise
  */
-int find_in_dir(int inumber, char const *sub_name) {
-    insert_delay(); // simulate storage access delay to i-node with inumber
+static bool inode_view_published(inode_t *inode, inode_view_t *view) {
+    inode_meta_t const *meta = inode_meta(inode);
+    uint64_t seq = atomic_load_explicit(&meta->im_seq, memory_order_acquire);
 
-    pthread_rwlock_rdlock(&(inode_table_s.inode_table_rwlock));
-
-    if (!valid_inumber(inumber) ||
-        inode_table_s.inode_table[inumber].i_node_type != T_DIRECTORY) {
-        pthread_rwlock_unlock(&(inode_table_s.inode_table_rwlock));
-        return -1;
+    if (seq & 1) {
+        return false;
     }
 
-    /* Locates the block containing the DIRECTORY's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table_s.inode_table[inumber].i_data_block);
+    view->v_size = atomic_load_explicit(&meta->im_size, memory_order_relaxed);
+    view->v_stored = atomic_load_explicit(&meta->im_stored, memory_order_relaxed);
+    view->v_wb_offset = atomic_load_explicit(&meta->im_wb_offset, memory_order_relaxed);
+    view->v_wb_length = atomic_load_explicit(&meta->im_wb_length, memory_order_relaxed);
+    view->v_root_count = atomic_load_explicit(&meta->im_extent_count, memory_order_relaxed);
+    view->v_map.bm_depth = atomic_load_explicit(&meta->im_tree_depth, memory_order_relaxed);
+    view->v_map.bm_generation = atomic_load_explicit(&meta->im_map_generation, memory_order_relaxed);
 
-        pthread_rwlock_unlock(&(inode_table_s.inode_table_rwlock));
+    if (view->v_root_count > INODE_EXTENTS || view->v_map.bm_depth > EXTENT_TREE_MAX_DEPTH) {
+        return false;
+    }
 
-    if (dir_entry == NULL) {
-        return -1;
+    for (uint32_t i = 0; i < view->v_root_count; i++) {
+        view->v_root[i].e_logical = atomic_load_explicit(&meta->im_extents[i].pe_logical, memory_order_relaxed);
+        view->v_root[i].e_start = atomic_load_explicit(&meta->im_extents[i].pe_start, memory_order_relaxed);
+        view->v_root[i].e_length = atomic_load_explicit(&meta->im_extents[i].pe_length, memory_order_relaxed);
     }
 
-    /* Iterates over the directory entries looking for one that has the target
-     * name */
-    pthread_mutex_lock(&(fs_state_s.fs_state_mutex));
+    atomic_thread_fence(memory_order_acquire);
 
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+    if (atomic_load_explicit(&meta->im_seq, memory_order_relaxed) != seq) {
+        return false;
+    }
 
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+    uint64_t appended = atomic_load(&inode_append(inode)->ap_size);
 
-            pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
-            return dir_entry[i].d_inumber;
-        }
+    if (appended > view->v_size) {
+        view->v_size = appended;
     }
-    pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
 
-    return -1;
+    if (appended > view->v_stored) {
+        view->v_stored = appended;
+    }
+
+    view->v_map.bm_root.entries = view->v_root;
+    view->v_map.bm_root.count = &view->v_root_count;
+    view->v_map.bm_root.capacity = INODE_EXTENTS;
+
+    return true;
 }
 
 /*
- * Allocated a new data block
- * Returns: block index if successful, -1 otherwise
+ * Hints the device (or the buffer cache) about a range of blocks of a
+ * file's contents
+ * Inputs:
+ *   - block map of the file
+ *   - first block and block past the last one, inside the file
+ *   - BDEV_WILLNEED to read them in the background, BDEV_DONTNEED to let
+ *     them go
  */
-// ignorar os locks?
-int data_block_alloc() {
-        
-    for (int i = 0; i < DATA_BLOCKS; i++) {
-        if (i * (int) sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
+static void inode_advise_blocks(block_map_t const *map, uint64_t first, uint64_t end, bdev_advice_t advice) {
+
+    while (first < end) {
+        size_t run = 0;
+        int block = block_map_lookup(map, first, NULL, &run);
+
+        if (!valid_block_number(block)) {
+            return;
         }
 
-        pthread_mutex_lock(&(data_blocks_s.data_blocks_mutex));
+        if (run > end - first) {
+            run = (size_t)(end - first);
+        }
 
-        if (data_blocks_s.free_blocks[i] == FREE) {
-            data_blocks_s.free_blocks[i] = TAKEN;
-       
-            pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
-            return i;
+        if (data_blocks_s.cached && advice == BDEV_WILLNEED) {
+            bcache_prefetch((uint64_t)block, run);
+        } else {
+            if (data_blocks_s.cached) {
+                bcache_release((uint64_t)block, run);
+            }
+
+            bdev_advise(data_blocks_s.device, FS_BLOCK_START(block), run << block_shift, advice);
         }
 
-        pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
- 
+        first += run;
     }
-    return -1;
 }
 
-/* Frees a data block
- * Input
- * 	- the block index
- * Returns: 0 if success, -1 otherwise
+/*
+ * Reads ahead of an open file about to read [offset, offset + length), as
+ * much of it as the file holds.
+ * A read starting where the last one ended is sequential: the window of
+ * blocks read ahead starts at READAHEAD_MIN and doubles up to
+ * READAHEAD_MAX (ACCESS_SEQUENTIAL starts at the top, ACCESS_RANDOM never
+ * reads ahead). Any other read closes the window. Only blocks past the
+ * ones already asked for are requested, so a stream asks for each block
+ * once.
+ * Must be called with the file entry locked.
  */
-int data_block_free(int block_number) {
+static void file_readahead(inode_view_t const *view, open_file_entry_t *file, uint64_t offset, size_t length) {
 
-    if (!valid_block_number(block_number)) {
-        return -1;
+    if (offset >= view->v_size) {
+        length = 0;
+    } else if (view->v_size - offset < length) {
+        length = (size_t)(view->v_size - offset);
     }
 
-    insert_delay(); // simulate storage access delay to free_blocks
+    if (!data_blocks_s.readahead || file->of_access == ACCESS_RANDOM || length == 0) {
+        return;
+    }
 
-    pthread_mutex_lock(&(data_blocks_s.data_blocks_mutex));
+    if (file->of_access == ACCESS_SEQUENTIAL) {
+        file->of_ra_window = READAHEAD_MAX;
+    } else if (offset != file->of_ra_next) {
+        file->of_ra_window = 0;
+        file->of_ra_until = 0;
+    } else if (file->of_ra_window < READAHEAD_MAX) {
+        file->of_ra_window = file->of_ra_window == 0 ? READAHEAD_MIN : file->of_ra_window * 2;
+    }
 
-    data_blocks_s.free_blocks[block_number] = FREE;
+    file->of_ra_next = offset + length;
 
-    pthread_mutex_unlock(&(data_blocks_s.data_blocks_mutex));
+    if (file->of_ra_window == 0) {
+        return;
+    }
 
-    return 0;
+    uint64_t end = FS_BLOCK_INDEX(offset + length + FS_BLOCK_SIZE - 1);
+    uint64_t file_end = FS_BLOCK_INDEX(view->v_stored + FS_BLOCK_SIZE - 1);
+    uint64_t from = file->of_ra_until > end ? file->of_ra_until : end;
+    uint64_t to = end + file->of_ra_window < file_end ? end + file->of_ra_window : file_end;
+
+    if (from < to) {
+        inode_advise_blocks(&view->v_map, from, to, BDEV_WILLNEED);
+        file->of_ra_until = to;
+    }
 }
 
-/* Returns a pointer to the contents of a given block
- * Input:
- * 	- Block's index
- * Returns: pointer to the first byte of the block, NULL otherwise
+/*
+ * Sets how an open file will be read (see file_readahead)
+ * Must be called with the file entry locked.
  */
-void *data_block_get(int block_number) {
-    if (!valid_block_number(block_number)) {
-        return NULL;
+void file_set_access(open_file_entry_t *file, access_pattern_t access) {
+    file->of_access = access;
+    file->of_ra_window = 0;
+    file->of_ra_until = 0;
+}
+
+/*
+ * Hints how a byte range of a file will be used: BDEV_WILLNEED starts
+ * reading it in the background, BDEV_DONTNEED lets its cached blocks go
+ * (dirty ones are written back first)
+ * Must be called with the inode locked.
+ */
+void inode_advise(inode_t *inode, uint64_t offset, uint64_t length, bdev_advice_t advice) {
+
+    /* only the stored contents have blocks (appends included) */
+    uint64_t size = inode_stored_size(inode);
+
+    if (offset >= size || length == 0) {
+        return;
     }
 
-    insert_delay(); // simulate storage access delay to block
+    if (length > size - offset) {
+        length = size - offset;
+    }
 
-    return &(data_blocks_s.fs_data[block_number * BLOCK_SIZE]);
+    if (advice == BDEV_WILLNEED && !data_blocks_s.readahead) {
+        return;
+    }
+
+    block_map_t map = inode_block_map(inode);
+
+    inode_advise_blocks(&map, FS_BLOCK_INDEX(offset), FS_BLOCK_INDEX(offset + length + FS_BLOCK_SIZE - 1), advice);
 }
 
-/* Add new entry to the open file table
- * Inputs:
- * 	- I-node number of the file to open
- * 	- Initial offset
- * Returns: file handle if successful, -1 otherwise
+/* Reads a range of a file's blocks to a buffer, a whole contiguous run of
+ * blocks at a time
+ * Returns: 0 if sucessful, -1 otherwise
  */
-int add_to_open_file_table(int inumber, size_t offset) {
+static int block_map_read(block_map_t const *map, extent_cache_t *cache, uint64_t start, size_t stored,
+                          void *buffer) {
 
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+    size_t to_read_run = 0;
+    size_t total_read = 0;
 
-        if (fs_state_s.free_open_file_entries[i] == FREE) {
-            fs_state_s.free_open_file_entries[i] = TAKEN;
-            fs_state_s.open_file_table[i].of_inumber = inumber;
-            fs_state_s.open_file_table[i].of_offset = offset;
+    while (total_read < stored) {
 
-            return i;
-        }       
+        size_t run = 0;
+        int block = block_map_lookup(map, FS_BLOCK_INDEX(start + total_read), cache, &run);
 
+        if (!valid_block_number(block)) {
+            return -1;
+        }
+
+        size_t block_offset = FS_BLOCK_OFFSET(start + total_read);
+
+        to_read_run = run * FS_BLOCK_SIZE - block_offset;
+
+        if (to_read_run > stored - total_read) {
+            to_read_run = stored - total_read;
+        }
+
+        if (data_read(FS_BLOCK_START(block) + block_offset, (char *)buffer + total_read, to_read_run) == -1) {
+            return -1;
+        }
+
+        total_read += to_read_run;
     }
 
-    return -1;
+    return 0;
 }
 
-/* Frees an entry from the open file table
- * Inputs:
- * 	- file handle to free/close
- * Returns 0 is success, -1 otherwise
+/* Reads a range of a file to a buffer: what its blocks hold, and then what
+ * the write-back buffer holds copied over it
+ * Returns: 0 if sucessful, -1 otherwise
  */
-int remove_from_open_file_table(int fhandle) {
-
-    pthread_mutex_lock(&(fs_state_s.fs_state_mutex));
+static int inode_read_range(inode_t *inode, extent_cache_t *cache, uint64_t start, size_t to_read, void *buffer) {
 
-    if (!valid_file_handle(fhandle) ||
-        fs_state_s.free_open_file_entries[fhandle] != TAKEN) {
+    write_buffer_t const *wb = inode_write_buffer(inode);
+    block_map_t map = inode_block_map(inode);
 
-        pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
+    /* past the stored contents, everything is still in the write-back
+     * buffer */
+    uint64_t stored_size = inode_stored_size(inode);
+    size_t stored = start >= stored_size ? 0
+                    : stored_size - start < to_read ? (size_t)(stored_size - start) : to_read;
 
+    if (block_map_read(&map, cache, start, stored, buffer) == -1) {
         return -1;
     }
 
-    fs_state_s.free_open_file_entries[fhandle] = FREE;
+    uint64_t end = start + to_read;
+    uint64_t wb_end = wb->wb_offset + wb->wb_length;
 
-    pthread_mutex_unlock(&(fs_state_s.fs_state_mutex));
+    if (wb->wb_length > 0 && wb->wb_offset < end && wb_end > start) {
+        uint64_t from = wb->wb_offset > start ? wb->wb_offset : start;
+        uint64_t to = wb_end < end ? wb_end : end;
+
+        memcpy((char *)buffer + (from - start), wb->wb_data + (from - wb->wb_offset), (size_t)(to - from));
+    }
 
     return 0;
 }
 
-/* Returns pointer to a given entry in the open file table
- * Inputs:
- * 	 - file handle
- * Returns: pointer to the entry if sucessful, NULL otherwise
- */
-open_file_entry_t *get_open_file_entry(int fhandle) {
-    if (!valid_file_handle(fhandle)) {
-        return NULL;
-    }
+/* Reads to_read bytes of a file into an array of iovecs (see inode_readv_at) */
+static int inode_read_iov(inode_t *inode, extent_cache_t *cache, uint64_t offset, size_t to_read,
+                          struct iovec const *iov, int iovcnt) {
 
-    return &(fs_state_s.open_file_table[fhandle]);
-}
+    size_t done = 0;
 
+    /* consecutive iovecs mostly land in the extent found for the last one */
+    for (int i = 0; i < iovcnt && done < to_read; i++) {
+        size_t length = iov[i].iov_len < to_read - done ? iov[i].iov_len : to_read - done;
+
+        if (inode_read_range(inode, cache, offset + done, length, iov[i].iov_base) == -1) {
+            return -1;
+        }
 
+        done += length;
+    }
 
-// ------------------------------- AUX FUNCTIONS ---------------------------------------------
+    return 0;
+}
 
-/* Writes in the direct region
+/* Reads from a file at a given offset, scattering the data into an array
+ * of iovecs, up to the end of the file (see inode_size). While no write
+ * inside the file runs under the shared inode lock, the read takes no
+ * range (see inode_meta_t).
+ * Must be called with the inode locked.
  * Inputs:
- * 	 - inode
- *   - pointer to the file entry
- *   - buffer
- *   - n of bytes to write
- * Returns: total of written bytes if sucessful, -1 otherwise
+ *   - inode
+ *   - extent cache to use for the lookups (NULL for none)
+ *   - offset in the file
+ *   - iovecs to fill, and how many there are
+ * Returns: total of read bytes if sucessful, -1 otherwise
  */
-ssize_t tfs_write_direct_region(inode_t *inode, open_file_entry_t *file, void const *buffer, size_t write_size) {
+ssize_t inode_readv_at(inode_t *inode, extent_cache_t *cache, uint64_t offset, struct iovec const *iov, int iovcnt) {
 
-    size_t bytes_written = 0;
-    size_t to_write_block = 0;
+    inode_meta_t const *meta = inode_meta(inode);
+    uint64_t size = inode_size(inode);
+    size_t to_read = iov_length(iov, iovcnt);
 
-    for (int i = 0; write_size > 0 && i < REFERENCE_BLOCK_INDEX; i++) {
+    if (offset >= size) {
+        return 0;
+    }
 
-        if (inode->i_size % BLOCK_SIZE == 0) {                                                           
-            int insert_status = direct_block_insert(inode);     
-            if (insert_status == -1) {
-                printf("[ tfs_write_direct_region ] Error writing in direct region: %s\n", strerror(errno));
-                return -1;
-            }
-        }
+    if (size - offset < to_read) {
+        to_read = (size_t)(size - offset);
+    }
 
-        void *block = data_block_get(inode->i_data_block);
+    uint64_t finished = atomic_load_explicit(&meta->im_finished, memory_order_acquire);
+    uint64_t started = atomic_load_explicit(&meta->im_started, memory_order_relaxed);
 
-        if (block == NULL) {
+    if (started == finished) {
+        if (inode_read_iov(inode, cache, offset, to_read, iov, iovcnt) == -1) {
             return -1;
         }
-        
-        if (write_size >= BLOCK_SIZE || BLOCK_SIZE - (file->of_offset % BLOCK_SIZE) < write_size) {
-            to_write_block = BLOCK_SIZE - (file->of_offset % BLOCK_SIZE);
-            write_size -= to_write_block;
 
-        } else  {   
-            to_write_block = write_size;
-            write_size = 0;
+        atomic_thread_fence(memory_order_acquire);
+
+        /* no write inside the file started meanwhile, so none tore the read */
+        if (atomic_load_explicit(&meta->im_started, memory_order_relaxed) == started) {
+            return (ssize_t)to_read;
         }
+    }
 
-        memcpy(block + (file->of_offset % BLOCK_SIZE), buffer + bytes_written, to_write_block);
+    /* writes inside the file may be running under the shared inode lock */
+    range_t range;
+    inode_range_lock(inode, &range, offset, offset + to_read, READ);
 
-        file->of_offset += to_write_block;
-        inode->i_size += to_write_block;
-        bytes_written += to_write_block;
+    int result = inode_read_iov(inode, cache, offset, to_read, iov, iovcnt);
 
-    }
+    inode_range_unlock(inode, &range);
 
-    return (ssize_t)bytes_written;
+    return result == -1 ? -1 : (ssize_t)to_read;
 }
 
-/* 
- *  INSERTS
+/*
+ * Reads from a file through a view published of it (see inode_readv)
+ * Returns: total of read bytes, -1 if the read has to be done with the
+ * inode locked
  */
-int direct_block_insert(inode_t *inode) {
+static ssize_t inode_view_readv(inode_view_t const *view, extent_cache_t *cache, uint64_t offset,
+                                struct iovec const *iov, int iovcnt) {
 
-    inode->i_data_block = data_block_alloc();
+    size_t to_read = iov_length(iov, iovcnt);
 
-    void *block = data_block_get(inode->i_data_block);
+    if (offset >= view->v_size) {
+        return 0;
+    }
+
+    if (view->v_size - offset < to_read) {
+        to_read = (size_t)(view->v_size - offset);
+    }
 
-    if (inode->i_data_block == -1) {
-        printf("[ direct_block_insert ] Error : alloc block failed\n");
+    /* the write-back buffer is only read with the lock */
+    if (offset + to_read > view->v_stored ||
+        (view->v_wb_length > 0 && view->v_wb_offset < offset + to_read &&
+         view->v_wb_offset + view->v_wb_length > offset)) {
         return -1;
     }
 
-    memset(block, -1, BLOCK_SIZE);
+    size_t done = 0;
 
-    inode->i_block[inode->i_data_block - 1] = inode->i_data_block;
+    for (int i = 0; i < iovcnt && done < to_read; i++) {
+        size_t length = iov[i].iov_len < to_read - done ? iov[i].iov_len : to_read - done;
 
-    return 0;
+        if (block_map_read(&view->v_map, cache, offset + done, length, iov[i].iov_base) == -1) {
+            return -1;
+        }
+
+        done += length;
+    }
+
+    return (ssize_t)to_read;
 }
 
-/* Writes in the indirect region
+/*
+ * Reads from a file at a given offset, like inode_readv_at, without
+ * locking it: the blocks are found through the published block-map root
+ * (see inode_meta_t), inside an epoch critical section so none of them is
+ * handed out again meanwhile (see data_block_retire_n). If anything that
+ * may change the contents started before the read was done, or the read
+ * reaches the write-back buffer, it is done again with the inode locked.
+ * An open file reads ahead first (see file_readahead).
+ * Must be called with the inode unlocked, and the file entry locked.
  * Inputs:
- * 	 - inode
- *   - pointer to the file entry
- *   - buffer
- *   - n of bytes to write
- * Returns: total of written bytes if sucessful, -1 otherwise
+ *   - inode
+ *   - open file reading (NULL for none)
+ *   - offset in the file
+ *   - iovecs to fill, and how many there are
+ * Returns: total of read bytes if sucessful, -1 otherwise
  */
-ssize_t tfs_write_indirect_region(inode_t *inode, open_file_entry_t *file, void const *buffer, size_t write_size) {
+ssize_t inode_readv(inode_t *inode, open_file_entry_t *file, uint64_t offset, struct iovec const *iov, int iovcnt) {
 
-    size_t bytes_written = 0;
-    size_t to_write_block = 0;
-    int insert_status = 0;
+    inode_meta_t const *meta = inode_meta(inode);
+    extent_cache_t *cache = file == NULL ? NULL : &file->of_extent_cache;
+    ssize_t total_read = -1;
+    bool read_ahead = false;
+    inode_view_t view;
 
-    for (int i = 0; write_size > 0; i++) {
+    epoch_enter();
 
-        if (inode->i_size + write_size > MAX_BYTES) {
-            write_size = MAX_BYTES - inode->i_size;
+    uint64_t finished = atomic_load_explicit(&meta->im_finished, memory_order_acquire);
+    uint64_t started = atomic_load_explicit(&meta->im_started, memory_order_relaxed);
+
+    if (started == finished && inode_view_published(inode, &view)) {
+        if (file != NULL) {
+            file_readahead(&view, file, offset, iov_length(iov, iovcnt));
+            read_ahead = true;
         }
 
-        if (inode->i_size % BLOCK_SIZE == 0) { 
+        total_read = inode_view_readv(&view, cache, offset, iov, iovcnt);
 
-            insert_status = indirect_block_insert(inode);  
+        atomic_thread_fence(memory_order_acquire);
 
-            if (insert_status == -1) {
-                printf("[ tfs_write_indirect_region ] Error writing in indirect region: %s\n", strerror(errno));
-                return -1;
-            }
+        /* something may have changed the file under the read */
+        if (atomic_load_explicit(&meta->im_started, memory_order_relaxed) != started) {
+            total_read = -1;
         }
+    }
 
-        void *block = data_block_get(inode->i_data_block);
+    epoch_exit();
 
-        if (block == NULL) {
-            printf("[ tfs_write_indirect_region ] Error : NULL block\n");
-            return -1;
-        }
-        
-        if (write_size >= BLOCK_SIZE || BLOCK_SIZE - (file->of_offset % BLOCK_SIZE) < write_size) {
-            to_write_block = BLOCK_SIZE - (file->of_offset % BLOCK_SIZE);           
-            write_size -= to_write_block;
-        }
+    if (total_read != -1) {
+        return total_read;
+    }
 
-        else  {
-            to_write_block = write_size;
-            write_size = 0;
-        }
+    if (inode_lock(inode, READ) != 0) {
+        return -1;
+    }
 
+    if (file != NULL && !read_ahead) {
+        inode_view_locked(inode, &view);
+        file_readahead(&view, file, offset, iov_length(iov, iovcnt));
+    }
 
-        memcpy(block + (file->of_offset % BLOCK_SIZE), buffer + bytes_written, to_write_block);
+    total_read = inode_readv_at(inode, cache, offset, iov, iovcnt);
 
+    if (inode_unlock(inode, READ) != 0) {
+        return -1;
+    }
 
-        file->of_offset += to_write_block;
-        inode->i_size += to_write_block;
-        bytes_written += to_write_block;
+    return total_read;
+}
 
-    
+/* Reads from a file, starting at the file entry's offset and moving it
+ * past what was read (see inode_readv)
+ * Must be called with the file entry locked and the inode unlocked.
+ * Inputs:
+ *   - inode
+ *   - pointer to the file entry
+ *   - iovecs to fill, and how many there are
+ * Returns: total of read bytes if sucessful, -1 otherwise
+ */
+ssize_t tfs_read_region(inode_t *inode, open_file_entry_t *file, struct iovec const *iov, int iovcnt) {
+
+    ssize_t total_read = inode_readv(inode, file, file->of_offset, iov, iovcnt);
+
+    if (total_read > 0) {
+        file->of_offset += (uint64_t)total_read;
     }
-  
-    return (ssize_t)bytes_written;
+
+    return total_read;
 }
 
-int indirect_block_insert(inode_t *inode) {
+/*
+ * Writes the buffers of the listed files that have been in use for
+ * WRITEBACK_AGE_MS, in a single transaction; if it fails to commit, every
+ * file goes back on the list
+ */
+static void writeback_expired(int const *inumbers, size_t count) {
 
-    int *last_i_block = (int *)data_block_get(inode->i_block[MAX_DIRECT_BLOCKS]);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    int block_number = data_block_alloc();
+    journal_start();
 
-    if (block_number == -1) {
-        printf(" Error : Invalid block insertion\n");
-        return -1;
-    }
+    for (size_t i = 0; i < count; i++) {
+        inode_t *inode = &inode_table_s.inode_table[inumbers[i]];
+        write_buffer_t const *wb = &writeback_s.buffers[inumbers[i]];
 
-    inode->i_data_block = block_number;
+        if (inode_lock(inode, WRITE) != 0) {
+            continue;
+        }
 
-    memset(data_block_get(block_number), -1, BLOCK_SIZE / sizeof(int));
+        long age = wb->wb_length == 0 ? WRITEBACK_AGE_MS
+                   : (long)(now.tv_sec - wb->wb_since.tv_sec) * 1000 +
+                         (now.tv_nsec - wb->wb_since.tv_nsec) / 1000000;
 
-    last_i_block[block_number - FIRST_INDIRECT_BLOCK] = block_number;    
+        /* young buffers (and ones that could not be written) wait for the
+         * next round; the size of appended files is stored right away */
+        if (age < WRITEBACK_AGE_MS || inode_writeback(inode) == -1) {
+            writeback_list(inumbers[i]);
+        }
 
-    return 0;
+        inode_unlock(inode, WRITE);
+    }
+
+    /* the files are listed again, so the next round retries them */
+    if (journal_stop() == -1) {
+        printf("[ writeback_expired ] Error : commit failed\n");
 
+        for (size_t i = 0; i < count; i++) {
+            writeback_list(inumbers[i]);
+        }
+    }
 }
 
-int tfs_handle_indirect_block(inode_t *inode) {
+/* Flusher thread: looks at the listed buffers every WRITEBACK_AGE_MS */
+static void *writeback_thread(void *arg) {
 
-    int block_number = data_block_alloc();
+    (void)arg;
 
-    if (block_number == -1) {
-        return -1;
-    }
+    pthread_mutex_lock(&writeback_s.writeback_mutex);
 
-    inode->i_block[MAX_DIRECT_BLOCKS] = block_number;
-    inode->i_data_block = block_number;
+    while (!writeback_s.stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WRITEBACK_AGE_MS / 1000;
+        deadline.tv_nsec += (WRITEBACK_AGE_MS % 1000) * 1000000L;
 
-    memset(data_block_get(inode->i_data_block), -1, sizeof(data_block_get(inode->i_data_block)));
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
 
-    return 0;
-}
+        pthread_cond_timedwait(&writeback_s.writeback_cond, &writeback_s.writeback_mutex, &deadline);
 
-/* Reads from the direct region a certain amount of bytes to a buffer
- * Inputs:
- *   - pointer to the file entry
- *   - n bytes to read
- *   - buffer
- * Returns: total of read bytes if sucessful, -1 otherwise
- */
-ssize_t tfs_read_direct_region(open_file_entry_t *file, size_t to_read, void *buffer) {
+        size_t count = writeback_s.dirty_count;
 
-    size_t current_block = (file->of_offset / BLOCK_SIZE) + 1;
-    size_t block_offset = file->of_offset % BLOCK_SIZE;
-    size_t to_read_block = 0;
-    size_t total_read = 0;
-    
-    if (file->of_offset + to_read <= MAX_BYTES_DIRECT_DATA) {
+        if (writeback_s.stopping || count == 0) {
+            continue;
+        }
 
-        while (to_read > 0 && current_block <= MAX_DIRECT_BLOCKS) {        
+        memcpy(writeback_s.batch, writeback_s.dirty, count * sizeof(int));
+        writeback_s.dirty_count = 0;
 
-            void *block = data_block_get((int) current_block);
+        for (size_t i = 0; i < count; i++) {
+            writeback_s.buffers[writeback_s.batch[i]].wb_listed = false;
+        }
 
-            if (block == NULL) {
-                return -1;
-            }
+        pthread_mutex_unlock(&writeback_s.writeback_mutex);
 
-            if (to_read + block_offset > BLOCK_SIZE ) { 
-                to_read_block = BLOCK_SIZE - block_offset;               
-                to_read -= to_read_block;
+        writeback_expired(writeback_s.batch, count);
 
-            } else {
-                to_read_block = to_read;
-                to_read = 0;
-            }
+        pthread_mutex_lock(&writeback_s.writeback_mutex);
+    }
 
-            memcpy(buffer + total_read, block + block_offset, to_read_block);
+    pthread_mutex_unlock(&writeback_s.writeback_mutex);
+
+    return NULL;
+}
 
-            file->of_offset += to_read_block;
-            total_read += to_read_block;
+/* Starts the flusher
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+static int writeback_start() {
 
-            current_block = (file->of_offset / BLOCK_SIZE) + 1;
-            block_offset = file->of_offset % BLOCK_SIZE;
+    pthread_mutex_init(&writeback_s.writeback_mutex, NULL);
+    pthread_cond_init(&writeback_s.writeback_cond, NULL);
+    writeback_s.dirty_count = 0;
+    writeback_s.stopping = false;
 
-        }
+    if (pthread_create(&writeback_s.flusher, NULL, writeback_thread, NULL) != 0) {
+        printf("[ writeback_start ] Error : flusher not started\n");
+        pthread_mutex_destroy(&writeback_s.writeback_mutex);
+        pthread_cond_destroy(&writeback_s.writeback_cond);
+        return -1;
     }
 
-    return (ssize_t) total_read;
+    writeback_s.running = true;
+
+    return 0;
 }
 
-/* Reads from the indirect region a certain amount of bytes to a buffer
- * Inputs:
- *   - pointer to the file entry
- *   - n bytes to read
- *   - buffer
- * Returns: total of read bytes if sucessful, -1 otherwise
- */
-ssize_t tfs_read_indirect_region(open_file_entry_t *file, size_t to_read, void *buffer) {
+/* Stops the flusher; the buffers keep their contents */
+static void writeback_stop() {
 
-    size_t to_read_block = 0;
-    size_t total_read = 0;
-    size_t current_block = (file->of_offset / BLOCK_SIZE) + 2;
-    size_t block_offset = file->of_offset % BLOCK_SIZE;
+    if (!writeback_s.running) {
+        return;
+    }
 
-    while (to_read > 0) {      
+    pthread_mutex_lock(&writeback_s.writeback_mutex);
+    writeback_s.stopping = true;
+    pthread_cond_signal(&writeback_s.writeback_cond);
+    pthread_mutex_unlock(&writeback_s.writeback_mutex);
 
-        void *block = data_block_get((int) current_block);
-        if (block == NULL) {
-            return -1;
-        }
+    pthread_join(writeback_s.flusher, NULL);
 
-        if (to_read + block_offset > BLOCK_SIZE ) {
-            to_read_block = BLOCK_SIZE - block_offset;              
-            to_read -= to_read_block;
+    pthread_mutex_destroy(&writeback_s.writeback_mutex);
+    pthread_cond_destroy(&writeback_s.writeback_cond);
+    writeback_s.running = false;
+}
 
-        } else {
-            to_read_block = to_read;
-            to_read = 0;
-        }
+/* Writes every write-back buffer, in a single transaction
+ * Returns: 0 if sucessful, -1 otherwise
+ */
+static int writeback_all() {
 
-        memcpy(buffer + total_read, block + block_offset, to_read_block);
+    int result = 0;
 
-        file->of_offset += to_read_block;
-        total_read += to_read_block;
+    journal_start();
 
-        current_block = (file->of_offset / BLOCK_SIZE) + 2;
-        block_offset = file->of_offset % BLOCK_SIZE;
-    }
+    for (size_t i = 0; i < fs_params.inode_table_size; i++) {
+        inode_t *inode = &inode_table_s.inode_table[i];
 
-    file->of_offset = file->of_offset;
+        if ((writeback_s.buffers[i].wb_length == 0 && atomic_load(&fs_state_s.appends[i].ap_size) <= inode->i_size) ||
+            inode_lock(inode, WRITE) != 0) {
+            continue;
+        }
+
+        if (inode_writeback(inode) == -1) {
+            result = -1;
+        }
+
+        inode_unlock(inode, WRITE);
+    }
 
-    return (ssize_t)total_read;
+    return journal_stop() == -1 ? -1 : result;
 }
 
 /* Locks an inode mutex or a rwlock, specified by the flag lock_state
@@ -742,21 +3649,24 @@ int inode_lock(inode_t *inode, lock_state_t lock_state) {
 
     // READ
     if (lock_state == READ) {
-        if (pthread_rwlock_rdlock(&inode->inode_rwlock) != 0) {
+        if (pthread_rwlock_rdlock(&inode_locks(inode)->il_rwlock) != 0) {
             printf("[ inode_lock ] Error locking memory region\n");
             return -1;
         }
     }
     // WRITE
     else if (lock_state == WRITE) {
-        if (pthread_rwlock_wrlock(&inode->inode_rwlock) != 0) {
+        if (pthread_rwlock_wrlock(&inode_locks(inode)->il_rwlock) != 0) {
             printf("[ inode_lock ] Error locking memory region\n");
             return -1;
         }
+
+        /* readers without the lock stay away until it is let go */
+        inode_change_start(inode);
     }
     // MUTEX
     else if (lock_state == MUTEX){
-        if (pthread_mutex_lock(&inode->inode_mutex) != 0) {
+        if (pthread_mutex_lock(&inode_locks(inode)->il_mutex) != 0) {
             printf("[ inode_lock ] Error locking memory region\n");
             return -1;
         }
@@ -776,16 +3686,22 @@ int inode_lock(inode_t *inode, lock_state_t lock_state) {
  */
 int inode_unlock(inode_t *inode, lock_state_t lock_state) {
 
+    /* whatever changed is published while the lock is still held */
+    if (lock_state == WRITE) {
+        inode_publish(inode);
+        inode_change_finish(inode);
+    }
+
     // RWLOCK
     if (lock_state == READ || lock_state == WRITE) {
-        if (pthread_rwlock_unlock(&inode->inode_rwlock) != 0) {
+        if (pthread_rwlock_unlock(&inode_locks(inode)->il_rwlock) != 0) {
             printf("[ inode_unlock ] Error unlocking memory region\n");
             return -1;
         }
     }
     // MUTEX
     else if (lock_state == MUTEX){
-        if (pthread_mutex_unlock(&inode->inode_mutex) != 0) {
+        if (pthread_mutex_unlock(&inode_locks(inode)->il_mutex) != 0) {
             printf("[ inode_unlock ] Error unlocking memory region\n");
             return -1;
         }
@@ -2,6 +2,7 @@
 #define STATE_H
 
 #include "config.h"
+#include "bdev.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -10,81 +11,199 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 /*
  * Directory entry
+ * This is the on-disk format: just the name and the i-number, so a block
+ * packs as many entries as possible. Directory synchronization lives in
+ * in-memory state, never inside the entries.
  */
 typedef struct {
     char d_name[MAX_FILE_NAME];
     int d_inumber;
-    pthread_mutex_t dir_entry_mutex;
-    pthread_rwlock_t dir_entry_rwlock;
 } dir_entry_t;
 
+/*
+ * Directories are linear hash tables: block 0 holds a dir_header_t and
+ * blocks 1..dh_buckets are the primary buckets. A full bucket chains
+ * overflow blocks through db_next.
+ */
+typedef struct {
+    uint32_t dh_level;   // the round started with 2^dh_level buckets
+    uint32_t dh_split;   // next bucket to be split in this round
+    uint32_t dh_buckets; // number of primary buckets
+    uint32_t dh_entries; // number of names in the directory
+} dir_header_t;
+
+typedef struct {
+    int db_count;  // entries in use in this block
+    int db_next;   // overflow block, -1 if none
+    dir_entry_t db_entries[];
+} dir_bucket_t;
+
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
+/*
+ * Extent: a run of physically contiguous data blocks
+ * e_logical : first block of the file the run maps
+ * e_start : first data block of the run
+ * e_length : number of blocks
+ * Index nodes of the extent tree use the same layout to point to a child
+ * node: e_logical is the first file block under it, e_start the child's
+ * block and e_length is unused.
+ */
+typedef struct {
+    uint32_t e_logical;
+    int e_start;
+    uint32_t e_length;
+} extent_t;
+
+/*
+ * Extent tree node, filling a whole data block
+ * eh_depth : 0 for leaves (entries are extents), > 0 for index nodes
+ */
+typedef struct {
+    uint32_t eh_count;
+    uint32_t eh_depth;
+    extent_t eh_entries[];
+} extent_node_t;
+
+/*
+ * Last extent an open file went through, so sequential accesses do not
+ * walk the tree again for every block
+ */
+typedef struct {
+    uint64_t ec_generation;
+    uint32_t ec_logical;
+    int ec_start;
+    uint32_t ec_length;
+} extent_cache_t;
+
 /*
  * I-node
+ * The block map is an extent tree covering the file's blocks from the
+ * first one, without holes. Its root (INODE_EXTENTS entries) lives in the
+ * i-node; with i_tree_depth levels below it, any block is found visiting
+ * at most EXTENT_TREE_MAX_DEPTH + 1 nodes.
+ * i_map_generation changes whenever blocks are unmapped, which
+ * invalidates the extents cached by open files.
+ * I-nodes are persistent and start a cache line each; their locks are
+ * kept apart, with the rest of the volatile state of a file (see
+ * inode_lock).
  */
 typedef struct {
-    inode_type i_node_type;
-    size_t i_size;
-    int i_data_block; //current block in use to write
-    int i_block[11];   // 10 primeiras entradas sao diretas
-    pthread_mutex_t inode_mutex;
-    pthread_rwlock_t inode_rwlock;
+    _Alignas(CACHE_LINE) inode_type i_node_type;
+    uint64_t i_size;
+    extent_t i_extents[INODE_EXTENTS];
+    uint32_t i_extent_count;
+    uint32_t i_tree_depth;
+    uint64_t i_map_generation;
     /* in a real FS, more fields would exist here */
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
+/* How an open file will be read (see file_readahead) */
+typedef enum { ACCESS_NORMAL = 0, ACCESS_SEQUENTIAL = 1, ACCESS_RANDOM = 2 } access_pattern_t;
+
 /*
  * Open file entry (in open file table)
+ * Entries start a cache line each. What every read and write of a handle
+ * touches (the i-node number, the offset and the mutex guarding it) fills
+ * the first line; the rest comes after.
  * of_inumber : entry number
+ * of_append : whether writes append to the file (see inode_appendv)
  * of_offset : current offset position
+ * of_ra_next : offset a sequential read would start at
+ * of_ra_until : first block not read ahead yet
+ * of_ra_window : blocks read ahead of a sequential reader
  */
 typedef struct {
-    int of_inumber;
-    size_t of_offset;
+    _Alignas(CACHE_LINE) int of_inumber;
+    bool of_append;
+    uint64_t of_offset;
     pthread_mutex_t open_file_mutex;
+    extent_cache_t of_extent_cache;
+    access_pattern_t of_access;
+    uint64_t of_ra_next;
+    uint64_t of_ra_until;
+    uint64_t of_ra_window;
     pthread_rwlock_t open_file_rwlock;
 } open_file_entry_t;
 
 typedef enum { READ = 1, WRITE = 2, MUTEX = 3 } lock_state_t;
 
-
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
-
-
-void state_init();
+/*
+ * Volume geometry, chosen when the FS is initialized
+ * block_size : bytes per data block, a power of two
+ * data_blocks : number of data blocks
+ * inode_table_size : number of i-nodes
+ * max_open_files : entries in the open file table
+ * image_path : file holding the volume, NULL to keep it in memory
+ * backend : how the image's data blocks are reached (BDEV_MMAP, BDEV_PREAD
+ *           or BDEV_DIRECT, see bdev.h); in-memory volumes use BDEV_MEMORY
+ * cache_size : bytes of buffer cache in front of BDEV_PREAD and BDEV_DIRECT
+ *              (see bcache.h), 0 for none
+ */
+typedef struct {
+    size_t block_size;
+    size_t data_blocks;
+    size_t inode_table_size;
+    size_t max_open_files;
+    char const *image_path;
+    bdev_type_t backend;
+    size_t cache_size;
+} tfs_params_t;
+
+int state_init(tfs_params_t const *params);
 void state_destroy();
+int state_sync();
+tfs_params_t const *state_params();
 
 int inode_create(inode_type n_type);
 int inode_delete(int inumber);
 inode_t *inode_get(int inumber);
 
-int clear_dir_entry(int inumber, int sub_inumber);
+int clear_dir_entry(int inumber, char const *sub_name);
 int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
 int find_in_dir(int inumber, char const *sub_name);
 
 int data_block_alloc();
+int data_block_alloc_n(int n, int *allocated);
 int data_block_free(int block_number);
+int data_block_free_n(int block_number, int n);
+int data_block_retire_n(int block_number, int n);
 void *data_block_get(int block_number);
-int data_block_insert(int i_block[], int block_number);
-int index_block_insert(int index_block[], int block_number);
 
-int add_to_open_file_table(int inumber, size_t offset);
+int add_to_open_file_table(int inumber, uint64_t offset, bool append);
 int remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
 
 
-ssize_t tfs_write_direct_region(inode_t *inode, open_file_entry_t *file, void const *buffer, size_t write_size);
-int direct_block_insert(inode_t *inode);
-ssize_t tfs_write_indirect_region(inode_t *inode, open_file_entry_t *file, void const *buffer, size_t write_size);
-int indirect_block_insert(inode_t *inode);
-int tfs_handle_indirect_block(inode_t *inode);
-ssize_t tfs_read_direct_region(open_file_entry_t *file, size_t to_read, void *buffer);
-ssize_t tfs_read_indirect_region(open_file_entry_t *file, size_t to_read, void *buffer);
+void inode_extents_init(inode_t *inode);
+int inode_extent_lookup(inode_t *inode, uint64_t block_index, extent_cache_t *cache, size_t *run_length);
+int inode_block_get(inode_t *inode, uint64_t block_index);
+int inode_blocks_reserve(inode_t *inode, uint64_t block_count);
+int inode_blocks_free(inode_t *inode);
+int inode_truncate(inode_t *inode);
+uint64_t inode_size(inode_t *inode);
+uint64_t inode_stat(inode_t *inode, inode_type *type);
+int inode_writeback(inode_t *inode);
+ssize_t inode_writev_at(inode_t *inode, extent_cache_t *cache, uint64_t offset, struct iovec const *iov,
+                        int iovcnt);
+bool inode_overwrites(inode_t *inode, uint64_t offset, size_t length);
+ssize_t inode_overwritev_at(inode_t *inode, extent_cache_t *cache, uint64_t offset, struct iovec const *iov,
+                            int iovcnt);
+ssize_t inode_combine_writev(inode_t *inode, extent_cache_t *cache, uint64_t offset, struct iovec const *iov,
+                             int iovcnt);
+ssize_t inode_appendv(inode_t *inode, struct iovec const *iov, int iovcnt, uint64_t *end);
+ssize_t inode_readv_at(inode_t *inode, extent_cache_t *cache, uint64_t offset, struct iovec const *iov, int iovcnt);
+ssize_t inode_readv(inode_t *inode, open_file_entry_t *file, uint64_t offset, struct iovec const *iov, int iovcnt);
+ssize_t tfs_read_region(inode_t *inode, open_file_entry_t *file, struct iovec const *iov, int iovcnt);
+void file_set_access(open_file_entry_t *file, access_pattern_t access);
+void inode_advise(inode_t *inode, uint64_t offset, uint64_t length, bdev_advice_t advice);
 
 int inode_lock(inode_t *inode, lock_state_t lock_state);
 int inode_unlock(inode_t *inode, lock_state_t lock_state);
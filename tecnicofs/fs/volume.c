@@ -0,0 +1,343 @@
+#define _DEFAULT_SOURCE
+#include "volume.h"
+#include "journal.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define VOLUME_MAGIC (0x3156534643455454ULL) // "TTECFSV1"
+#define VOLUME_VERSION (3)
+
+/*
+ * Superblock, at offset 0 of the image
+ * Region offsets are stored so a mount can check them against the layout
+ * its own build would compute; sb_inode_size rejects images written by a
+ * build with a different i-node layout.
+ */
+typedef struct {
+    uint64_t sb_magic;
+    uint32_t sb_version;
+    uint32_t sb_inode_size;
+    uint64_t sb_block_size;
+    uint64_t sb_data_blocks;
+    uint64_t sb_inode_table_size;
+    uint64_t sb_journal;
+    uint64_t sb_journal_size;
+    uint64_t sb_inode_bitmap;
+    uint64_t sb_inode_table;
+    uint64_t sb_block_bitmap;
+    uint64_t sb_data;
+    uint64_t sb_size;
+} superblock_t;
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+/*
+ * Computes where each region of a volume with a given geometry starts
+ * Returns: the superblock describing that layout (sb_magic left at 0)
+ */
+static superblock_t volume_layout(tfs_params_t const *params) {
+    superblock_t layout;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t alignment = params->block_size > page_size ? params->block_size : page_size;
+
+    memset(&layout, 0, sizeof(layout));
+    layout.sb_version = VOLUME_VERSION;
+    layout.sb_inode_size = (uint32_t)sizeof(inode_t);
+    layout.sb_block_size = params->block_size;
+    layout.sb_data_blocks = params->data_blocks;
+    layout.sb_inode_table_size = params->inode_table_size;
+
+    size_t offset = align_up(sizeof(superblock_t), alignment);
+
+    layout.sb_journal = offset;
+    layout.sb_journal_size = align_up(JOURNAL_SIZE, alignment);
+    offset += layout.sb_journal_size;
+    layout.sb_inode_bitmap = offset;
+    offset = align_up(offset + (params->inode_table_size + 63) / 64 * sizeof(uint64_t), alignment);
+    layout.sb_inode_table = offset;
+    offset = align_up(offset + params->inode_table_size * sizeof(inode_t), alignment);
+    layout.sb_block_bitmap = offset;
+    offset = align_up(offset + (params->data_blocks + 63) / 64 * sizeof(uint64_t), alignment);
+    layout.sb_data = offset;
+    layout.sb_size = offset + params->data_blocks * params->block_size;
+
+    return layout;
+}
+
+/* Points a volume's metadata regions into its mapping */
+static void volume_regions(volume_t *volume, superblock_t const *layout) {
+    char *base = (char *)volume->v_base;
+
+    volume->v_inode_bitmap = (_Atomic uint64_t *)(base + layout->sb_inode_bitmap);
+    volume->v_inode_table = (inode_t *)(base + layout->sb_inode_table);
+    volume->v_block_bitmap = (uint64_t *)(base + layout->sb_block_bitmap);
+}
+
+/*
+ * Opens the block device holding a volume's data blocks: the rest of the
+ * mapping for in-memory volumes, the rest of the image file otherwise (then
+ * v_data is reserved for the directory and extent tree blocks)
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int volume_data(tfs_params_t const *params, volume_t *volume, superblock_t const *layout) {
+    volume->v_data_offset = layout->sb_data;
+    volume->v_data_size = layout->sb_size - layout->sb_data;
+
+    if (volume->v_fd == -1) {
+        volume->v_data = (char *)volume->v_base + layout->sb_data;
+        volume->v_device = bdev_open_memory(volume->v_data, volume->v_data_size);
+        return volume->v_device == NULL ? -1 : 0;
+    }
+
+    if (params->backend == BDEV_DIRECT && layout->sb_block_size < BDEV_DIRECT_ALIGN) {
+        printf("[ volume_data ] Error : O_DIRECT needs blocks of at least %d bytes\n", BDEV_DIRECT_ALIGN);
+        return -1;
+    }
+
+    void *data = mmap(NULL, volume->v_data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                      -1, 0);
+
+    if (data == MAP_FAILED) {
+        printf("[ volume_data ] Error : %s\n", strerror(errno));
+        return -1;
+    }
+
+    volume->v_data = (char *)data;
+    volume->v_device =
+        bdev_open_file(params->backend, volume->v_fd, params->image_path, layout->sb_data, volume->v_data_size);
+
+    return volume->v_device == NULL ? -1 : 0;
+}
+
+/*
+ * Maps an existing image, taking its geometry from the superblock
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int volume_mount(tfs_params_t *params, volume_t *volume, size_t file_size) {
+
+    superblock_t super;
+
+    if (file_size < sizeof(super) || pread(volume->v_fd, &super, sizeof(super), 0) != (ssize_t)sizeof(super)) {
+        printf("[ volume_mount ] Error : image too small\n");
+        return -1;
+    }
+
+    if (super.sb_magic != VOLUME_MAGIC || super.sb_version != VOLUME_VERSION ||
+        super.sb_inode_size != sizeof(inode_t)) {
+        printf("[ volume_mount ] Error : not a volume image of this version\n");
+        return -1;
+    }
+
+    params->block_size = super.sb_block_size;
+    params->data_blocks = super.sb_data_blocks;
+    params->inode_table_size = super.sb_inode_table_size;
+
+    superblock_t layout = volume_layout(params);
+
+    if (layout.sb_journal != super.sb_journal || layout.sb_journal_size != super.sb_journal_size ||
+        layout.sb_inode_bitmap != super.sb_inode_bitmap || layout.sb_inode_table != super.sb_inode_table ||
+        layout.sb_block_bitmap != super.sb_block_bitmap || layout.sb_data != super.sb_data ||
+        layout.sb_size != super.sb_size || file_size < super.sb_size) {
+        printf("[ volume_mount ] Error : corrupted superblock\n");
+        return -1;
+    }
+
+    volume->v_size = super.sb_data;
+    volume->v_base = mmap(NULL, volume->v_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, volume->v_fd, 0);
+
+    if (volume->v_base == MAP_FAILED) {
+        printf("[ volume_mount ] Error : %s\n", strerror(errno));
+        volume->v_base = NULL;
+        return -1;
+    }
+
+    /* no page was touched yet, so they all fault in after the replay */
+    if (journal_open(volume->v_fd, layout.sb_journal, layout.sb_journal_size) == -1) {
+        printf("[ volume_mount ] Error : journal replay failed\n");
+        return -1;
+    }
+
+    volume_regions(volume, &layout);
+
+    return volume_data(params, volume, &layout);
+}
+
+/*
+ * Lays out a new volume in an empty image file (or in memory). The file is
+ * only extended, never written, so the zeroed regions stay sparse.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int volume_format(tfs_params_t const *params, volume_t *volume) {
+
+    superblock_t layout = volume_layout(params);
+
+    volume->v_size = volume->v_fd == -1 ? layout.sb_size : layout.sb_data;
+
+    if (volume->v_fd == -1) {
+        volume->v_base = mmap(NULL, volume->v_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    } else if (ftruncate(volume->v_fd, (off_t)layout.sb_size) == -1) {
+        volume->v_base = MAP_FAILED;
+    } else {
+        volume->v_base = mmap(NULL, volume->v_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, volume->v_fd, 0);
+    }
+
+    if (volume->v_base == MAP_FAILED) {
+        printf("[ volume_format ] Error : %s\n", strerror(errno));
+        volume->v_base = NULL;
+        return -1;
+    }
+
+    layout.sb_magic = VOLUME_MAGIC;
+    memcpy(volume->v_base, &layout, sizeof(layout));
+
+    if (volume->v_fd != -1 &&
+        (volume_persist(volume, volume->v_base, sizeof(layout)) == -1 ||
+         journal_open(volume->v_fd, layout.sb_journal, layout.sb_journal_size) == -1)) {
+        return -1;
+    }
+
+    volume_regions(volume, &layout);
+
+    return volume_data(params, volume, &layout);
+}
+
+/*
+ * Opens the volume described by params: the image file is mounted if it
+ * holds a volume and formatted if it is empty (or missing); without an
+ * image path a new in-memory volume is made
+ * Input:
+ *  - params: geometry for a new volume; when mounting it is overwritten
+ *    with the image's geometry
+ *  - volume: where to store the mapping
+ * Returns: 1 if an existing volume was mounted, 0 if a new one was
+ * formatted, -1 otherwise
+ */
+int volume_open(tfs_params_t *params, volume_t *volume) {
+
+    volume->v_fd = -1;
+    volume->v_base = NULL;
+    volume->v_data = NULL;
+    volume->v_device = NULL;
+    volume->v_page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (params->image_path == NULL) {
+        return volume_format(params, volume);
+    }
+
+    volume->v_fd = open(params->image_path, O_RDWR | O_CREAT, 0644);
+
+    struct stat st;
+
+    if (volume->v_fd == -1 || fstat(volume->v_fd, &st) == -1) {
+        printf("[ volume_open ] Error : %s\n", strerror(errno));
+        volume_close(volume);
+        return -1;
+    }
+
+    int result = st.st_size == 0 ? volume_format(params, volume)
+                                 : volume_mount(params, volume, (size_t)st.st_size);
+
+    if (result == -1) {
+        volume_close(volume);
+        return -1;
+    }
+
+    return st.st_size == 0 ? 0 : 1;
+}
+
+/*
+ * Writes a range of the mapping to the same place in the image file (the
+ * superblock; other metadata only goes there through the journal)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int volume_persist(volume_t *volume, void const *addr, size_t length) {
+    if (volume->v_fd == -1) {
+        return 0;
+    }
+
+    size_t offset = (size_t)((char const *)addr - (char const *)volume->v_base);
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t written = pwrite(volume->v_fd, (char const *)addr + done, length - done, (off_t)(offset + done));
+
+        if (written == -1) {
+            printf("[ volume_persist ] Error : %s\n", strerror(errno));
+            return -1;
+        }
+
+        done += (size_t)written;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns: where the byte at addr, in the mapping or in v_data, lives in
+ * the image
+ */
+uint64_t volume_offset(volume_t const *volume, void const *addr) {
+    uintptr_t byte = (uintptr_t)addr;
+    uintptr_t data = (uintptr_t)volume->v_data;
+
+    if (byte >= data && byte < data + volume->v_data_size) {
+        return volume->v_data_offset + (byte - data);
+    }
+
+    return byte - (uintptr_t)volume->v_base;
+}
+
+/*
+ * Drops the pages behind a range of data blocks, whose contents are no
+ * longer needed. The range must be page aligned; reading it again gives
+ * zeros, or whatever the image file holds there.
+ * Input:
+ *  - volume
+ *  - offset and length of the range, in bytes from the first data block
+ */
+void volume_discard(volume_t *volume, size_t offset, size_t length) {
+    if (volume->v_device == NULL || length == 0) {
+        return;
+    }
+
+    /* failing only means the memory stays in use */
+    if (volume->v_fd != -1) {
+        madvise(volume->v_data + offset, length, MADV_DONTNEED);
+    }
+
+    bdev_discard(volume->v_device, offset, length);
+}
+
+/* Checkpoints the journal of a volume, closes its device and unmaps it */
+void volume_close(volume_t *volume) {
+    if (volume->v_device != NULL) {
+        bdev_flush(volume->v_device);
+    }
+
+    if (volume->v_fd != -1) {
+        journal_close();
+    }
+
+    bdev_close(volume->v_device);
+    volume->v_device = NULL;
+
+    if (volume->v_fd != -1 && volume->v_data != NULL) {
+        munmap(volume->v_data, volume->v_data_size);
+    }
+
+    volume->v_data = NULL;
+
+    if (volume->v_base != NULL) {
+        munmap(volume->v_base, volume->v_size);
+        volume->v_base = NULL;
+    }
+
+    if (volume->v_fd != -1) {
+        close(volume->v_fd);
+        volume->v_fd = -1;
+    }
+}
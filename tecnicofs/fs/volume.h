@@ -0,0 +1,46 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include "state.h"
+#include <stdatomic.h>
+
+/*
+ * Volume
+ * The metadata regions of a volume are laid out in one mapping, each region
+ * aligned to the block size (and at least to a page), and the data blocks
+ * follow them on a block device (see bdev.h):
+ *   superblock | journal | i-node bitmap | i-node table | block bitmap | data blocks
+ * With an image file the mapping is a private one of the file's metadata
+ * regions, so mounting only reads the superblock (and replays the journal)
+ * and every other page faults in when first used. Changes to it never reach
+ * the file by themselves: metadata goes through the journal (see
+ * journal.h), and the data blocks are a device over the rest of the file.
+ * Directory and extent tree blocks are changed in place, so unless the
+ * device is memory they are read into v_data (a reserved region with room
+ * for every block) and stay there while allocated; their changes also only
+ * reach the file through the journal.
+ * Without an image the whole layout lives in anonymous memory, reserved but
+ * not committed, and v_data is the memory device itself: pages only take
+ * memory once written, and freed blocks give theirs back (volume_discard).
+ */
+typedef struct {
+    void *v_base;
+    size_t v_size;
+    int v_fd; // image file, -1 for in-memory volumes
+    size_t v_page_size;
+    _Atomic uint64_t *v_inode_bitmap;
+    inode_t *v_inode_table;
+    uint64_t *v_block_bitmap;
+    char *v_data;
+    size_t v_data_offset;
+    size_t v_data_size;
+    block_device_t *v_device;
+} volume_t;
+
+int volume_open(tfs_params_t *params, volume_t *volume);
+int volume_persist(volume_t *volume, void const *addr, size_t length);
+uint64_t volume_offset(volume_t const *volume, void const *addr);
+void volume_discard(volume_t *volume, size_t offset, size_t length);
+void volume_close(volume_t *volume);
+
+#endif // VOLUME_H
@@ -0,0 +1,107 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Per-file scaling benchmark (make bench). Each thread works on a file of its own, through a
+ * handle of its own: it overwrites and reads back RECORD-byte records in place and reads at
+ * the end of the file. Threads share no file, so the time they take together should stay
+ * that of one of them: whatever they still share (cache lines of neighbouring i-nodes and
+ * open file entries, table-wide locks) shows as lost efficiency.
+ * Usage: tests/bench [operations per thread]
+ */
+
+#define MAX_THREADS 8
+#define RECORD 64
+#define RECORDS 64
+#define OPS 50000
+
+static long ops = OPS;
+static int handles[MAX_THREADS];
+
+static void *worker(void *arg) {
+
+    int fh = handles[(long)arg];
+    char record[RECORD];
+    char buffer[RECORD];
+
+    memset(record, 'a' + (int)(long)arg, RECORD);
+
+    for (long i = 0; i < ops; i++) {
+        uint64_t offset = (uint64_t)(i % RECORDS) * RECORD;
+
+        assert(tfs_pwrite(fh, record, RECORD, offset) == RECORD);
+        assert(tfs_pread(fh, buffer, RECORD, offset) == RECORD);
+        assert(tfs_read(fh, buffer, RECORD) == 0);
+    }
+
+    return NULL;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+
+    if (argc > 1) {
+        ops = atol(argv[1]);
+    }
+
+    assert(ops > 0);
+    assert(tfs_init() != -1);
+
+    char record[RECORD * RECORDS];
+    memset(record, '-', sizeof(record));
+
+    /* every file gets its records before the clock starts, and every
+     * handle is left at the end of its file */
+    for (int i = 0; i < MAX_THREADS; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "/f%d", i);
+
+        handles[i] = tfs_open(path, TFS_O_CREAT);
+        assert(handles[i] != -1);
+        assert(tfs_write(handles[i], record, sizeof(record)) == sizeof(record));
+        assert(tfs_fsync(handles[i]) != -1);
+    }
+
+    double single = 0;
+
+    printf("threads  seconds  ops/s (x1000)  efficiency\n");
+
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        pthread_t tids[MAX_THREADS];
+        double start = now();
+
+        for (long i = 0; i < threads; i++) {
+            assert(pthread_create(&tids[i], NULL, worker, (void *)i) == 0);
+        }
+
+        for (int i = 0; i < threads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+
+        double elapsed = now() - start;
+        double rate = (double)threads * (double)ops * 3 / elapsed;
+
+        if (threads == 1) {
+            single = rate;
+        }
+
+        printf("%7d  %7.3f  %13.0f  %9.0f%%\n", threads, elapsed, rate / 1000, 100 * rate / (single * threads));
+    }
+
+    for (int i = 0; i < MAX_THREADS; i++) {
+        assert(tfs_close(handles[i]) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test reads large files from an image through BDEV_PREAD, with a buffer cache much smaller
+ * than the files, so read-ahead blocks must be evicted and read again as the readers move on.
+ * FILES files of SIZE bytes are written and the image is mounted again, so nothing is cached.
+ * Then N_THREADS threads read the files from start to end in CHUNK-byte reads, which do not
+ * line up with blocks, two threads per file: one leaves read-ahead to the file system, the
+ * other declares TFS_FADV_SEQUENTIAL. Each asks for the next window with TFS_FADV_WILLNEED
+ * and gives up what it has read with TFS_FADV_DONTNEED. Every byte depends on its file and
+ * its offset, so a block read ahead to the wrong place shows.
+ * Finally, each file is given up whole and read again, block by block, out of order.
+ */
+
+#define FILES 2
+#define N_THREADS (2 * FILES)
+#define SIZE (4 << 20)
+#define CHUNK 12000
+#define WINDOW (1 << 20)
+#define BLOCK 4096
+
+static char image[64];
+
+static char byte_at(int file, uint64_t offset) {
+    return (char)('a' + (offset / BLOCK * 3 + offset % 13 + (uint64_t)file * 5) % 26);
+}
+
+static void check_range(int file, uint64_t offset, char const *buffer, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        assert(buffer[i] == byte_at(file, offset + i));
+    }
+}
+
+static void path_of(int file, char *path, size_t size) { snprintf(path, size, "/big%d", file); }
+
+void *fn(void *arg) {
+
+    int thread = (int)(long)arg;
+    int file = thread % FILES;
+    char path[32];
+    char buffer[CHUNK];
+    uint64_t offset = 0;
+    uint64_t advised = 0;
+
+    path_of(file, path, sizeof(path));
+
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+
+    if (thread >= FILES) {
+        assert(tfs_fadvise(fh, 0, 0, TFS_FADV_SEQUENTIAL) != -1);
+    }
+
+    for (;;) {
+        if (offset >= advised) {
+            assert(tfs_fadvise(fh, advised, WINDOW, TFS_FADV_WILLNEED) != -1);
+
+            if (advised >= WINDOW) {
+                assert(tfs_fadvise(fh, advised - WINDOW, WINDOW, TFS_FADV_DONTNEED) != -1);
+            }
+
+            advised += WINDOW;
+        }
+
+        ssize_t got = tfs_read(fh, buffer, CHUNK);
+        assert(got >= 0);
+
+        if (got == 0) {
+            break;
+        }
+
+        check_range(file, offset, buffer, (size_t)got);
+        offset += (uint64_t)got;
+    }
+
+    assert(offset == SIZE);
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    static char contents[WINDOW];
+    char path[32];
+
+    snprintf(image, sizeof(image), "/tmp/tfs_thread_10.%ld.img", (long)getpid());
+    unlink(image);
+
+    tfs_params_t params = tfs_default_params();
+    params.block_size = BLOCK;
+    params.data_blocks = 2 * FILES * SIZE / BLOCK;
+    params.image_path = image;
+    params.backend = BDEV_PREAD;
+    params.cache_size = WINDOW;
+
+    assert(tfs_init_with_params(&params) != -1);
+
+    for (int f = 0; f < FILES; f++) {
+        path_of(f, path, sizeof(path));
+
+        int fh = tfs_open(path, TFS_O_CREAT);
+        assert(fh != -1);
+
+        for (uint64_t done = 0; done < SIZE; done += WINDOW) {
+            for (size_t i = 0; i < WINDOW; i++) {
+                contents[i] = byte_at(f, done + i);
+            }
+
+            assert(tfs_write(fh, contents, WINDOW) == WINDOW);
+        }
+
+        assert(tfs_close(fh) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+    assert(tfs_init_with_params(&params) != -1);
+
+    for (long i = 0; i < N_THREADS; i++) {
+        assert(pthread_create(&tids[i], NULL, fn, (void *)i) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int f = 0; f < FILES; f++) {
+        char block[BLOCK];
+
+        path_of(f, path, sizeof(path));
+
+        int fh = tfs_open(path, 0);
+        assert(fh != -1);
+        assert(tfs_fadvise(fh, 0, SIZE, TFS_FADV_DONTNEED) != -1);
+
+        /* a stride coprime with the number of blocks visits each once */
+        for (uint64_t i = 0, b = 0; i < SIZE / BLOCK; i++, b = (b + 97) % (SIZE / BLOCK)) {
+            assert(tfs_pread(fh, block, BLOCK, b * BLOCK) == BLOCK);
+            check_range(f, b * BLOCK, block, BLOCK);
+        }
+
+        assert(tfs_close(fh) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/*
+ * This test checks that small writes left in a file's write-back buffer reach the image on
+ * their own once they get old. A child process mounts an image and N_THREADS threads write a
+ * few small pieces each to a file of their own, which stay buffered: no handle is synced or
+ * closed. The child then sleeps well past WRITEBACK_AGE_MS and exits without tfs_destroy, so
+ * only the flusher can have written the files back.
+ * Mounting the image again, every file must hold all of its pieces.
+ */
+
+#define N_THREADS 4
+#define PIECES 5
+#define PIECE 300
+#define SIZE (PIECES * PIECE)
+
+static char image[64];
+
+static char file_char(long thread) { return (char)('a' + thread); }
+
+void *fn(void *arg) {
+
+    long thread = (long)arg;
+    char path[32];
+    char piece[PIECE];
+
+    snprintf(path, sizeof(path), "/f%ld", thread);
+    memset(piece, file_char(thread), PIECE);
+
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+
+    for (int i = 0; i < PIECES; i++) {
+        assert(tfs_write(fh, piece, PIECE) == PIECE);
+    }
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    snprintf(image, sizeof(image), "/tmp/tfs_thread_11.%ld.img", (long)getpid());
+    unlink(image);
+
+    tfs_params_t params = tfs_default_params();
+    params.block_size = 4096;
+    params.image_path = image;
+    params.backend = BDEV_PREAD;
+
+    pid_t pid = fork();
+    assert(pid != -1);
+
+    if (pid == 0) {
+        pthread_t tids[N_THREADS];
+        struct timespec age = {0, 4 * WRITEBACK_AGE_MS * 1000000L};
+
+        assert(tfs_init_with_params(&params) != -1);
+
+        for (long i = 0; i < N_THREADS; i++) {
+            assert(pthread_create(&tids[i], NULL, fn, (void *)i) == 0);
+        }
+
+        for (int i = 0; i < N_THREADS; i++) {
+            pthread_join(tids[i], NULL);
+        }
+
+        while (nanosleep(&age, &age) == -1) {
+        }
+
+        _exit(0);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(tfs_init_with_params(&params) != -1);
+
+    for (long i = 0; i < N_THREADS; i++) {
+        char path[32];
+        char buffer[SIZE + 1];
+
+        snprintf(path, sizeof(path), "/f%ld", i);
+
+        int fh = tfs_open(path, 0);
+        assert(fh != -1);
+        assert(tfs_read(fh, buffer, sizeof(buffer)) == SIZE);
+        assert(tfs_close(fh) != -1);
+
+        for (size_t j = 0; j < SIZE; j++) {
+            assert(buffer[j] == file_char(i));
+        }
+    }
+
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -11,6 +11,8 @@
  * The number of threads chosen is 2, but any other number could be chosen.
  * READ and WRITE are such huge numbers because for small "counts" there are no differences 
  * between thread-safe and not thread-safe applications/ programms. 
+ * The same threads then read halves of the file through the shared handle with tfs_pread,
+ * which must not move (nor depend on) the handle's offset.
  */
 
 #define READ 100000
@@ -39,6 +41,23 @@ void *fn(void *args) {
 
 }
 
+void *fn_pread(void *args) {
+
+    char buffer[READ / 2];
+
+    int fh = ((int *)args)[0];
+    int half = ((int *)args)[1];
+
+    assert(tfs_pread(fh, buffer, READ / 2, (uint64_t)half * (READ / 2)) == READ / 2);
+
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        assert(buffer[i] == 'V');
+    }
+
+    return (void *)NULL;
+
+}
+
 
 
 int main() {
@@ -76,6 +95,18 @@ int main() {
 
     assert(counter == READ);
 
+    int args[2][2] = {{fh, 0}, {fh, 1}};
+
+    pthread_create(&tid1, NULL, fn_pread, (void *)args[0]);
+    pthread_create(&tid2, NULL, fn_pread, (void *)args[1]);
+
+    pthread_join(tid1, NULL);
+    pthread_join(tid2, NULL);
+
+    /* the handle's offset is still at the end of the file */
+    char byte;
+    assert(tfs_read(fh, &byte, 1) == 0);
+
     pthread_mutex_destroy(&mutex);
 
     assert(tfs_close(fh) != -1);
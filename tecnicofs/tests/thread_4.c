@@ -0,0 +1,99 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * This test uses multiple threads to create and look up files inside nested directories
+ * (/d1/d2/d3). Each thread creates FILES files in the deepest directory, writes its own name
+ * to each of them and then looks up every file of every thread.
+ * The objective is to check that path resolution works for deep paths while the directories
+ * are being changed concurrently, and that misses for names that do not exist (which are
+ * cached as negative entries) do not hide files created afterwards.
+ */
+
+#define N_THREADS 4
+#define FILES 6
+
+#define DIR ("/d1/d2/d3")
+
+void *fn(void *arg) {
+
+    long id = (long)arg;
+    char path[64];
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "%s/f%ld_%d", DIR, id, i);
+
+        /* the miss is cached, the create must replace it */
+        assert(tfs_lookup(path) == -1);
+
+        int fh = tfs_open(path, TFS_O_CREAT);
+        assert(fh != -1);
+        assert(tfs_write(fh, path, strlen(path)) == (ssize_t)strlen(path));
+        assert(tfs_close(fh) != -1);
+
+        assert(tfs_lookup(path) != -1);
+    }
+
+    return (void *)NULL;
+}
+
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+    char path[64];
+    char buffer[64];
+
+    assert(tfs_init() != -1);
+
+    assert(tfs_mkdir("/d1") != -1);
+    assert(tfs_mkdir("/d1/d2") != -1);
+    assert(tfs_mkdir("/d1/d2/d3") != -1);
+
+    /* names already in use, missing parents and files as parents are refused */
+    assert(tfs_mkdir("/d1") == -1);
+    assert(tfs_mkdir("/nope/d2") == -1);
+    assert(tfs_open("/nope/f", TFS_O_CREAT) == -1);
+
+    /* directories can not be opened as files */
+    assert(tfs_open("/d1/d2", 0) == -1);
+
+    for (long i = 0; i < N_THREADS; i++) {
+        assert(pthread_create(&tids[i], NULL, fn, (void *)i) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int t = 0; t < N_THREADS; t++) {
+        for (int i = 0; i < FILES; i++) {
+            snprintf(path, sizeof(path), "%s/f%d_%d", DIR, t, i);
+            memset(buffer, '\0', sizeof(buffer));
+
+            int fh = tfs_open(path, 0);
+            assert(fh != -1);
+            assert(tfs_read(fh, buffer, sizeof(buffer)) == (ssize_t)strlen(path));
+            assert(strcmp(buffer, path) == 0);
+            assert(tfs_close(fh) != -1);
+        }
+    }
+
+    /* the same name in another directory is another file */
+    snprintf(path, sizeof(path), "/d1/f0_0");
+    assert(tfs_lookup(path) == -1);
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_lookup(path) != tfs_lookup("/d1/d2/d3/f0_0"));
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successfull test\n");
+
+    return 0;
+
+}
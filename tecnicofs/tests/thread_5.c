@@ -0,0 +1,133 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test keeps the file system in an image file. Several threads fill files in a
+ * directory, the file system is destroyed and the image is mounted again, asking for a
+ * different geometry: the image must keep its own, and every file must still be there
+ * with the same contents. Files created after the mount must not reuse i-nodes or blocks
+ * of the old ones. Each mount reaches the data blocks through a different backend.
+ * Files are written in small pieces, which are buffered: another handle must read them
+ * before they are synced.
+ */
+
+#define N_THREADS 4
+#define SIZE 5000
+
+static char contents[N_THREADS][SIZE];
+
+/* named after the process, so runs at the same time keep apart */
+static char image[64];
+
+void *fn(void *arg) {
+
+    long id = (long)arg;
+    char path[64];
+
+    snprintf(path, sizeof(path), "/dir/f%ld", id);
+    memset(contents[id], 'a' + (int)id, SIZE);
+
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+
+    for (size_t done = 0; done < SIZE; done += 100) {
+        assert(tfs_write(fh, contents[id] + done, 100) == 100);
+    }
+
+    char buffer[SIZE];
+    int reader = tfs_open(path, 0);
+    assert(reader != -1);
+    assert(tfs_read(reader, buffer, SIZE) == SIZE);
+    assert(memcmp(buffer, contents[id], SIZE) == 0);
+    assert(tfs_close(reader) != -1);
+
+    assert(tfs_fsync(fh) != -1);
+    assert(tfs_close(fh) != -1);
+
+    return (void *)NULL;
+}
+
+static void check(long id) {
+    char path[64];
+    char buffer[SIZE];
+
+    snprintf(path, sizeof(path), "/dir/f%ld", id);
+
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+    assert(tfs_fadvise(fh, 0, 0, TFS_FADV_SEQUENTIAL) != -1);
+    assert(tfs_read(fh, buffer, SIZE) == SIZE);
+    assert(memcmp(buffer, contents[id], SIZE) == 0);
+    assert(tfs_close(fh) != -1);
+}
+
+int main() {
+
+    pthread_t tids[N_THREADS];
+
+    snprintf(image, sizeof(image), "/tmp/tfs_thread_5.%ld.img", (long)getpid());
+    unlink(image);
+
+    tfs_params_t params = tfs_default_params();
+    params.block_size = 4096;
+    params.image_path = image;
+    params.backend = BDEV_PREAD;
+
+    assert(tfs_init_with_params(&params) != -1);
+    assert(tfs_mkdir("/dir") != -1);
+
+    for (long i = 0; i < N_THREADS; i++) {
+        assert(pthread_create(&tids[i], NULL, fn, (void *)i) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    /* the image keeps the geometry it was formatted with */
+    params.block_size = 1024;
+    params.backend = BDEV_DIRECT;
+    assert(tfs_init_with_params(&params) != -1);
+    assert(state_params()->block_size == 4096);
+
+    for (long i = 0; i < N_THREADS; i++) {
+        check(i);
+    }
+
+    /* a new file must not clobber the old ones */
+    int fh = tfs_open("/dir/new", TFS_O_CREAT);
+    assert(fh != -1);
+    assert(tfs_write(fh, contents[0], SIZE) == SIZE);
+    assert(tfs_close(fh) != -1);
+
+    for (long i = 0; i < N_THREADS; i++) {
+        check(i);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    params.backend = BDEV_MMAP;
+    assert(tfs_init_with_params(&params) != -1);
+
+    for (long i = 0; i < N_THREADS; i++) {
+        check(i);
+    }
+
+    fh = tfs_open("/dir/new", 0);
+    assert(fh != -1);
+    char buffer[SIZE];
+    assert(tfs_read(fh, buffer, SIZE) == SIZE);
+    assert(memcmp(buffer, contents[0], SIZE) == 0);
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_destroy() != -1);
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
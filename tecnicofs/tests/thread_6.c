@@ -0,0 +1,169 @@
+#include "operations.h"
+#include "ioring.h"
+#include <assert.h>
+#include <string.h>
+
+/*
+ * This test drives the file system from a single thread through an I/O ring served by a
+ * pool of workers. FILES files are opened in one batch, written in one batch (each file
+ * gets its own contents) and closed in one batch, then opened and read back the same way.
+ * The objective is to check that every request completes exactly once, with the result
+ * of the matching synchronous call, whatever order the workers run them in.
+ * Then every file's contents are appended to a single file at once, through a handle each,
+ * and each must end up there whole, exactly once. On an append handle, tfs_pwrite must still
+ * write at its offset, while tfs_write keeps appending.
+ * Finally, records made of a header, a payload and a trailer are written with one tfs_writev
+ * each and read back with tfs_readv into differently cut buffers.
+ */
+
+#define FILES 16
+#define WORKERS 4
+#define SIZE 3000
+
+static char contents[FILES][SIZE];
+static char buffers[FILES][SIZE];
+static char paths[FILES][32];
+static int handles[FILES];
+
+/* Submits a request for each file and reaps them all, checking the results */
+static void batch(tfs_ring_t *ring, tfs_op_t op, int flags, ssize_t expected) {
+
+    for (int i = 0; i < FILES; i++) {
+        tfs_sqe_t *sqe = tfs_ring_get_sqe(ring);
+        assert(sqe != NULL);
+
+        sqe->sqe_op = op;
+        sqe->sqe_fhandle = handles[i];
+        sqe->sqe_buffer = op == TFS_OP_WRITE ? contents[i] : buffers[i];
+        sqe->sqe_length = SIZE;
+        sqe->sqe_path = paths[i];
+        sqe->sqe_flags = flags;
+        sqe->sqe_user_data = (uint64_t)i;
+    }
+
+    /* every entry is prepared */
+    assert(tfs_ring_get_sqe(ring) == NULL);
+    assert(tfs_ring_submit(ring) == FILES);
+
+    int seen[FILES] = {0};
+    tfs_cqe_t cqe;
+
+    for (int i = 0; i < FILES; i++) {
+        assert(tfs_ring_wait_cqe(ring, &cqe) == 0);
+        assert(cqe.cqe_user_data < FILES && seen[cqe.cqe_user_data]++ == 0);
+
+        if (op == TFS_OP_OPEN) {
+            assert(cqe.cqe_result >= 0);
+            handles[cqe.cqe_user_data] = (int)cqe.cqe_result;
+        } else {
+            assert(cqe.cqe_result == expected);
+        }
+    }
+
+    /* nothing left in flight */
+    assert(tfs_ring_peek_cqe(ring, &cqe) == -1);
+    assert(tfs_ring_wait_cqe(ring, &cqe) == -1);
+}
+
+int main() {
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/f%d", i);
+        memset(contents[i], 'A' + i, SIZE);
+    }
+
+    tfs_ring_t *ring = tfs_ring_create(FILES, WORKERS);
+    assert(ring != NULL);
+
+    batch(ring, TFS_OP_OPEN, TFS_O_CREAT, 0);
+    batch(ring, TFS_OP_WRITE, 0, SIZE);
+    batch(ring, TFS_OP_CLOSE, 0, 0);
+
+    batch(ring, TFS_OP_OPEN, 0, 0);
+    batch(ring, TFS_OP_READ, 0, SIZE);
+    batch(ring, TFS_OP_CLOSE, 0, 0);
+
+    for (int i = 0; i < FILES; i++) {
+        assert(memcmp(buffers[i], contents[i], SIZE) == 0);
+    }
+
+    /* concurrent appenders on one file */
+    for (int i = 0; i < FILES; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/log");
+    }
+
+    batch(ring, TFS_OP_OPEN, TFS_O_CREAT | TFS_O_APPEND, 0);
+    batch(ring, TFS_OP_WRITE, 0, SIZE);
+    batch(ring, TFS_OP_CLOSE, 0, 0);
+
+    tfs_ring_destroy(ring);
+
+    int fh = tfs_open("/log", 0);
+    assert(fh != -1);
+
+    int appended[FILES] = {0};
+
+    for (int i = 0; i < FILES; i++) {
+        assert(tfs_read(fh, buffers[i], SIZE) == SIZE);
+
+        int owner = buffers[i][0] - 'A';
+        assert(owner >= 0 && owner < FILES && appended[owner]++ == 0);
+        assert(memcmp(buffers[i], contents[owner], SIZE) == 0);
+    }
+
+    assert(tfs_read(fh, buffers[0], SIZE) == 0);
+    assert(tfs_close(fh) != -1);
+
+    /* positioned writes ignore append mode */
+    fh = tfs_open("/log", TFS_O_APPEND);
+    assert(fh != -1);
+    assert(tfs_pwrite(fh, contents[0], SIZE, SIZE) == SIZE);
+    assert(tfs_write(fh, contents[1], SIZE) == SIZE);
+    assert(tfs_close(fh) != -1);
+
+    fh = tfs_open("/log", 0);
+    assert(fh != -1);
+    assert(tfs_pread(fh, buffers[0], SIZE, SIZE) == SIZE);
+    assert(memcmp(buffers[0], contents[0], SIZE) == 0);
+    assert(tfs_pread(fh, buffers[1], SIZE, FILES * SIZE) == SIZE);
+    assert(memcmp(buffers[1], contents[1], SIZE) == 0);
+    assert(tfs_pread(fh, buffers[2], SIZE, (FILES + 1) * SIZE) == 0);
+    assert(tfs_close(fh) != -1);
+
+    /* vectored I/O: FILES records of 4 + SIZE + 4 bytes */
+    char header[4] = "HEAD";
+    char trailer[4] = "TAIL";
+    fh = tfs_open("/records", TFS_O_CREAT);
+    assert(fh != -1);
+
+    for (int i = 0; i < FILES; i++) {
+        struct iovec record[3] = {{header, 4}, {contents[i], SIZE}, {trailer, 4}};
+        assert(tfs_writev(fh, record, 3) == SIZE + 8);
+    }
+
+    assert(tfs_close(fh) != -1);
+
+    fh = tfs_open("/records", 0);
+    assert(fh != -1);
+
+    for (int i = 0; i < FILES; i++) {
+        char head[8];
+        struct iovec record[3] = {{head, 8}, {buffers[i], SIZE - 4}, {head + 4, 4}};
+        assert(tfs_readv(fh, record, 3) == SIZE + 8);
+        assert(memcmp(head, "HEAD", 4) == 0 && memcmp(head + 4, "TAIL", 4) == 0);
+        memmove(buffers[i] + 4, buffers[i], SIZE - 4);
+        memset(buffers[i], 'A' + i, 4);
+        assert(memcmp(buffers[i], contents[i], SIZE) == 0);
+    }
+
+    assert(tfs_readv(fh, (struct iovec[]){{buffers[0], SIZE}}, 1) == 0);
+    assert(tfs_close(fh) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
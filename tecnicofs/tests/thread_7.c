@@ -0,0 +1,271 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * This test uses multiple threads to write inside the same file at once, each one through a
+ * handle of its own. The file is written and synced first, so every write lands on stored data
+ * and runs under the shared i-node lock, holding only the bytes it writes.
+ * Thread i owns every N_THREADS-th slice of the file; slices are SLICE bytes long, so neighbouring
+ * threads keep writing to the same blocks. Each thread writes its slices ROUNDS times, with a
+ * different character each round, while N_READERS threads read whole slices
+ * back, each of which must hold a single character.
+ * The objective is to check, byte by byte, that every slice ends up holding the last character
+ * its owner wrote, with nothing lost or spilled over from a neighbour.
+ * Then writes that grow a file, which the threads hand to a single one of them to apply
+ * (write combining), are checked the same way: first N_THREADS threads write RECORDS records
+ * each through one shared handle, and every record must be there whole, exactly once, with
+ * the file exactly as long as all of them; then each thread writes its own records past the
+ * end of a new file through a handle of its own, at interleaved places.
+ */
+
+#define N_THREADS 8
+#define SLICE 100
+#define SLICES 640
+#define ROUNDS 4
+#define N_READERS 2
+#define SIZE (SLICE * SLICES)
+#define RECORD 512
+#define RECORDS 64
+#define GROWN (N_THREADS * RECORDS * RECORD)
+
+static int handles[N_THREADS];
+static int reader_handles[N_READERS];
+static int shared_fh;
+static char contents[SIZE];
+static char grown[GROWN];
+
+static char slice_char(int thread, int round) {
+    return (char)('A' + thread * ROUNDS + round);
+}
+
+void *fn(void *arg) {
+
+    int thread = (int)(long)arg;
+    char slice[SLICE];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        memset(slice, slice_char(thread, round), SLICE);
+
+        for (int i = thread; i < SLICES; i += N_THREADS) {
+            assert(tfs_pwrite(handles[thread], slice, SLICE, (uint64_t)i * SLICE) == SLICE);
+        }
+    }
+
+    return (void *)NULL;
+}
+
+void *fn_read(void *arg) {
+
+    int reader = (int)(long)arg;
+    char slice[SLICE];
+
+    for (int i = reader; i < SLICES * ROUNDS; i += N_READERS) {
+        assert(tfs_pread(reader_handles[reader], slice, SLICE, (uint64_t)(i % SLICES) * SLICE) == SLICE);
+
+        for (int j = 1; j < SLICE; j++) {
+            assert(slice[j] == slice[0]);
+        }
+    }
+
+    return (void *)NULL;
+}
+
+void *fn_shared(void *arg) {
+
+    char record[RECORD];
+
+    memset(record, 'a' + (int)(long)arg, RECORD);
+
+    for (int i = 0; i < RECORDS; i++) {
+        assert(tfs_write(shared_fh, record, RECORD) == RECORD);
+    }
+
+    return (void *)NULL;
+}
+
+void *fn_grow(void *arg) {
+
+    int thread = (int)(long)arg;
+    char record[RECORD];
+
+    memset(record, 'a' + thread, RECORD);
+
+    for (int i = 0; i < RECORDS; i++) {
+        uint64_t offset = ((uint64_t)i * N_THREADS + (uint64_t)thread) * RECORD;
+        assert(tfs_pwrite(handles[thread], record, RECORD, offset) == RECORD);
+    }
+
+    return (void *)NULL;
+}
+
+/* Every record of the shared handle's file is whole, and each thread wrote RECORDS of them */
+int check_shared() {
+
+    int count[N_THREADS];
+
+    memset(count, 0, sizeof(count));
+
+    for (int r = 0; r < N_THREADS * RECORDS; r++) {
+        char const *record = grown + r * RECORD;
+        int thread = record[0] - 'a';
+
+        if (thread < 0 || thread >= N_THREADS) {
+            return -1;
+        }
+
+        for (int i = 1; i < RECORD; i++) {
+            if (record[i] != record[0]) {
+                return -1;
+            }
+        }
+
+        count[thread]++;
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        if (count[i] != RECORDS) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Record r of the grown file was written by thread r % N_THREADS */
+int check_grown() {
+
+    for (int i = 0; i < GROWN; i++) {
+        if (grown[i] != 'a' + (i / RECORD) % N_THREADS) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int check() {
+
+    for (int i = 0; i < SIZE; i++) {
+        if (contents[i] != slice_char((i / SLICE) % N_THREADS, ROUNDS - 1)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+
+    char *path = "/f7";
+
+    pthread_t tids[N_THREADS];
+    pthread_t readers[N_READERS];
+
+    assert(tfs_init() != -1);
+
+    int fh = tfs_open(path, TFS_O_CREAT);
+    assert(fh != -1);
+
+    memset(contents, '-', sizeof(contents));
+    assert(tfs_write(fh, contents, SIZE) == SIZE);
+    assert(tfs_fsync(fh) != -1);
+    assert(tfs_close(fh) != -1);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        handles[i] = tfs_open(path, 0);
+        assert(handles[i] != -1);
+    }
+
+    for (int i = 0; i < N_READERS; i++) {
+        reader_handles[i] = tfs_open(path, 0);
+        assert(reader_handles[i] != -1);
+    }
+
+    for (long i = 0; i < N_THREADS; i++) {
+        assert(pthread_create(&tids[i], NULL, fn, (void *)i) == 0);
+    }
+
+    for (long i = 0; i < N_READERS; i++) {
+        assert(pthread_create(&readers[i], NULL, fn_read, (void *)i) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < N_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(tfs_close(handles[i]) != -1);
+    }
+
+    for (int i = 0; i < N_READERS; i++) {
+        assert(tfs_close(reader_handles[i]) != -1);
+    }
+
+    memset(contents, '\0', sizeof(contents));
+
+    fh = tfs_open(path, 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, contents, SIZE + 1) == SIZE);
+    assert(tfs_close(fh) != -1);
+
+    assert(check() == 0);
+
+    shared_fh = tfs_open("/f8", TFS_O_CREAT);
+    assert(shared_fh != -1);
+
+    for (long i = 0; i < N_THREADS; i++) {
+        assert(pthread_create(&tids[i], NULL, fn_shared, (void *)i) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    assert(tfs_close(shared_fh) != -1);
+
+    memset(grown, '\0', sizeof(grown));
+
+    fh = tfs_open("/f8", 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, grown, GROWN) == GROWN);
+    assert(tfs_read(fh, contents, 1) == 0);
+    assert(tfs_close(fh) != -1);
+
+    assert(check_shared() == 0);
+
+    for (int i = 0; i < N_THREADS; i++) {
+        handles[i] = tfs_open("/f9", TFS_O_CREAT);
+        assert(handles[i] != -1);
+    }
+
+    for (long i = 0; i < N_THREADS; i++) {
+        assert(pthread_create(&tids[i], NULL, fn_grow, (void *)i) == 0);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < N_THREADS; i++) {
+        assert(tfs_close(handles[i]) != -1);
+    }
+
+    memset(grown, '\0', sizeof(grown));
+
+    fh = tfs_open("/f9", 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, grown, GROWN) == GROWN);
+    assert(tfs_read(fh, contents, 1) == 0);
+    assert(tfs_close(fh) != -1);
+
+    assert(check_grown() == 0);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
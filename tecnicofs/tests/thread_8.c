@@ -0,0 +1,167 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+/*
+ * This test stops the file system the way a crash would: a child process fills an image and
+ * exits without tfs_destroy, so no checkpoint ever writes the metadata to its home location
+ * and only the journal holds it. N_THREADS threads create FILES files each in a directory of
+ * their own, write them in pieces and sync them; every third file is then truncated and
+ * written again, shorter, and synced again.
+ * Mounting the image replays the journal: every file must be there with the contents it was
+ * last synced with, and a truncated file must hold nothing of what it held before. A file
+ * created after the mount must not clobber the old ones, which must survive a clean unmount
+ * too. This is done once for each backend.
+ */
+
+#define N_THREADS 4
+#define FILES 8
+#define PIECE 1000
+#define SIZE (14 * PIECE)
+#define SHORT (3 * PIECE)
+
+static char image[64];
+
+static char file_char(long thread, int file, bool truncated) {
+    return (char)((truncated ? 'A' : 'a') + (thread * FILES + file) % 26);
+}
+
+static bool is_truncated(int file) { return file % 3 == 0; }
+
+static void write_file(int fh, char c, size_t size) {
+    char piece[PIECE];
+
+    memset(piece, c, PIECE);
+
+    for (size_t done = 0; done < size; done += PIECE) {
+        assert(tfs_write(fh, piece, PIECE) == PIECE);
+    }
+
+    assert(tfs_fsync(fh) != -1);
+}
+
+void *fn(void *arg) {
+
+    long thread = (long)arg;
+    char path[64];
+
+    snprintf(path, sizeof(path), "/d%ld", thread);
+    assert(tfs_mkdir(path) != -1);
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/d%ld/f%d", thread, i);
+
+        int fh = tfs_open(path, TFS_O_CREAT);
+        assert(fh != -1);
+        write_file(fh, file_char(thread, i, false), SIZE);
+        assert(tfs_close(fh) != -1);
+    }
+
+    for (int i = 0; i < FILES; i += 3) {
+        snprintf(path, sizeof(path), "/d%ld/f%d", thread, i);
+
+        int fh = tfs_open(path, TFS_O_TRUNC);
+        assert(fh != -1);
+        write_file(fh, file_char(thread, i, true), SHORT);
+        assert(tfs_close(fh) != -1);
+    }
+
+    return (void *)NULL;
+}
+
+static void check() {
+
+    char path[64];
+    char buffer[SIZE + 1];
+
+    for (long thread = 0; thread < N_THREADS; thread++) {
+        for (int i = 0; i < FILES; i++) {
+            size_t size = is_truncated(i) ? SHORT : SIZE;
+            char c = file_char(thread, i, is_truncated(i));
+
+            snprintf(path, sizeof(path), "/d%ld/f%d", thread, i);
+
+            int fh = tfs_open(path, 0);
+            assert(fh != -1);
+            assert(tfs_read(fh, buffer, sizeof(buffer)) == size);
+            assert(tfs_close(fh) != -1);
+
+            for (size_t j = 0; j < size; j++) {
+                assert(buffer[j] == c);
+            }
+        }
+    }
+}
+
+/* Fills an image in a child process that exits without unmounting it */
+static void crash(tfs_params_t const *params) {
+
+    pid_t pid = fork();
+    assert(pid != -1);
+
+    if (pid == 0) {
+        pthread_t tids[N_THREADS];
+
+        assert(tfs_init_with_params(params) != -1);
+
+        for (long i = 0; i < N_THREADS; i++) {
+            assert(pthread_create(&tids[i], NULL, fn, (void *)i) == 0);
+        }
+
+        for (int i = 0; i < N_THREADS; i++) {
+            pthread_join(tids[i], NULL);
+        }
+
+        _exit(0);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main() {
+
+    bdev_type_t backends[] = {BDEV_PREAD, BDEV_MMAP, BDEV_DIRECT};
+
+    snprintf(image, sizeof(image), "/tmp/tfs_thread_8.%ld.img", (long)getpid());
+
+    tfs_params_t params = tfs_default_params();
+    params.block_size = 4096;
+    params.data_blocks = 1024;
+    params.image_path = image;
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        params.backend = backends[b];
+
+        unlink(image);
+        crash(&params);
+
+        assert(tfs_init_with_params(&params) != -1);
+        check();
+
+        /* a new file must not clobber the old ones */
+        char contents[SIZE];
+        memset(contents, '-', SIZE);
+
+        int fh = tfs_open("/new", TFS_O_CREAT);
+        assert(fh != -1);
+        assert(tfs_write(fh, contents, SIZE) == SIZE);
+        assert(tfs_close(fh) != -1);
+
+        check();
+        assert(tfs_destroy() != -1);
+
+        assert(tfs_init_with_params(&params) != -1);
+        check();
+        assert(tfs_destroy() != -1);
+    }
+
+    unlink(image);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
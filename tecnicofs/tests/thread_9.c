@@ -0,0 +1,154 @@
+#include "operations.h"
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * This test fragments files on purpose: FILES files are written one block at a time, taking
+ * turns, and each block is synced before the next file writes, so neighbouring blocks of a
+ * file end up apart on the volume. Every block is its own extent, far more than the
+ * INODE_EXTENTS the i-node holds, so the files' block maps must grow into extent trees.
+ * The files are read back whole and block by block at scattered offsets. Then every other
+ * file is truncated and fragmented again, with other contents, while N_READERS threads keep
+ * reading the files left alone: the truncated files must hold their new contents only, and
+ * the others must never change.
+ */
+
+#define FILES 4
+#define BLOCKS 120
+#define N_READERS 2
+
+static size_t block_size;
+static char paths[FILES][32];
+static atomic_bool rewriting;
+
+static char block_char(int file, int block, bool rewritten) {
+    return (char)((rewritten ? 'A' : 'a') + (file * 7 + block) % 26);
+}
+
+static bool is_rewritten(int file) { return file % 2 == 0; }
+
+/* Writes the files given by the mask one block at a time, syncing each block */
+static void fragment(int mask, bool rewritten) {
+
+    int handles[FILES];
+    char block[block_size];
+
+    for (int f = 0; f < FILES; f++) {
+        if (mask & (1 << f)) {
+            handles[f] = tfs_open(paths[f], TFS_O_CREAT | TFS_O_TRUNC);
+            assert(handles[f] != -1);
+        }
+    }
+
+    for (int b = 0; b < BLOCKS; b++) {
+        for (int f = 0; f < FILES; f++) {
+            if (mask & (1 << f)) {
+                memset(block, block_char(f, b, rewritten), block_size);
+                assert(tfs_write(handles[f], block, block_size) == block_size);
+                assert(tfs_fsync(handles[f]) != -1);
+            }
+        }
+    }
+
+    for (int f = 0; f < FILES; f++) {
+        if (mask & (1 << f)) {
+            assert(tfs_close(handles[f]) != -1);
+        }
+    }
+}
+
+/* Checks a file whole, through its offset, and block by block, through tfs_pread */
+static void check(int file, bool rewritten) {
+
+    char contents[BLOCKS * block_size + 1];
+    char block[block_size];
+
+    int fh = tfs_open(paths[file], 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, contents, sizeof(contents)) == BLOCKS * block_size);
+
+    for (size_t i = 0; i < BLOCKS * block_size; i++) {
+        assert(contents[i] == block_char(file, (int)(i / block_size), rewritten));
+    }
+
+    /* a stride coprime with BLOCKS visits every block once, out of order */
+    for (int i = 0, b = 0; i < BLOCKS; i++, b = (b + 37) % BLOCKS) {
+        assert(tfs_pread(fh, block, block_size, (uint64_t)b * block_size) == block_size);
+
+        for (size_t j = 0; j < block_size; j++) {
+            assert(block[j] == block_char(file, b, rewritten));
+        }
+    }
+
+    assert(tfs_close(fh) != -1);
+}
+
+void *fn_read(void *arg) {
+
+    (void)arg;
+
+    do {
+        for (int f = 0; f < FILES; f++) {
+            if (!is_rewritten(f)) {
+                check(f, false);
+            }
+        }
+    } while (atomic_load(&rewriting));
+
+    return (void *)NULL;
+}
+
+int main() {
+
+    pthread_t readers[N_READERS];
+
+    assert(tfs_init() != -1);
+    block_size = state_params()->block_size;
+
+    for (int f = 0; f < FILES; f++) {
+        snprintf(paths[f], sizeof(paths[f]), "/f%d", f);
+    }
+
+    fragment((1 << FILES) - 1, false);
+
+    for (int f = 0; f < FILES; f++) {
+        inode_t *inode = inode_get(tfs_lookup(paths[f]));
+        assert(inode != NULL && inode->i_tree_depth > 0);
+        check(f, false);
+    }
+
+    atomic_store(&rewriting, true);
+
+    for (long i = 0; i < N_READERS; i++) {
+        assert(pthread_create(&readers[i], NULL, fn_read, (void *)i) == 0);
+    }
+
+    int mask = 0;
+
+    for (int f = 0; f < FILES; f++) {
+        if (is_rewritten(f)) {
+            mask |= 1 << f;
+        }
+    }
+
+    fragment(mask, true);
+    atomic_store(&rewriting, false);
+
+    for (int i = 0; i < N_READERS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    for (int f = 0; f < FILES; f++) {
+        inode_t *inode = inode_get(tfs_lookup(paths[f]));
+        assert(inode != NULL && inode->i_tree_depth > 0);
+        check(f, is_rewritten(f));
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}